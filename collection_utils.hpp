@@ -7,7 +7,42 @@
 #include <algorithm>
 #include <set>
 #include <unordered_set>
+#include <unordered_map>
 #include <optional>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <limits>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <array>
+#include <utility>
+#include <iterator>
+#include <type_traits>
+#include <initializer_list>
+#include <new>
+#include <variant>
+#include <atomic>
+#include <future>
+#include <memory>
+#include <map>
+#include <tuple>
+#include <cmath>
+#include <thread>
+#include <chrono>
+#include <exception>
+#include <system_error>
+#if __has_include(<bit>)
+#include <bit>
+#endif
+#if __has_include(<span>)
+#include <span>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 namespace collection_utils {
 
@@ -16,27 +51,36 @@ namespace collection_utils {
 /**
  * @brief Check if any element in the container evaluates to true.
  *
- * Elements are cast to bool before evaluation.
+ * Elements are cast to bool before evaluation. Usable in constant expressions, e.g. on a constexpr std::array.
  *
  * @tparam Container Type of container supporting begin() and end().
  * @param c Container to check.
  * @return true if at least one element is truthy, false otherwise.
  */
-template <typename Container> bool any_of(const Container &c) {
-    return std::any_of(c.begin(), c.end(), [](auto v) { return static_cast<bool>(v); });
+template <typename Container> constexpr bool any_of(const Container &c) {
+    // NOTE: a plain loop instead of std::any_of so this stays usable in constant expressions before c++20
+    for (const auto &v : c) {
+        if (static_cast<bool>(v))
+            return true;
+    }
+    return false;
 }
 
 /**
  * @brief Check if all elements in the container evaluate to true.
  *
- * Elements are cast to bool before evaluation.
+ * Elements are cast to bool before evaluation. Usable in constant expressions, e.g. on a constexpr std::array.
  *
  * @tparam Container Type of container supporting begin() and end().
  * @param c Container to check.
  * @return true if all elements are truthy, false otherwise.
  */
-template <typename Container> bool all_of(const Container &c) {
-    return std::all_of(c.begin(), c.end(), [](auto v) { return static_cast<bool>(v); });
+template <typename Container> constexpr bool all_of(const Container &c) {
+    for (const auto &v : c) {
+        if (!static_cast<bool>(v))
+            return false;
+    }
+    return true;
 }
 
 // endfold
@@ -60,7 +104,10 @@ template <typename Container> bool all_of(const Container &c) {
  * // removed == true, data now contains only {2, "two"}
  * @endcode
  */
-template <typename MapLike, typename Key> bool erase(MapLike &map, const Key &key) {
+template <typename MapLike, typename Key,
+          typename = decltype(std::declval<MapLike &>().erase(
+              std::declval<MapLike &>().find(std::declval<const Key &>())))>
+bool erase(MapLike &map, const Key &key) {
     if (auto it = map.find(key); it != map.end()) {
         map.erase(it);
         return true;
@@ -76,7 +123,10 @@ template <typename MapLike, typename Key> bool erase(MapLike &map, const Key &ke
  * @param key The key to search for.
  * @return true if the key exists in the map, false otherwise.
  */
-template <typename Map> bool contains_key(const Map &map, const typename Map::key_type &key) {
+template <typename Map,
+          typename = decltype(std::declval<const Map &>().find(std::declval<const typename Map::key_type &>()) !=
+                              std::declval<const Map &>().end())>
+bool contains_key(const Map &map, const typename Map::key_type &key) {
     return map.find(key) != map.end();
 }
 
@@ -88,7 +138,10 @@ template <typename Map> bool contains_key(const Map &map, const typename Map::ke
  * @param key The key to check for absence.
  * @return true if the key does NOT exist in the map, false otherwise.
  */
-template <typename Map> bool does_not_contain_key(const Map &map, const typename Map::key_type &key) {
+template <typename Map,
+          typename = decltype(std::declval<const Map &>().find(std::declval<const typename Map::key_type &>()) ==
+                              std::declval<const Map &>().end())>
+bool does_not_contain_key(const Map &map, const typename Map::key_type &key) {
     return map.find(key) == map.end();
 }
 
@@ -106,7 +159,10 @@ template <typename Map> bool does_not_contain_key(const Map &map, const typename
  *         - Contains a const reference to the value if the key exists.
  *         - `std::nullopt` if the key is not found.
  */
-template <typename Map, typename Key>
+template <typename Map, typename Key,
+          typename = decltype(std::declval<const Map &>().find(std::declval<const Key &>())->second,
+                              std::declval<const Map &>().find(std::declval<const Key &>()) !=
+                                  std::declval<const Map &>().end())>
 std::optional<std::reference_wrapper<const typename Map::mapped_type>> at_optional(const Map &map, const Key &key) {
     auto it = map.find(key);
     if (it != map.end())
@@ -128,7 +184,10 @@ std::optional<std::reference_wrapper<const typename Map::mapped_type>> at_option
  *         - Contains a mutable reference to the value if the key exists.
  *         - `std::nullopt` if the key is not found.
  */
-template <typename Map, typename Key>
+template <typename Map, typename Key,
+          typename = decltype(std::declval<Map &>().find(std::declval<const Key &>())->second,
+                              std::declval<Map &>().find(std::declval<const Key &>()) !=
+                                  std::declval<Map &>().end())>
 std::optional<std::reference_wrapper<typename Map::mapped_type>> at_optional(Map &map, const Key &key) {
     auto it = map.find(key);
     if (it != map.end())
@@ -252,412 +311,8703 @@ template <typename T, typename Func> auto map_vector(const std::vector<T> &vec,
 }
 // endfold
 
-// startfold unordered maps
+// startfold fixed size arrays
 
 /**
- * @brief Inverts a mapping from key to value into a hash map of value to key.
- *
- * This function creates a new `std::unordered_map` whose keys are the values
- * of the input associative container and whose mapped values are the original
- * keys. This is useful when performing a reverse lookup.
+ * @brief Check if a value exists in a std::array.
  *
- * @tparam Map An associative container type providing `key_type`,
- *             `mapped_type`, and iteration over `std::pair<const key_type, mapped_type>`.
+ * @tparam T Type of elements in the array.
+ * @tparam N Number of elements in the array.
+ * @param arr The array to search within.
+ * @param value The value to search for.
+ * @return true if the value exists in the array, false otherwise.
+ */
+template <typename T, std::size_t N> constexpr bool contains(const std::array<T, N> &arr, const T &value) {
+    for (const auto &elem : arr) {
+        if (elem == value)
+            return true;
+    }
+    return false;
+}
+
+namespace detail {
+template <typename T, std::size_t N, typename Func, std::size_t... I>
+constexpr auto map_array_impl(const std::array<T, N> &arr, Func &func, std::index_sequence<I...>) {
+    using U = decltype(func(std::declval<const T &>()));
+    return std::array<U, N>{{func(arr[I])...}};
+}
+
+template <typename T, std::size_t N, std::size_t M, std::size_t... I, std::size_t... J>
+constexpr std::array<T, N + M> join_arrays_impl(const std::array<T, N> &a1, const std::array<T, M> &a2,
+                                                 std::index_sequence<I...>, std::index_sequence<J...>) {
+    return std::array<T, N + M>{{a1[I]..., a2[J]...}};
+}
+} // namespace detail
+
+/**
+ * @brief Transform a std::array by applying a function to each element.
  *
- * @param m The input map to invert.
+ * The result is built directly from the function results, so the output type does not need to be default
+ * constructible, and nothing is heap allocated. If func is constexpr the whole table can be built at compile time.
  *
- * @return std::unordered_map<Map::mapped_type, Map::key_type>
- *         A new unordered map containing reversed key/value pairs.
+ * @tparam T Type of input elements.
+ * @tparam N Number of elements.
+ * @tparam Func Type of the function to apply. Must be callable with const T&.
+ * @param arr Input array.
+ * @param func Function to apply to each element.
+ * @return std::array<U, N> where U is the return type of func.
  *
- * @note If the input container contains duplicate values, only one of the
- *       corresponding keys will be preserved in the resulting unordered map.
- *       The specific key that remains depends on hash bucket insertion order.
+ * @example
+ * @code
+ * constexpr std::array<int, 3> ids = {1, 2, 3};
+ * constexpr auto squares = map_vector(ids, [](int x) { return x * x; }); // std::array<int, 3>{1, 4, 9}
+ * @endcode
  */
-template <typename Map> std::unordered_map<typename Map::mapped_type, typename Map::key_type> invert(const Map &m) {
-    std::unordered_map<typename Map::mapped_type, typename Map::key_type> result;
-    for (const auto &kv : m)
-        result.emplace(kv.second, kv.first);
-    return result;
+template <typename T, std::size_t N, typename Func> constexpr auto map_vector(const std::array<T, N> &arr, Func func) {
+    return detail::map_array_impl(arr, func, std::make_index_sequence<N>{});
 }
 
-/*
- * @brief Apply a function to each key in a modifiable unordered map.
+/**
+ * @brief Concatenate two std::arrays into an array whose size is known at compile time.
  *
- * @tparam K Type of keys in the map.
- * @tparam V Type of values in the map.
- * @tparam Func Type of the function to apply. Must be callable with K&.
- * @param map The unordered map whose keys will be processed.
- * @param func Function to apply to each key.
+ * @tparam T Type of elements in the arrays.
+ * @tparam N Size of the first array.
+ * @tparam M Size of the second array.
+ * @param a1 First array.
+ * @param a2 Second array.
+ * @return std::array<T, N + M> containing all elements of a1 followed by all elements of a2.
  */
-template <typename K, typename V, typename Func> void for_each_key_in_map(std::unordered_map<K, V> &map, Func func) {
-    for (auto &pair : map) {
-        func(pair.first);
-    }
+template <typename T, std::size_t N, std::size_t M>
+constexpr std::array<T, N + M> join_vectors(const std::array<T, N> &a1, const std::array<T, M> &a2) {
+    return detail::join_arrays_impl(a1, a2, std::make_index_sequence<N>{}, std::make_index_sequence<M>{});
 }
 
 /**
- * @brief Apply a function to each value in a modifiable unordered map.
+ * @brief Computes the intersection of two sorted std::arrays without allocating.
  *
- * @note the values are iterated over by reference, and passed ot the function by reference or not depending on the
- * siganture of the lambda that comes in
+ * Since the size of the intersection is only known once it has been computed, the result is returned in an array
+ * sized for the worst case together with the number of slots actually used.
  *
- * @tparam K Type of keys in the map.
- * @tparam V Type of values in the map.
- * @tparam Func Type of the function to apply. Must be callable with V&.
- * @param map The unordered map whose values will be processed.
- * @param func Function to apply to each value.
+ * @tparam T Type of elements, must be default constructible and support operator<.
+ * @tparam N Size of the first array.
+ * @tparam M Size of the second array.
+ * @param a First array, sorted ascending.
+ * @param b Second array, sorted ascending.
+ * @return std::pair<std::array<T, min(N, M)>, std::size_t> The common elements in ascending order, followed by the
+ *         count of valid elements. Slots past the count are default constructed.
+ *
+ * @note The behavior is unspecified if either input is not sorted.
  */
-template <typename K, typename V, typename Func> void for_each_value_in_map(std::unordered_map<K, V> &map, Func func) {
-    for (auto &pair : map) {
-        func(pair.second);
+template <typename T, std::size_t N, std::size_t M>
+constexpr std::pair<std::array<T, (N < M ? N : M)>, std::size_t> sorted_set_intersection(const std::array<T, N> &a,
+                                                                                          const std::array<T, M> &b) {
+    std::array<T, (N < M ? N : M)> result{};
+    std::size_t count = 0, i = 0, j = 0;
+    while (i < N && j < M) {
+        if (a[i] < b[j]) {
+            ++i;
+        } else if (b[j] < a[i]) {
+            ++j;
+        } else {
+            result[count++] = a[i];
+            ++i;
+            ++j;
+        }
     }
+    return {result, count};
 }
 
+#if defined(__cpp_lib_span)
+
 /**
- * @brief Apply a function to each key-value pair of a modifiable unordered_map.
+ * @brief Check if a value exists in a std::span.
  *
- * @tparam Key Type of the keys in the unordered_map.
- * @tparam Value Type of the values in the unordered_map.
- * @tparam Func Type of the function to apply. Must be callable with (Key&, Value&).
- * @param map The unordered_map to process.
- * @param func Function to apply to each key-value pair.
+ * Lets the same lookup run over any contiguous storage (C arrays, static tables, a slice of a buffer) without
+ * copying it into a vector first. The span is deduced, so pass one explicitly, e.g. `contains(std::span(table), x)`;
+ * std::vector and std::array arguments pick their own overloads instead.
+ *
+ * @tparam T Type of elements viewed by the span.
+ * @tparam Extent Static extent of the span, or std::dynamic_extent.
+ * @param view The span to search within.
+ * @param value The value to search for.
+ * @return true if the value exists in the span, false otherwise.
  */
-template <typename Key, typename Value, typename Func>
-void for_each_pair_in_map(std::unordered_map<Key, Value> &map, Func func) {
-    for (auto &pair : map) {
-        func(pair.first, pair.second);
+template <typename T, std::size_t Extent>
+constexpr bool contains(std::span<T, Extent> view, const std::remove_cv_t<T> &value) {
+    for (const auto &elem : view) {
+        if (elem == value)
+            return true;
     }
+    return false;
 }
 
 /**
- * @brief Transform the values of an unordered_map by applying a function to each value.
+ * @brief Transform a fixed extent std::span into a std::array by applying a function to each element.
  *
- * @tparam K Type of the keys in the map.
- * @tparam V Type of the input values in the map.
- * @tparam Func Type of the function to apply. Must be callable with const V&.
- * @param input_map Input unordered_map.
- * @param func Function to apply to each value.
- * @return A new unordered_map with the same keys and transformed values.
+ * @tparam T Type of elements viewed by the span.
+ * @tparam N Static extent of the span.
+ * @tparam Func Type of the function to apply. Must be callable with const T&.
+ * @param view Input span.
+ * @param func Function to apply to each element.
+ * @return std::array<U, N> where U is the return type of func.
  */
-template <typename Map, typename Func> auto map_values(const Map &input_map, Func func) {
-    using KeyType = typename Map::key_type;
-    using ValueType = decltype(func(std::declval<typename Map::mapped_type>()));
+template <typename T, std::size_t N, typename Func>
+    requires(N != std::dynamic_extent)
+constexpr auto map_vector(std::span<T, N> view, Func func) {
+    return [&]<std::size_t... I>(std::index_sequence<I...>) {
+        using U = decltype(func(std::declval<const T &>()));
+        return std::array<U, N>{{func(view[I])...}};
+    }(std::make_index_sequence<N>{});
+}
 
-    std::unordered_map<KeyType, ValueType> result;
-    result.reserve(input_map.size());
+#endif
 
-    for (const auto &[key, value] : input_map) {
-        // NOTE: move is fine here because func(value) is a temporary that's about to go out of scope
-        // the reason why we prefer move is that if the result is not copy constructible we get errors from this
-        result.emplace(key, std::move(func(value)));
-    }
-    return result;
-}
+// endfold
+
+// startfold static vector
 
 /**
- * @brief Transform the entries (key-value pairs) of an unordered_map by applying a function to each pair.
+ * @brief A vector with a compile-time capacity whose elements live inline, so it never touches the heap.
  *
- * @tparam K Type of the keys in the input map.
- * @tparam V Type of the values in the input map.
- * @tparam Func Type of the function to apply. Must be callable with (const K&, const V&) and return std::pair<K2, V2>.
- * @param input_map Input unordered_map.
- * @param func Function to apply to each key-value pair.
- * @return A new unordered_map with transformed keys and values.
+ * Meant for real-time code paths (audio, physics) where allocation is forbidden. Elements are constructed in place
+ * in an internal buffer; going past the capacity throws instead of reallocating.
+ *
+ * @tparam T Type of the elements.
+ * @tparam N Maximum number of elements.
+ *
+ * @example
+ * @code
+ * static_vector<int, 4> a = {1, 2};
+ * static_vector<int, 8> b = {3};
+ * auto c = join_vectors(a, b); // static_vector<int, 12>{1, 2, 3}, no allocation
+ * @endcode
  */
-template <typename K, typename V, typename Func>
-auto map_entries(const std::unordered_map<K, V> &input_map, Func func) {
-    using PairType = decltype(func(std::declval<const K &>(), std::declval<const V &>()));
-    using K2 = typename PairType::first_type;
-    using V2 = typename PairType::second_type;
+template <typename T, std::size_t N> class static_vector {
+  public:
+    using value_type = T;
+    using size_type = std::size_t;
+    using difference_type = std::ptrdiff_t;
+    using reference = T &;
+    using const_reference = const T &;
+    using pointer = T *;
+    using const_pointer = const T *;
+    using iterator = T *;
+    using const_iterator = const T *;
 
-    std::unordered_map<K2, V2> result;
-    result.reserve(input_map.size());
-    for (const auto &[key, value] : input_map) {
-        auto [new_key, new_value] = func(key, value);
-        result.emplace(std::move(new_key), std::move(new_value));
+    static_vector() = default;
+
+    static_vector(std::initializer_list<T> init) {
+        reserve(init.size());
+        construct_from(init.begin(), init.end());
     }
-    return result;
-}
 
-/**
- * @brief Filter an unordered_map based on a predicate applied to key-value pairs.
- *
- * @tparam K Type of keys in the map.
- * @tparam V Type of values in the map.
- * @tparam Pred Type of the predicate. Must be callable with (const K&, const V&).
- * @param input_map Input unordered_map to filter.
- * @param pred Predicate function that returns true to keep an element, false to remove it.
- * @return A new unordered_map containing only the key-value pairs for which pred(key, value) is true.
- */
-template <typename K, typename V, typename Pred>
-std::unordered_map<K, V> filter_map(const std::unordered_map<K, V> &input_map, Pred pred) {
-    std::unordered_map<K, V> result;
-    result.reserve(input_map.size());
+    static_vector(const static_vector &other) { construct_from(other.begin(), other.end()); }
 
-    for (const auto &[key, value] : input_map) {
-        if (pred(key, value)) {
-            result.emplace(key, value);
+    static_vector(static_vector &&other) noexcept(std::is_nothrow_move_constructible_v<T>) {
+        construct_from(std::make_move_iterator(other.begin()), std::make_move_iterator(other.end()));
+        other.clear();
+    }
+
+    static_vector &operator=(const static_vector &other) {
+        if (this != &other) {
+            clear();
+            for (const auto &v : other)
+                emplace_back(v);
         }
+        return *this;
     }
 
-    return result;
-}
+    static_vector &operator=(static_vector &&other) noexcept(std::is_nothrow_move_constructible_v<T>) {
+        if (this != &other) {
+            clear();
+            for (auto &v : other)
+                emplace_back(std::move(v));
+            other.clear();
+        }
+        return *this;
+    }
 
-/**
- * @brief Filter an unordered_map based on a predicate applied to its keys.
- *
- * @tparam K Type of keys in the map.
- * @tparam V Type of values in the map.
- * @tparam Pred Type of the predicate. Must be callable with (const K&).
- * @param input_map Input unordered_map to filter.
- * @param pred Predicate function that returns true to keep an element, false to remove it.
- * @return A new unordered_map containing only the key-value pairs for which pred(key) is true.
- */
-template <typename K, typename V, typename Pred>
-std::unordered_map<K, V> filter_map_by_keys(const std::unordered_map<K, V> &input_map, Pred pred) {
-    std::unordered_map<K, V> result;
-    result.reserve(input_map.size());
+    ~static_vector() { clear(); }
 
-    for (const auto &[key, value] : input_map) {
-        if (pred(key)) {
-            result.emplace(key, value);
+    /**
+     * @brief Construct an element in place at the end.
+     *
+     * @throws std::length_error if the vector is already at capacity.
+     */
+    template <typename... Args> T &emplace_back(Args &&...args) {
+        if (count == N) {
+            throw std::length_error("static_vector capacity exceeded");
         }
+        T *slot = ::new (static_cast<void *>(storage + count * sizeof(T))) T(std::forward<Args>(args)...);
+        ++count;
+        return *slot;
     }
 
-    return result;
-}
+    void push_back(const T &value) { emplace_back(value); }
+    void push_back(T &&value) { emplace_back(std::move(value)); }
+
+    void pop_back() {
+        --count;
+        data()[count].~T();
+    }
+
+    void clear() {
+        while (count > 0)
+            pop_back();
+    }
+
+    /**
+     * @brief Does not allocate; only checks that n elements would fit, so generic code that reserves keeps working.
+     *
+     * @throws std::length_error if n is larger than the capacity.
+     */
+    void reserve(std::size_t n) const {
+        if (n > N) {
+            throw std::length_error("static_vector capacity exceeded");
+        }
+    }
+
+    static constexpr std::size_t capacity() { return N; }
+    std::size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    bool full() const { return count == N; }
+
+    T *data() { return std::launder(reinterpret_cast<T *>(storage)); }
+    const T *data() const { return std::launder(reinterpret_cast<const T *>(storage)); }
+
+    iterator begin() { return data(); }
+    iterator end() { return data() + count; }
+    const_iterator begin() const { return data(); }
+    const_iterator end() const { return data() + count; }
+
+    T &operator[](std::size_t i) { return data()[i]; }
+    const T &operator[](std::size_t i) const { return data()[i]; }
+
+    T &at(std::size_t i) {
+        if (i >= count) {
+            throw std::out_of_range("static_vector index out of range");
+        }
+        return data()[i];
+    }
+    const T &at(std::size_t i) const {
+        if (i >= count) {
+            throw std::out_of_range("static_vector index out of range");
+        }
+        return data()[i];
+    }
+
+    T &front() { return data()[0]; }
+    const T &front() const { return data()[0]; }
+    T &back() { return data()[count - 1]; }
+    const T &back() const { return data()[count - 1]; }
+
+    bool operator==(const static_vector &other) const {
+        return count == other.count && std::equal(begin(), end(), other.begin());
+    }
+    bool operator!=(const static_vector &other) const { return !(*this == other); }
+
+  private:
+    /**
+     * @brief Append [first, last) during construction. The destructor does not run for an object whose constructor
+     * throws, so destroy the elements built so far before passing the exception on.
+     */
+    template <typename It> void construct_from(It first, It last) {
+        try {
+            for (; first != last; ++first)
+                emplace_back(*first);
+        } catch (...) {
+            clear();
+            throw;
+        }
+    }
+
+    // NOTE: raw bytes rather than T[N] so that elements are only constructed when they are pushed
+    alignas(T) unsigned char storage[(N > 0 ? N : 1) * sizeof(T)];
+    std::size_t count = 0;
+};
+
 /**
- * @brief Keep only the entries in an unordered_map whose keys are in a specified set.
+ * @brief Check if a value exists in a static_vector.
  *
- * @tparam K Type of keys in the map and the set.
- * @tparam V Type of values in the map.
- * @param input_map The unordered_map to filter.
- * @param key_set The set of keys to keep.
- * @return std::unordered_map<K, V> A new unordered_map containing only entries with keys in key_set.
+ * @tparam T Type of elements in the vector.
+ * @tparam N Capacity of the vector.
+ * @param vec The vector to search within.
+ * @param value The value to search for.
+ * @return true if the value exists in the vector, false otherwise.
  */
-template <typename K, typename V>
-std::unordered_map<K, V> filter_map_by_key_set(const std::unordered_map<K, V> &input_map,
-                                               const std::unordered_set<K> &key_set) {
-    return filter_map_by_keys(input_map, [&](const K &key) { return key_set.find(key) != key_set.end(); });
+template <typename T, std::size_t N> bool contains(const static_vector<T, N> &vec, const T &value) {
+    return std::find(vec.begin(), vec.end(), value) != vec.end();
 }
 
 /**
- * @brief Filter an unordered_map based on a predicate applied to its values.
+ * @brief Concatenate two static_vectors; the capacity of the result is the sum of the input capacities, so this can
+ * never overflow.
  *
- * @tparam K Type of keys in the map.
- * @tparam V Type of values in the map.
- * @tparam Pred Type of the predicate. Must be callable with (const V&).
- * @param input_map Input unordered_map to filter.
- * @param pred Predicate function that returns true to keep an element, false to remove it.
- * @return A new unordered_map containing only the key-value pairs for which pred(value) is true.
+ * @tparam T Type of elements in the vectors.
+ * @tparam A Capacity of the first vector.
+ * @tparam B Capacity of the second vector.
+ * @param v1 First vector.
+ * @param v2 Second vector.
+ * @return static_vector<T, A + B> containing all elements from v1 followed by all elements from v2.
  */
-template <typename K, typename V, typename Pred>
-std::unordered_map<K, V> filter_map_by_values(const std::unordered_map<K, V> &input_map, Pred pred) {
-    std::unordered_map<K, V> result;
-    result.reserve(input_map.size());
-
-    for (const auto &[key, value] : input_map) {
-        if (pred(value)) {
-            result.emplace(key, value);
-        }
-    }
-
+template <typename T, std::size_t A, std::size_t B>
+static_vector<T, A + B> join_vectors(const static_vector<T, A> &v1, const static_vector<T, B> &v2) {
+    static_vector<T, A + B> result;
+    for (const auto &v : v1)
+        result.push_back(v);
+    for (const auto &v : v2)
+        result.push_back(v);
     return result;
 }
 
 /**
- * @brief Build an unordered_map from a vector of objects, using a member or attribute as the key.
+ * @brief Extend a static_vector by appending the elements of another static_vector.
  *
- * @tparam Key Type of the key to use in the map.
- * @tparam Value Type of the objects in the vector.
- * @tparam KeyFunc Callable type that takes a const Value& and returns a Key.
- * @param vec Vector of objects to convert to a map.
- * @param key_func Function that extracts the key from a Value.
- * @return std::unordered_map<Key, Value> The resulting map.
+ * @tparam T Type of elements in the vectors.
+ * @tparam N Capacity of the vector being extended.
+ * @tparam M Capacity of the vector being appended.
+ * @param v1 Vector to be extended. Will be modified in-place.
+ * @param v2 Vector whose elements will be appended to v1.
  *
- * @note If multiple objects in the vector produce the same key, only the first one encountered will be inserted into
- * the map. Subsequent objects with duplicate keys will be ignored. Therefore if there is such duplicate data then
- * information will be lost
+ * @throws std::length_error if the result would not fit in v1, in which case v1 is left unchanged.
  */
-template <typename Key, typename Value, typename KeyFunc>
-std::unordered_map<Key, Value> build_map_from_vector(const std::vector<Value> &vec, KeyFunc key_func) {
-    std::unordered_map<Key, Value> map;
-    for (const auto &item : vec) {
-        map.emplace(key_func(item), item); // first occurrence wins
-    }
-    return map;
+template <typename T, std::size_t N, std::size_t M>
+void extend_vector(static_vector<T, N> &v1, const static_vector<T, M> &v2) {
+    v1.reserve(v1.size() + v2.size()); // check up front so a failed extend does not leave v1 half extended
+    for (const auto &v : v2)
+        v1.push_back(v);
 }
 
 /**
- * @brief Combine two unordered_maps with the same keyset using a provided binary function.
+ * @brief Apply a function to each element of a modifiable static_vector.
  *
- * @tparam Key Type of the keys in the maps.
- * @tparam Value1 Type of the values in the first map.
- * @tparam Value2 Type of the values in the second map.
- * @tparam ResultType Type of the values in the resulting map.
- * @tparam Func Callable type that takes (const Value1&, const Value2&) and returns ResultType.
+ * @tparam T Type of elements in the vector.
+ * @tparam N Capacity of the vector.
+ * @tparam Func Type of the function to apply. Must be callable with T&.
+ * @param vec Vector whose elements will be processed.
+ * @param func Function to apply to each element.
+ */
+template <typename T, std::size_t N, typename Func> void for_each_in_vector(static_vector<T, N> &vec, Func func) {
+    for (auto &elem : vec) {
+        func(elem);
+    }
+}
+
+/**
+ * @brief Apply a function to each element of a read-only static_vector.
+ *
+ * @tparam T Type of elements in the vector.
+ * @tparam N Capacity of the vector.
+ * @tparam Func Type of the function to apply. Must be callable with const T&.
+ * @param vec Vector whose elements will be processed.
+ * @param func Function to apply to each element.
+ */
+template <typename T, std::size_t N, typename Func> void for_each_in_vector(const static_vector<T, N> &vec, Func func) {
+    for (const auto &elem : vec) {
+        func(elem);
+    }
+}
+
+/**
+ * @brief Concatenate a static_vector of static_vectors into a single static_vector.
+ *
+ * @tparam T Type of elements in the vectors.
+ * @tparam N Capacity of each inner vector.
+ * @tparam M Capacity of the outer vector.
+ * @param vectors The vectors to join.
+ * @return static_vector<T, N * M> containing all elements from all input vectors in order.
+ */
+template <typename T, std::size_t N, std::size_t M>
+static_vector<T, N * M> join_all_vectors(const static_vector<static_vector<T, N>, M> &vectors) {
+    static_vector<T, N * M> result;
+    for (const auto &v : vectors) {
+        for (const auto &elem : v)
+            result.push_back(elem);
+    }
+    return result;
+}
+
+/**
+ * @brief Transform a static_vector by applying a function to each element.
+ *
+ * @tparam T Type of input elements.
+ * @tparam N Capacity of the vector.
+ * @tparam Func Type of the function to apply. Must be callable with const T&.
+ * @param vec Input vector.
+ * @param func Function to apply to each element.
+ * @return static_vector<U, N> where U is the return type of func.
+ */
+template <typename T, std::size_t N, typename Func> auto map_vector(const static_vector<T, N> &vec, Func func) {
+    using U = decltype(func(std::declval<const T &>()));
+    static_vector<U, N> result;
+    for (const auto &elem : vec) {
+        result.push_back(func(elem));
+    }
+    return result;
+}
+
+// endfold
+
+// startfold copy on write vector
+
+/**
+ * @brief A vector whose copies share one buffer until one of them is modified.
+ *
+ * Copying a cow_vector is an atomic increment, so a large vector can be handed to many consumers without defensive
+ * copies. The first mutation through a handle whose buffer is shared clones the buffer for that handle only; a
+ * handle that owns its buffer alone mutates in place. Read access never clones.
+ *
+ * Different cow_vector objects sharing a buffer may be used from different threads. A single cow_vector object has the
+ * same thread safety as std::vector.
+ *
+ * @tparam T Type of the elements, must be copy constructible for cloning.
+ *
+ * @example
+ * @code
+ * cow_vector<Sample> samples(load_samples());
+ * for (auto &consumer : consumers)
+ *     consumer.submit(samples);          // no copy
+ * // in a consumer that needs to add to it:
+ * extend_vector(my_samples, extra);      // clones once, only if still shared
+ * @endcode
+ */
+template <typename T> class cow_vector {
+  public:
+    using value_type = T;
+    using size_type = std::size_t;
+    using const_iterator = typename std::vector<T>::const_iterator;
+    using iterator = const_iterator; // elements are only written through the mutating members
+
+    cow_vector() = default;
+    cow_vector(std::vector<T> items) {
+        if (!items.empty())
+            shared = new buffer{{1}, std::move(items)};
+    }
+    cow_vector(std::initializer_list<T> items) : cow_vector(std::vector<T>(items)) {}
+    cow_vector(std::size_t count, const T &value) : cow_vector(std::vector<T>(count, value)) {}
+
+    cow_vector(const cow_vector &other) : shared(other.shared) {
+        if (shared)
+            shared->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    cow_vector(cow_vector &&other) noexcept : shared(std::exchange(other.shared, nullptr)) {}
+
+    cow_vector &operator=(const cow_vector &other) {
+        cow_vector(other).swap(*this);
+        return *this;
+    }
+
+    cow_vector &operator=(cow_vector &&other) noexcept {
+        cow_vector(std::move(other)).swap(*this);
+        return *this;
+    }
+
+    ~cow_vector() { release(); }
+
+    void swap(cow_vector &other) noexcept { std::swap(shared, other.shared); }
+
+    std::size_t size() const { return shared ? shared->items.size() : 0; }
+    bool empty() const { return size() == 0; }
+
+    const T &operator[](std::size_t i) const { return shared->items[i]; }
+    const T &at(std::size_t i) const { return view().at(i); }
+    const T &front() const { return shared->items.front(); }
+    const T &back() const { return shared->items.back(); }
+    const T *data() const { return shared ? shared->items.data() : nullptr; }
+
+    const_iterator begin() const { return view().begin(); }
+    const_iterator end() const { return view().end(); }
+
+    /**
+     * @brief The elements as a plain vector, without cloning.
+     */
+    const std::vector<T> &view() const { return shared ? shared->items : empty_items(); }
+
+    /**
+     * @brief Whether another cow_vector currently shares this buffer, i.e. whether the next mutation will clone.
+     */
+    bool is_shared() const { return shared && shared->refs.load(std::memory_order_acquire) > 1; }
+
+    /**
+     * @brief Writable access to the elements, cloning the buffer first if it is shared.
+     *
+     * The reference must not be used after this cow_vector is copied: the copy shares the buffer, so writes through it
+     * would silently change the copy as well. Call mutate() again after making a copy.
+     */
+    std::vector<T> &mutate() {
+        if (!shared) {
+            shared = new buffer{{1}, {}};
+        } else if (is_shared()) {
+            auto *own = new buffer{{1}, shared->items};
+            release();
+            shared = own;
+        }
+        return shared->items;
+    }
+
+    void set(std::size_t i, T value) { mutate().at(i) = std::move(value); }
+    void push_back(T value) { mutate().push_back(std::move(value)); }
+    template <typename... Args> T &emplace_back(Args &&...args) {
+        return mutate().emplace_back(std::forward<Args>(args)...);
+    }
+    void pop_back() { mutate().pop_back(); }
+    void resize(std::size_t count) { mutate().resize(count); }
+    void reserve(std::size_t capacity) { mutate().reserve(capacity); }
+
+    /**
+     * @brief Drop this handle's reference to the elements; never clones.
+     */
+    void clear() {
+        release();
+        shared = nullptr;
+    }
+
+    /**
+     * @brief Move the elements out, without cloning when this handle owns its buffer alone.
+     */
+    std::vector<T> release_vector() && {
+        std::vector<T> result;
+        if (is_shared())
+            result = shared->items;
+        else if (shared)
+            result = std::move(shared->items);
+        clear();
+        return result;
+    }
+
+    friend bool operator==(const cow_vector &a, const cow_vector &b) {
+        return a.shared == b.shared || a.view() == b.view();
+    }
+    friend bool operator!=(const cow_vector &a, const cow_vector &b) { return !(a == b); }
+
+  private:
+    struct buffer {
+        std::atomic<std::size_t> refs;
+        std::vector<T> items;
+    };
+
+    static const std::vector<T> &empty_items() {
+        static const std::vector<T> none;
+        return none;
+    }
+
+    void release() {
+        if (shared && shared->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            delete shared;
+    }
+
+    buffer *shared = nullptr;
+};
+
+/**
+ * @brief Check if a value exists in a cow_vector.
+ */
+template <typename T> bool contains(const cow_vector<T> &vec, const T &value) {
+    return std::find(vec.begin(), vec.end(), value) != vec.end();
+}
+
+/**
+ * @brief Concatenate two cow_vectors. If either one is empty the result shares the other's buffer.
+ */
+template <typename T> cow_vector<T> join_vectors(const cow_vector<T> &v1, const cow_vector<T> &v2) {
+    if (v1.empty())
+        return v2;
+    if (v2.empty())
+        return v1;
+    return cow_vector<T>(join_vectors(v1.view(), v2.view()));
+}
+
+/**
+ * @brief Extend a cow_vector in place; its buffer is cloned first only if it is shared and v2 is not empty.
+ */
+template <typename T> void extend_vector(cow_vector<T> &v1, const cow_vector<T> &v2) {
+    if (v2.empty())
+        return;
+    if (v1.empty()) {
+        v1 = v2;
+        return;
+    }
+    const cow_vector<T> keep_alive = v2; // v1 and v2 may be the same object
+    extend_vector(v1.mutate(), keep_alive.view());
+}
+
+/**
+ * @brief Apply a modifying function to each element of a cow_vector, cloning its buffer first if it is shared.
+ *
+ * Named apart from for_each_in_vector so that read-only iteration over a non-const cow_vector never clones.
+ */
+template <typename T, typename Func> void modify_each_in_vector(cow_vector<T> &vec, Func func) {
+    if (vec.empty())
+        return;
+    for (auto &elem : vec.mutate()) {
+        func(elem);
+    }
+}
+
+/**
+ * @brief Apply a function to each element of a cow_vector; never clones. Use modify_each_in_vector to change them.
+ */
+template <typename T, typename Func> void for_each_in_vector(const cow_vector<T> &vec, Func func) {
+    for (const auto &elem : vec) {
+        func(elem);
+    }
+}
+
+/**
+ * @brief Concatenate a vector of cow_vectors into a single cow_vector.
+ */
+template <typename T> cow_vector<T> join_all_vectors(const std::vector<cow_vector<T>> &vectors) {
+    std::size_t total_size = 0;
+    for (const auto &v : vectors)
+        total_size += v.size();
+
+    std::vector<T> result;
+    result.reserve(total_size);
+    for (const auto &v : vectors)
+        result.insert(result.end(), v.begin(), v.end());
+    return cow_vector<T>(std::move(result));
+}
+
+/**
+ * @brief Transform a cow_vector by applying a function to each element.
+ *
+ * @return cow_vector<U> where U is the return type of func.
+ */
+template <typename T, typename Func> auto map_vector(const cow_vector<T> &vec, Func func) {
+    return cow_vector<decltype(func(std::declval<const T &>()))>(map_vector(vec.view(), func));
+}
+
+// endfold
+
+// startfold persistent vector
+
+/**
+ * @brief Immutable vector with O(log n) concatenation, slicing, indexing, update and push_back.
+ *
+ * Elements live in shared, immutable leaf chunks of up to leaf_capacity elements, held together by a height balanced
+ * (AVL) binary tree. Every operation returns a new version and leaves the old one untouched; versions share every
+ * chunk and subtree they have in common, so keeping old versions around costs only the O(log n) nodes each operation
+ * copied. Adjacent small chunks are merged whenever two leaves meet during a concatenation, so repeated slicing and
+ * joining does not fragment the storage.
+ *
+ * Copying a persistent_vector copies one shared_ptr. Versions can be read from any number of threads.
+ *
+ * @tparam T Type of the elements; not bool, since chunks hand out raw pointers that std::vector<bool> cannot provide.
+ *
+ * @example
+ * @code
+ * persistent_vector<Event> log;
+ * log = log.push_back(e1).push_back(e2);
+ * auto merged = join_vectors(log, other_log);     // O(log n), both inputs stay valid
+ * auto recent = merged.slice(merged.size() - 1000, merged.size());
+ * for_each_in_vector(recent, [](const Event &e) { replay(e); });
+ * @endcode
+ */
+template <typename T> class persistent_vector {
+    static_assert(!std::is_same_v<T, bool>, "persistent_vector<bool> is not supported, store char instead");
+
+    struct node;
+    using node_ptr = std::shared_ptr<const node>;
+
+  public:
+    using value_type = T;
+    using size_type = std::size_t;
+    static constexpr std::size_t leaf_capacity = 32;
+
+    /**
+     * @brief Forward iterator; walks one chunk at a time and only descends the tree when it crosses a chunk boundary.
+     */
+    class const_iterator {
+      public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T *;
+        using reference = const T &;
+
+        const_iterator() = default;
+
+        reference operator*() const { return chunk[index - chunk_first]; }
+        pointer operator->() const { return &**this; }
+
+        const_iterator &operator++() {
+            if (++index == chunk_last && index < owner->size())
+                load_chunk();
+            return *this;
+        }
+        const_iterator operator++(int) {
+            const_iterator previous = *this;
+            ++*this;
+            return previous;
+        }
+
+        bool operator==(const const_iterator &other) const { return index == other.index; }
+        bool operator!=(const const_iterator &other) const { return index != other.index; }
+
+      private:
+        friend class persistent_vector;
+
+        const_iterator(const persistent_vector *owner, std::size_t index) : owner(owner), index(index) {
+            if (index < owner->size())
+                load_chunk();
+        }
+
+        void load_chunk() {
+            const node *leaf = owner->leaf_containing(index, chunk_first);
+            chunk = leaf->items.data();
+            chunk_last = chunk_first + leaf->items.size();
+        }
+
+        const persistent_vector *owner = nullptr;
+        std::size_t index = 0;
+        const T *chunk = nullptr;
+        std::size_t chunk_first = 0;
+        std::size_t chunk_last = 0;
+    };
+    using iterator = const_iterator;
+
+    persistent_vector() = default;
+
+    /**
+     * @brief Build from a vector in O(n), as a perfectly balanced tree of full chunks.
+     */
+    persistent_vector(const std::vector<T> &items) {
+        std::vector<node_ptr> leaves;
+        leaves.reserve((items.size() + leaf_capacity - 1) / leaf_capacity);
+        for (std::size_t i = 0; i < items.size(); i += leaf_capacity) {
+            const std::size_t end = std::min(items.size(), i + leaf_capacity);
+            leaves.push_back(make_leaf(std::vector<T>(items.begin() + i, items.begin() + end)));
+        }
+        root = build_balanced(leaves, 0, leaves.size());
+    }
+
+    persistent_vector(std::initializer_list<T> items) : persistent_vector(std::vector<T>(items)) {}
+
+    std::size_t size() const { return root ? root->size : 0; }
+    bool empty() const { return !root; }
+
+    /**
+     * @brief Element at index i, in O(log n). No bounds checking.
+     */
+    const T &operator[](std::size_t i) const {
+        std::size_t first = 0;
+        const node *leaf = leaf_containing(i, first);
+        return leaf->items[i - first];
+    }
+
+    /**
+     * @throws std::out_of_range if i is not a valid index.
+     */
+    const T &at(std::size_t i) const {
+        if (i >= size())
+            throw std::out_of_range("persistent_vector::at index out of range");
+        return (*this)[i];
+    }
+
+    const T &front() const { return (*this)[0]; }
+    const T &back() const { return (*this)[size() - 1]; }
+
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, size()); }
+
+    /**
+     * @brief A new version with value appended. Copies at most one chunk and O(log n) nodes.
+     */
+    persistent_vector push_back(T value) const {
+        std::vector<T> items;
+        items.push_back(std::move(value));
+        return persistent_vector(join(root, make_leaf(std::move(items))));
+    }
+
+    /**
+     * @brief A new version with element i replaced, in O(log n).
+     *
+     * @throws std::out_of_range if i is not a valid index.
+     */
+    persistent_vector set(std::size_t i, T value) const {
+        if (i >= size())
+            throw std::out_of_range("persistent_vector::set index out of range");
+        return persistent_vector(set_in(root, i, std::move(value)));
+    }
+
+    /**
+     * @brief This vector followed by other, in O(log n).
+     */
+    persistent_vector concat(const persistent_vector &other) const { return persistent_vector(join(root, other.root)); }
+
+    /**
+     * @brief Elements [first, last), in O(log n).
+     *
+     * @throws std::out_of_range if first > last or last > size().
+     */
+    persistent_vector slice(std::size_t first, std::size_t last) const {
+        if (first > last || last > size())
+            throw std::out_of_range("persistent_vector::slice range out of bounds");
+        node_ptr prefix = split(root, last).first;
+        return persistent_vector(split(prefix, first).second);
+    }
+
+    persistent_vector take(std::size_t count) const { return slice(0, std::min(count, size())); }
+    persistent_vector drop(std::size_t count) const { return slice(std::min(count, size()), size()); }
+
+    /**
+     * @brief Call func(const T *data, std::size_t count) for every chunk, in order.
+     *
+     * The fastest way to read every element: the inner loop runs over contiguous memory.
+     */
+    template <typename Func> void for_each_chunk(Func &&func) const { for_each_leaf(root.get(), func); }
+
+    std::vector<T> to_vector() const {
+        std::vector<T> result;
+        result.reserve(size());
+        for_each_chunk([&](const T *data, std::size_t count) { result.insert(result.end(), data, data + count); });
+        return result;
+    }
+
+    /**
+     * @brief A new version of the same shape with func applied to every element of every chunk.
+     */
+    template <typename Func> auto map_chunks(Func func) const {
+        using U = std::decay_t<decltype(func(std::declval<const T &>()))>;
+        std::vector<typename persistent_vector<U>::node_ptr> leaves;
+        for_each_chunk([&](const T *data, std::size_t count) {
+            std::vector<U> mapped;
+            mapped.reserve(count);
+            for (std::size_t i = 0; i < count; ++i)
+                mapped.push_back(func(data[i]));
+            leaves.push_back(persistent_vector<U>::make_leaf(std::move(mapped)));
+        });
+        return persistent_vector<U>(persistent_vector<U>::build_balanced(leaves, 0, leaves.size()));
+    }
+
+  private:
+    template <typename U> friend class persistent_vector;
+
+    struct node {
+        std::vector<T> items; // leaves only
+        node_ptr left;        // internal nodes only
+        node_ptr right;
+        std::size_t size;
+        int height; // 0 for leaves
+    };
+
+    explicit persistent_vector(node_ptr root) : root(std::move(root)) {}
+
+    static int height(const node_ptr &n) { return n ? n->height : -1; }
+
+    static node_ptr make_leaf(std::vector<T> items) {
+        const std::size_t size = items.size();
+        return std::make_shared<const node>(node{std::move(items), nullptr, nullptr, size, 0});
+    }
+
+    static node_ptr make_node(node_ptr left, node_ptr right) {
+        const std::size_t size = left->size + right->size;
+        const int h = 1 + std::max(left->height, right->height);
+        return std::make_shared<const node>(node{{}, std::move(left), std::move(right), size, h});
+    }
+
+    static node_ptr build_balanced(const std::vector<node_ptr> &leaves, std::size_t first, std::size_t last) {
+        if (first == last)
+            return nullptr;
+        if (last - first == 1)
+            return leaves[first];
+        const std::size_t middle = first + (last - first) / 2;
+        return make_node(build_balanced(leaves, first, middle), build_balanced(leaves, middle, last));
+    }
+
+    /**
+     * @brief Node over left and right whose heights differ by at most 2, rotating once or twice if needed.
+     */
+    static node_ptr balance(node_ptr left, node_ptr right) {
+        if (height(left) > height(right) + 1) {
+            if (height(left->left) >= height(left->right))
+                return make_node(left->left, make_node(left->right, std::move(right)));
+            return make_node(make_node(left->left, left->right->left),
+                             make_node(left->right->right, std::move(right)));
+        }
+        if (height(right) > height(left) + 1) {
+            if (height(right->right) >= height(right->left))
+                return make_node(make_node(std::move(left), right->left), right->right);
+            return make_node(make_node(std::move(left), right->left->left),
+                             make_node(right->left->right, right->right));
+        }
+        return make_node(std::move(left), std::move(right));
+    }
+
+    /**
+     * @brief Concatenate two trees, walking down the spine of the taller one: O(|height difference| + 1), or O(log n)
+     * when one side is a single leaf.
+     */
+    static node_ptr join(const node_ptr &left, const node_ptr &right) {
+        if (!left)
+            return right;
+        if (!right)
+            return left;
+        if (left->height == 0 && right->height == 0 && left->items.size() + right->items.size() <= leaf_capacity) {
+            std::vector<T> items;
+            items.reserve(left->items.size() + right->items.size());
+            items.insert(items.end(), left->items.begin(), left->items.end());
+            items.insert(items.end(), right->items.begin(), right->items.end());
+            return make_leaf(std::move(items));
+        }
+        // a lone leaf is pushed all the way down to the leaf it touches, so it can merge with it instead of adding a
+        // chunk of one element per push_back
+        if (left->height > right->height + 1 || (right->height == 0 && left->height > 0))
+            return balance(left->left, join(left->right, right));
+        if (right->height > left->height + 1 || (left->height == 0 && right->height > 0))
+            return balance(join(left, right->left), right->right);
+        return make_node(left, right);
+    }
+
+    /**
+     * @brief The first i elements and the rest, as two trees.
+     */
+    static std::pair<node_ptr, node_ptr> split(const node_ptr &n, std::size_t i) {
+        if (!n || i == 0)
+            return {nullptr, n};
+        if (i >= n->size)
+            return {n, nullptr};
+        if (n->height == 0) {
+            const auto middle = n->items.begin() + i;
+            return {make_leaf(std::vector<T>(n->items.begin(), middle)),
+                    make_leaf(std::vector<T>(middle, n->items.end()))};
+        }
+        const std::size_t left_size = n->left->size;
+        if (i < left_size) {
+            auto [first, rest] = split(n->left, i);
+            return {first, join(rest, n->right)};
+        }
+        if (i == left_size)
+            return {n->left, n->right};
+        auto [first, rest] = split(n->right, i - left_size);
+        return {join(n->left, first), rest};
+    }
+
+    static node_ptr set_in(const node_ptr &n, std::size_t i, T &&value) {
+        if (n->height == 0) {
+            std::vector<T> items = n->items;
+            items[i] = std::move(value);
+            return make_leaf(std::move(items));
+        }
+        if (i < n->left->size)
+            return make_node(set_in(n->left, i, std::move(value)), n->right);
+        return make_node(n->left, set_in(n->right, i - n->left->size, std::move(value)));
+    }
+
+    /**
+     * @brief The leaf holding element i; first is set to the index of the leaf's first element.
+     */
+    const node *leaf_containing(std::size_t i, std::size_t &first) const {
+        const node *n = root.get();
+        first = 0;
+        while (n->height != 0) {
+            if (i < first + n->left->size) {
+                n = n->left.get();
+            } else {
+                first += n->left->size;
+                n = n->right.get();
+            }
+        }
+        return n;
+    }
+
+    template <typename Func> static void for_each_leaf(const node *n, Func &func) {
+        if (!n)
+            return;
+        if (n->height == 0) {
+            func(n->items.data(), n->items.size());
+            return;
+        }
+        for_each_leaf(n->left.get(), func);
+        for_each_leaf(n->right.get(), func);
+    }
+
+    node_ptr root;
+};
+
+/**
+ * @brief Check if a value exists in a persistent_vector, scanning chunk by chunk.
+ */
+template <typename T> bool contains(const persistent_vector<T> &vec, const T &value) {
+    bool found = false;
+    vec.for_each_chunk([&](const T *data, std::size_t count) {
+        if (!found)
+            found = std::find(data, data + count, value) != data + count;
+    });
+    return found;
+}
+
+/**
+ * @brief Concatenate two persistent_vectors in O(log n); both inputs remain valid and share their storage with the
+ * result.
+ */
+template <typename T>
+persistent_vector<T> join_vectors(const persistent_vector<T> &v1, const persistent_vector<T> &v2) {
+    return v1.concat(v2);
+}
+
+/**
+ * @brief Extend a persistent_vector by rebinding it to its concatenation with v2, in O(log n). Other copies of v1's
+ * previous version are unaffected.
+ */
+template <typename T> void extend_vector(persistent_vector<T> &v1, const persistent_vector<T> &v2) {
+    v1 = v1.concat(v2);
+}
+
+/**
+ * @brief Apply a function to each element of a persistent_vector, chunk by chunk. Use modify_each_in_vector to change
+ * them.
+ */
+template <typename T, typename Func> void for_each_in_vector(const persistent_vector<T> &vec, Func func) {
+    vec.for_each_chunk([&](const T *data, std::size_t count) {
+        for (std::size_t i = 0; i < count; ++i)
+            func(data[i]);
+    });
+}
+
+/**
+ * @brief Apply a modifying function to each element, rebinding vec to the modified version. Other copies of the
+ * previous version are unaffected.
+ *
+ * This rebuilds every chunk, so it is named apart from for_each_in_vector, which only reads and keeps the sharing.
+ */
+template <typename T, typename Func> void modify_each_in_vector(persistent_vector<T> &vec, Func func) {
+    vec = vec.map_chunks([&](const T &elem) {
+        T copy = elem;
+        func(copy);
+        return copy;
+    });
+}
+
+/**
+ * @brief Concatenate persistent_vectors; O(k log n) for k vectors, independent of their lengths.
+ */
+template <typename T> persistent_vector<T> join_all_vectors(const std::vector<persistent_vector<T>> &vectors) {
+    persistent_vector<T> result;
+    for (const auto &v : vectors)
+        result = result.concat(v);
+    return result;
+}
+
+/**
+ * @brief Transform a persistent_vector chunk by chunk.
+ *
+ * @return persistent_vector<U> with the same chunk layout, where U is the return type of func, which must not be bool.
+ */
+template <typename T, typename Func> auto map_vector(const persistent_vector<T> &vec, Func func) {
+    return vec.map_chunks(func);
+}
+
+// endfold
+
+// startfold segmented vector
+
+/**
+ * @brief Vector made of separately allocated blocks, so appending never moves the elements already stored.
+ *
+ * Each new block is as large as everything stored so far, so there are O(log n) blocks and appending is O(1)
+ * amortized, but unlike std::vector no element is ever copied or relocated: pointers and references to elements stay
+ * valid until that element is removed. splice moves all blocks of another segmented_vector over in O(blocks), again
+ * without touching the elements.
+ *
+ * Random access finds the block by binary search over the blocks' starting indices. Bulk processing should go through
+ * for_each_block, which hands out each block as a contiguous array that plain loops (and the compiler's vectorizer)
+ * handle well.
+ *
+ * @tparam T Type of the elements.
+ *
+ * @example
+ * @code
+ * segmented_vector<Particle> particles;
+ * Particle &p = particles.emplace_back(...);   // stays valid while particles grows
+ * particles.splice(std::move(newly_spawned));  // O(blocks), no element moves
+ * particles.for_each_block([](Particle *data, std::size_t count) { integrate(data, count); });
+ * @endcode
+ */
+template <typename T> class segmented_vector {
+    struct block {
+        T *data;
+        std::size_t size;
+        std::size_t capacity;
+    };
+
+    template <bool Const> class basic_iterator {
+      public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = std::conditional_t<Const, const T *, T *>;
+        using reference = std::conditional_t<Const, const T &, T &>;
+
+        basic_iterator() = default;
+
+        reference operator*() const { return blocks[block_index].data[offset]; }
+        pointer operator->() const { return &**this; }
+
+        basic_iterator &operator++() {
+            ++index;
+            if (++offset == blocks[block_index].size) {
+                ++block_index;
+                offset = 0;
+            }
+            return *this;
+        }
+        basic_iterator operator++(int) {
+            basic_iterator previous = *this;
+            ++*this;
+            return previous;
+        }
+
+        bool operator==(const basic_iterator &other) const { return index == other.index; }
+        bool operator!=(const basic_iterator &other) const { return index != other.index; }
+
+      private:
+        friend class segmented_vector;
+
+        basic_iterator(const block *blocks, std::size_t index) : blocks(blocks), index(index) {}
+
+        const block *blocks = nullptr;
+        std::size_t block_index = 0;
+        std::size_t offset = 0;
+        std::size_t index = 0;
+    };
+
+  public:
+    using value_type = T;
+    using size_type = std::size_t;
+    using iterator = basic_iterator<false>;
+    using const_iterator = basic_iterator<true>;
+
+    static constexpr std::size_t first_block_capacity = 16;
+
+    segmented_vector() = default;
+
+    segmented_vector(const std::vector<T> &items) {
+        try {
+            append_range(items.begin(), items.size());
+        } catch (...) {
+            clear();
+            throw;
+        }
+    }
+
+    segmented_vector(std::initializer_list<T> items) {
+        try {
+            append_range(items.begin(), items.size());
+        } catch (...) {
+            clear();
+            throw;
+        }
+    }
+
+    /**
+     * @brief Copy into a single block.
+     */
+    segmented_vector(const segmented_vector &other) {
+        try {
+            allocate_block(other.size());
+            other.for_each_block([&](const T *data, std::size_t n) { append_range(data, n); });
+        } catch (...) {
+            clear();
+            throw;
+        }
+    }
+
+    segmented_vector(segmented_vector &&other) noexcept
+        : blocks(std::move(other.blocks)), starts(std::move(other.starts)), count(std::exchange(other.count, 0)) {
+        other.blocks.clear();
+        other.starts.clear();
+    }
+
+    segmented_vector &operator=(segmented_vector other) noexcept {
+        swap(other);
+        return *this;
+    }
+
+    ~segmented_vector() { clear(); }
+
+    void swap(segmented_vector &other) noexcept {
+        blocks.swap(other.blocks);
+        starts.swap(other.starts);
+        std::swap(count, other.count);
+    }
+
+    std::size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    std::size_t block_count() const { return blocks.size(); }
+
+    T &operator[](std::size_t i) {
+        const std::size_t b = block_of(i);
+        return blocks[b].data[i - starts[b]];
+    }
+    const T &operator[](std::size_t i) const { return const_cast<segmented_vector &>(*this)[i]; }
+
+    /**
+     * @throws std::out_of_range if i is not a valid index.
+     */
+    T &at(std::size_t i) {
+        if (i >= count)
+            throw std::out_of_range("segmented_vector::at index out of range");
+        return (*this)[i];
+    }
+    const T &at(std::size_t i) const { return const_cast<segmented_vector &>(*this).at(i); }
+
+    T &back() { return (*this)[count - 1]; }
+    const T &back() const { return (*this)[count - 1]; }
+
+    iterator begin() { return iterator(blocks.data(), 0); }
+    iterator end() { return iterator(blocks.data(), count); }
+    const_iterator begin() const { return const_iterator(blocks.data(), 0); }
+    const_iterator end() const { return const_iterator(blocks.data(), count); }
+
+    /**
+     * @brief Append an element in O(1) amortized; no existing element moves.
+     *
+     * @return Reference to the new element, valid until it is removed.
+     */
+    template <typename... Args> T &emplace_back(Args &&...args) {
+        if (blocks.empty() || blocks.back().size == blocks.back().capacity)
+            allocate_block(std::max(first_block_capacity, count));
+        block &last = blocks.back();
+        T *element = ::new (static_cast<void *>(last.data + last.size)) T(std::forward<Args>(args)...);
+        ++last.size;
+        ++count;
+        return *element;
+    }
+
+    void push_back(const T &value) { emplace_back(value); }
+    void push_back(T &&value) { emplace_back(std::move(value)); }
+
+    void pop_back() {
+        if (blocks.back().size == 0)
+            free_last_block();
+        block &last = blocks.back();
+        last.data[--last.size].~T();
+        --count;
+    }
+
+    /**
+     * @brief Append copies of n elements starting at first, allocating at most one new block.
+     */
+    template <typename InputIt> void append_range(InputIt first, std::size_t n) {
+        if (n == 0)
+            return;
+        if (!blocks.empty()) {
+            block &last = blocks.back();
+            for (; n > 0 && last.size < last.capacity; --n, ++first) {
+                ::new (static_cast<void *>(last.data + last.size)) T(*first);
+                ++last.size;
+                ++count;
+            }
+        }
+        if (n == 0)
+            return;
+        allocate_block(std::max({first_block_capacity, count, n}));
+        block &last = blocks.back();
+        for (; n > 0; --n, ++first) {
+            ::new (static_cast<void *>(last.data + last.size)) T(*first);
+            ++last.size;
+            ++count;
+        }
+    }
+
+    /**
+     * @brief Move every block of other to the end of this vector in O(blocks); other is left empty.
+     *
+     * Elements keep their addresses, so pointers into other now point into this vector. Any unused capacity at the
+     * end of this vector's last block stays unused.
+     */
+    void splice(segmented_vector &&other) {
+        if (other.empty())
+            return;
+        if (!blocks.empty() && blocks.back().size == 0)
+            free_last_block(); // only the last block may ever be empty
+        blocks.reserve(blocks.size() + other.blocks.size());
+        starts.reserve(starts.size() + other.blocks.size());
+        for (const block &b : other.blocks) {
+            if (b.size == 0) {
+                std::allocator<T>().deallocate(b.data, b.capacity);
+                continue;
+            }
+            starts.push_back(count);
+            blocks.push_back(b);
+            count += b.size;
+        }
+        other.blocks.clear();
+        other.starts.clear();
+        other.count = 0;
+    }
+
+    /**
+     * @brief Call func(T *data, std::size_t count) for every non-empty block, in order.
+     */
+    template <typename Func> void for_each_block(Func &&func) {
+        for (const block &b : blocks)
+            if (b.size > 0)
+                func(b.data, b.size);
+    }
+
+    template <typename Func> void for_each_block(Func &&func) const {
+        for (const block &b : blocks)
+            if (b.size > 0)
+                func(static_cast<const T *>(b.data), b.size);
+    }
+
+    void clear() {
+        while (!blocks.empty())
+            free_last_block();
+        count = 0;
+    }
+
+  private:
+    std::size_t block_of(std::size_t i) const {
+        return static_cast<std::size_t>(std::upper_bound(starts.begin(), starts.end(), i) - starts.begin()) - 1;
+    }
+
+    void allocate_block(std::size_t capacity) {
+        if (capacity == 0)
+            return;
+        if (!blocks.empty() && blocks.back().size == 0)
+            free_last_block();
+        // reserve first, so neither push_back can throw once the block is allocated
+        blocks.reserve(blocks.size() + 1);
+        starts.reserve(starts.size() + 1);
+        T *data = std::allocator<T>().allocate(capacity);
+        blocks.push_back({data, 0, capacity});
+        starts.push_back(count);
+    }
+
+    void free_last_block() {
+        block &last = blocks.back();
+        for (std::size_t i = 0; i < last.size; ++i)
+            last.data[i].~T();
+        count -= last.size;
+        std::allocator<T>().deallocate(last.data, last.capacity);
+        blocks.pop_back();
+        starts.pop_back();
+    }
+
+    std::vector<block> blocks;
+    std::vector<std::size_t> starts; // index of the first element of each block
+    std::size_t count = 0;
+};
+
+/**
+ * @brief Check if a value exists in a segmented_vector, scanning block by block.
+ */
+template <typename T> bool contains(const segmented_vector<T> &vec, const T &value) {
+    bool found = false;
+    vec.for_each_block([&](const T *data, std::size_t count) {
+        if (!found)
+            found = std::find(data, data + count, value) != data + count;
+    });
+    return found;
+}
+
+/**
+ * @brief Concatenate copies of two segmented_vectors into a new segmented_vector of at most two blocks.
+ */
+template <typename T>
+segmented_vector<T> join_vectors(const segmented_vector<T> &v1, const segmented_vector<T> &v2) {
+    segmented_vector<T> result(v1);
+    extend_vector(result, v2);
+    return result;
+}
+
+/**
+ * @brief Extend a segmented_vector with copies of v2's elements. Allocates at most one block and never moves the
+ * elements already in v1.
+ */
+template <typename T> void extend_vector(segmented_vector<T> &v1, const segmented_vector<T> &v2) {
+    if (&v1 == &v2) {
+        extend_vector(v1, segmented_vector<T>(v2));
+        return;
+    }
+    v1.append_range(v2.begin(), v2.size());
+}
+
+/**
+ * @brief Extend a segmented_vector with copies of the elements of a std::vector, without moving v1's elements.
+ */
+template <typename T> void extend_vector(segmented_vector<T> &v1, const std::vector<T> &v2) {
+    v1.append_range(v2.begin(), v2.size());
+}
+
+/**
+ * @brief Apply a function to each element of a modifiable segmented_vector, block by block.
+ */
+template <typename T, typename Func> void for_each_in_vector(segmented_vector<T> &vec, Func func) {
+    vec.for_each_block([&](T *data, std::size_t count) {
+        for (std::size_t i = 0; i < count; ++i)
+            func(data[i]);
+    });
+}
+
+/**
+ * @brief Apply a function to each element of a read-only segmented_vector, block by block.
+ */
+template <typename T, typename Func> void for_each_in_vector(const segmented_vector<T> &vec, Func func) {
+    vec.for_each_block([&](const T *data, std::size_t count) {
+        for (std::size_t i = 0; i < count; ++i)
+            func(data[i]);
+    });
+}
+
+/**
+ * @brief Transform a segmented_vector block by block.
+ *
+ * @return segmented_vector<U> where U is the return type of func.
+ */
+template <typename T, typename Func> auto map_vector(const segmented_vector<T> &vec, Func func) {
+    segmented_vector<decltype(func(std::declval<const T &>()))> result;
+    vec.for_each_block([&](const T *data, std::size_t count) {
+        for (std::size_t i = 0; i < count; ++i)
+            result.emplace_back(func(data[i]));
+    });
+    return result;
+}
+
+// endfold
+
+// startfold unordered maps
+
+/**
+ * @brief Inverts a mapping from key to value into a hash map of value to key.
+ *
+ * This function creates a new `std::unordered_map` whose keys are the values
+ * of the input associative container and whose mapped values are the original
+ * keys. This is useful when performing a reverse lookup.
+ *
+ * @tparam Map An associative container type providing `key_type`,
+ *             `mapped_type`, and iteration over `std::pair<const key_type, mapped_type>`.
+ *
+ * @param m The input map to invert.
+ *
+ * @return std::unordered_map<Map::mapped_type, Map::key_type>
+ *         A new unordered map containing reversed key/value pairs.
+ *
+ * @note If the input container contains duplicate values, only one of the
+ *       corresponding keys will be preserved in the resulting unordered map.
+ *       The specific key that remains depends on hash bucket insertion order.
+ */
+template <typename Map> std::unordered_map<typename Map::mapped_type, typename Map::key_type> invert(const Map &m) {
+    std::unordered_map<typename Map::mapped_type, typename Map::key_type> result;
+    for (const auto &kv : m)
+        result.emplace(kv.second, kv.first);
+    return result;
+}
+
+/*
+ * @brief Apply a function to each key in a modifiable unordered map.
+ *
+ * @tparam K Type of keys in the map.
+ * @tparam V Type of values in the map.
+ * @tparam Func Type of the function to apply. Must be callable with K&.
+ * @param map The unordered map whose keys will be processed.
+ * @param func Function to apply to each key.
+ */
+template <typename K, typename V, typename Func> void for_each_key_in_map(std::unordered_map<K, V> &map, Func func) {
+    for (auto &pair : map) {
+        func(pair.first);
+    }
+}
+
+/**
+ * @brief Apply a function to each value in a modifiable unordered map.
+ *
+ * @note the values are iterated over by reference, and passed ot the function by reference or not depending on the
+ * siganture of the lambda that comes in
+ *
+ * @tparam K Type of keys in the map.
+ * @tparam V Type of values in the map.
+ * @tparam Func Type of the function to apply. Must be callable with V&.
+ * @param map The unordered map whose values will be processed.
+ * @param func Function to apply to each value.
+ */
+template <typename K, typename V, typename Func> void for_each_value_in_map(std::unordered_map<K, V> &map, Func func) {
+    for (auto &pair : map) {
+        func(pair.second);
+    }
+}
+
+/**
+ * @brief Apply a function to each key-value pair of a modifiable unordered_map.
+ *
+ * @tparam Key Type of the keys in the unordered_map.
+ * @tparam Value Type of the values in the unordered_map.
+ * @tparam Func Type of the function to apply. Must be callable with (Key&, Value&).
+ * @param map The unordered_map to process.
+ * @param func Function to apply to each key-value pair.
+ */
+template <typename Key, typename Value, typename Func>
+void for_each_pair_in_map(std::unordered_map<Key, Value> &map, Func func) {
+    for (auto &pair : map) {
+        func(pair.first, pair.second);
+    }
+}
+
+/**
+ * @brief Transform the values of an unordered_map by applying a function to each value.
+ *
+ * @tparam K Type of the keys in the map.
+ * @tparam V Type of the input values in the map.
+ * @tparam Func Type of the function to apply. Must be callable with const V&.
+ * @param input_map Input unordered_map.
+ * @param func Function to apply to each value.
+ * @return A new unordered_map with the same keys and transformed values.
+ */
+template <typename Map, typename Func> auto map_values(const Map &input_map, Func func) {
+    using KeyType = typename Map::key_type;
+    using ValueType = decltype(func(std::declval<typename Map::mapped_type>()));
+
+    std::unordered_map<KeyType, ValueType> result;
+    result.reserve(input_map.size());
+
+    for (const auto &[key, value] : input_map) {
+        // NOTE: move is fine here because func(value) is a temporary that's about to go out of scope
+        // the reason why we prefer move is that if the result is not copy constructible we get errors from this
+        result.emplace(key, std::move(func(value)));
+    }
+    return result;
+}
+
+/**
+ * @brief Transform the entries (key-value pairs) of an unordered_map by applying a function to each pair.
+ *
+ * @tparam K Type of the keys in the input map.
+ * @tparam V Type of the values in the input map.
+ * @tparam Func Type of the function to apply. Must be callable with (const K&, const V&) and return std::pair<K2, V2>.
+ * @param input_map Input unordered_map.
+ * @param func Function to apply to each key-value pair.
+ * @return A new unordered_map with transformed keys and values.
+ */
+template <typename K, typename V, typename Func>
+auto map_entries(const std::unordered_map<K, V> &input_map, Func func) {
+    using PairType = decltype(func(std::declval<const K &>(), std::declval<const V &>()));
+    using K2 = typename PairType::first_type;
+    using V2 = typename PairType::second_type;
+
+    std::unordered_map<K2, V2> result;
+    result.reserve(input_map.size());
+    for (const auto &[key, value] : input_map) {
+        auto [new_key, new_value] = func(key, value);
+        result.emplace(std::move(new_key), std::move(new_value));
+    }
+    return result;
+}
+
+/**
+ * @brief Filter an unordered_map based on a predicate applied to key-value pairs.
+ *
+ * @tparam K Type of keys in the map.
+ * @tparam V Type of values in the map.
+ * @tparam Pred Type of the predicate. Must be callable with (const K&, const V&).
+ * @param input_map Input unordered_map to filter.
+ * @param pred Predicate function that returns true to keep an element, false to remove it.
+ * @return A new unordered_map containing only the key-value pairs for which pred(key, value) is true.
+ */
+template <typename K, typename V, typename Pred>
+std::unordered_map<K, V> filter_map(const std::unordered_map<K, V> &input_map, Pred pred) {
+    std::unordered_map<K, V> result;
+    result.reserve(input_map.size());
+
+    for (const auto &[key, value] : input_map) {
+        if (pred(key, value)) {
+            result.emplace(key, value);
+        }
+    }
+
+    return result;
+}
+
+/**
+ * @brief Filter an unordered_map based on a predicate applied to its keys.
+ *
+ * @tparam K Type of keys in the map.
+ * @tparam V Type of values in the map.
+ * @tparam Pred Type of the predicate. Must be callable with (const K&).
+ * @param input_map Input unordered_map to filter.
+ * @param pred Predicate function that returns true to keep an element, false to remove it.
+ * @return A new unordered_map containing only the key-value pairs for which pred(key) is true.
+ */
+template <typename K, typename V, typename Pred>
+std::unordered_map<K, V> filter_map_by_keys(const std::unordered_map<K, V> &input_map, Pred pred) {
+    std::unordered_map<K, V> result;
+    result.reserve(input_map.size());
+
+    for (const auto &[key, value] : input_map) {
+        if (pred(key)) {
+            result.emplace(key, value);
+        }
+    }
+
+    return result;
+}
+/**
+ * @brief Keep only the entries in an unordered_map whose keys are in a specified set.
+ *
+ * @tparam K Type of keys in the map and the set.
+ * @tparam V Type of values in the map.
+ * @param input_map The unordered_map to filter.
+ * @param key_set The set of keys to keep.
+ * @return std::unordered_map<K, V> A new unordered_map containing only entries with keys in key_set.
+ */
+template <typename K, typename V>
+std::unordered_map<K, V> filter_map_by_key_set(const std::unordered_map<K, V> &input_map,
+                                               const std::unordered_set<K> &key_set) {
+    return filter_map_by_keys(input_map, [&](const K &key) { return key_set.find(key) != key_set.end(); });
+}
+
+/**
+ * @brief Filter an unordered_map based on a predicate applied to its values.
+ *
+ * @tparam K Type of keys in the map.
+ * @tparam V Type of values in the map.
+ * @tparam Pred Type of the predicate. Must be callable with (const V&).
+ * @param input_map Input unordered_map to filter.
+ * @param pred Predicate function that returns true to keep an element, false to remove it.
+ * @return A new unordered_map containing only the key-value pairs for which pred(value) is true.
+ */
+template <typename K, typename V, typename Pred>
+std::unordered_map<K, V> filter_map_by_values(const std::unordered_map<K, V> &input_map, Pred pred) {
+    std::unordered_map<K, V> result;
+    result.reserve(input_map.size());
+
+    for (const auto &[key, value] : input_map) {
+        if (pred(value)) {
+            result.emplace(key, value);
+        }
+    }
+
+    return result;
+}
+
+/**
+ * @brief Build an unordered_map from a vector of objects, using a member or attribute as the key.
+ *
+ * @tparam Key Type of the key to use in the map.
+ * @tparam Value Type of the objects in the vector.
+ * @tparam KeyFunc Callable type that takes a const Value& and returns a Key.
+ * @param vec Vector of objects to convert to a map.
+ * @param key_func Function that extracts the key from a Value.
+ * @return std::unordered_map<Key, Value> The resulting map.
+ *
+ * @note If multiple objects in the vector produce the same key, only the first one encountered will be inserted into
+ * the map. Subsequent objects with duplicate keys will be ignored. Therefore if there is such duplicate data then
+ * information will be lost
+ */
+template <typename Key, typename Value, typename KeyFunc>
+std::unordered_map<Key, Value> build_map_from_vector(const std::vector<Value> &vec, KeyFunc key_func) {
+    std::unordered_map<Key, Value> map;
+    for (const auto &item : vec) {
+        map.emplace(key_func(item), item); // first occurrence wins
+    }
+    return map;
+}
+
+/**
+ * @brief Combine two unordered_maps with the same keyset using a provided binary function.
+ *
+ * @tparam Key Type of the keys in the maps.
+ * @tparam Value1 Type of the values in the first map.
+ * @tparam Value2 Type of the values in the second map.
+ * @tparam ResultType Type of the values in the resulting map.
+ * @tparam Func Callable type that takes (const Value1&, const Value2&) and returns ResultType.
  * @param map1 First unordered_map.
  * @param map2 Second unordered_map.
  * @param func Function to combine corresponding values from map1 and map2.
  * @return std::unordered_map<Key, ResultType> Resulting map after applying func to each value pair.
  *
- * @throws std::invalid_argument if the keysets of the two maps do not match.
+ * @throws std::invalid_argument if the keysets of the two maps do not match.
+ */
+template <typename Key, typename Value1, typename Value2,
+          typename ResultType = decltype(std::declval<Value1>() + std::declval<Value2>()), typename Func>
+std::unordered_map<Key, ResultType> combine_maps(const std::unordered_map<Key, Value1> &map1,
+                                                 const std::unordered_map<Key, Value2> &map2, Func func) {
+    if (map1.size() != map2.size()) {
+        throw std::invalid_argument("Maps do not have the same number of elements");
+    }
+
+    std::unordered_map<Key, ResultType> result;
+
+    for (const auto &pair : map1) {
+        const Key &key = pair.first;
+        auto it2 = map2.find(key);
+        if (it2 == map2.end()) {
+            throw std::invalid_argument("Keysets of the maps do not match");
+        }
+        result[key] = func(pair.second, it2->second);
+    }
+
+    return result;
+}
+
+/**
+ * @brief Filters two maps to only include entries with keys that exist in both maps.
+ *
+ * This function takes two maps of the same type and returns a pair of maps where
+ * each map only contains the keys that are present in both input maps.
+ *
+ * @tparam MapType The type of the input maps. Must support `key_type`, iteration,
+ * and lookup operations. Typically `std::unordered_map` or `std::map`.
+ *
+ * @param map1 The first input map.
+ * @param map2 The second input map.
+ * @return A `std::pair` of filtered maps `{filtered_map1, filtered_map2}` where:
+ *   - `filtered_map1` contains only the entries from `map1` whose keys exist in `map2`.
+ *   - `filtered_map2` contains only the entries from `map2` whose keys exist in `map1`.
+ *
+ * @note Requires helper functions:
+ *   - `keys(const MapType&)` that returns a container of keys in the map.
+ *   - `filter_map_by_key_set(const MapType&, const std::unordered_set<typename MapType::key_type>&)`
+ *     that returns a map containing only the specified keys.
+ */
+template <typename MapType>
+std::pair<MapType, MapType> filter_maps_to_shared_keys(const MapType &map1, const MapType &map2) {
+    auto keys1 = keys(map1);
+    auto keys2 = keys(map2);
+
+    std::unordered_set<typename MapType::key_type> shared_keys;
+    for (auto &k : keys1) {
+        if (keys2.find(k) != keys2.end()) {
+            shared_keys.insert(k);
+        }
+    }
+
+    MapType filtered_map1 = filter_map_by_key_set(map1, shared_keys);
+    MapType filtered_map2 = filter_map_by_key_set(map2, shared_keys);
+
+    return {filtered_map1, filtered_map2};
+}
+
+/**
+ * @brief Extracts all values from an unordered_map into a vector.
+ *
+ * @tparam Key Type of the keys in the map.
+ * @tparam Value Type of the values in the map.
+ * @param map The unordered_map to extract values from.
+ * @return std::vector<Value> A vector containing all values from the map.
+ *
+ * @note The order of values in the resulting vector is unspecified because
+ *       unordered_map does not guarantee ordering.
+ */
+template <typename Key, typename Value> std::vector<Value> values(const std::unordered_map<Key, Value> &map) {
+    std::vector<Value> values;
+    values.reserve(map.size()); // optional: reserve space for efficiency
+    for (const auto &pair : map) {
+        values.push_back(pair.second);
+    }
+    return values;
+}
+
+/**
+ * @brief Extracts all keys from an unordered_map into a vector.
+ *
+ * @tparam Key Type of the keys in the map.
+ * @tparam Value Type of the values in the map.
+ * @param map The unordered_map to extract keys from.
+ * @return std::vector<Key> A vector containing all keys from the map.
+ *
+ * @note The order of keys in the resulting vector is unspecified because
+ *       unordered_map does not guarantee ordering.
+ */
+template <typename Key, typename Value> std::vector<Key> keys(const std::unordered_map<Key, Value> &map) {
+    std::vector<Key> keys;
+    keys.reserve(map.size()); // optional: reserve space for efficiency
+    for (const auto &pair : map) {
+        keys.push_back(pair.first);
+    }
+    return keys;
+}
+
+/**
+ * @brief Extracts all keys from an unordered_map into a static_vector, without allocating.
+ *
+ * @tparam N Capacity of the resulting vector.
+ * @tparam Key Type of the keys in the map.
+ * @tparam Value Type of the values in the map.
+ * @param map The unordered_map to extract keys from.
+ * @return static_vector<Key, N> A static_vector containing all keys from the map.
+ *
+ * @throws std::length_error if the map has more than N entries.
+ */
+template <std::size_t N, typename Key, typename Value>
+static_vector<Key, N> static_keys(const std::unordered_map<Key, Value> &map) {
+    static_vector<Key, N> keys;
+    keys.reserve(map.size());
+    for (const auto &pair : map) {
+        keys.push_back(pair.first);
+    }
+    return keys;
+}
+
+/**
+ * @brief Extracts all values from an unordered_map into a static_vector, without allocating.
+ *
+ * @tparam N Capacity of the resulting vector.
+ * @tparam Key Type of the keys in the map.
+ * @tparam Value Type of the values in the map.
+ * @param map The unordered_map to extract values from.
+ * @return static_vector<Value, N> A static_vector containing all values from the map.
+ *
+ * @throws std::length_error if the map has more than N entries.
+ */
+template <std::size_t N, typename Key, typename Value>
+static_vector<Value, N> static_values(const std::unordered_map<Key, Value> &map) {
+    static_vector<Value, N> values;
+    values.reserve(map.size());
+    for (const auto &pair : map) {
+        values.push_back(pair.second);
+    }
+    return values;
+}
+
+// endfold
+
+// startfold sets
+
+/**
+ * @brief Converts a vector into a set, removing duplicates.
+ *
+ * @tparam T Type of the elements in the vector.
+ * @param vec The vector to convert.
+ * @return std::set<T> A set containing all unique elements from the vector.
+ *
+ * @note The elements in the set are sorted because std::set maintains order.
+ */
+template <typename T> std::set<T> to_set(const std::vector<T> &vec) { return std::set<T>(vec.begin(), vec.end()); }
+
+/**
+ * @brief Converts a vector into an unordered_set, removing duplicates.
+ *
+ * @tparam T Type of the elements in the vector.
+ * @param vec The vector to convert.
+ * @return std::unordered_set<T> An unordered_set containing all unique elements from the vector.
+ *
+ * @note The elements in the unordered_set are not sorted.
+ */
+template <typename T> std::unordered_set<T> to_unordered_set(const std::vector<T> &vec) {
+    return std::unordered_set<T>(vec.begin(), vec.end());
+}
+
+/**
+ * @brief Computes the intersection of two sets.
+ *
+ * @tparam SetType Type of the input sets (std::set or std::unordered_set).
+ * @param a First set.
+ * @param b Second set.
+ * @return SetType A new set containing elements present in both input sets.
+ *
+ * @note For std::set, the result will be ordered. For std::unordered_set, order is unspecified.
+ */
+template <typename SetType> SetType set_intersection(const SetType &a, const SetType &b) {
+    SetType result;
+
+    if constexpr (std::is_same_v<SetType, std::set<typename SetType::value_type>>) {
+        // use std::set_intersection for ordered sets
+        std::set_intersection(a.begin(), a.end(), b.begin(), b.end(), std::inserter(result, result.begin()));
+    } else {
+        // Fallback for unordered_set or other sets
+        for (const auto &elem : a) {
+            if (b.count(elem)) {
+                result.insert(elem);
+            }
+        }
+    }
+
+    return result;
+}
+// endfold
+
+// startfold string interning
+
+/**
+ * @brief Compact handle to a string owned by a string_interner.
+ *
+ * Two handles produced by the same interner are equal if and only if the strings they refer to are equal, so
+ * comparing them is a single integer compare. The hash of the string is computed once when it is interned and
+ * carried inside the handle, so hashed containers keyed by handles never touch the characters again.
+ *
+ * @note Handles from different interners must not be mixed.
+ */
+struct interned_string {
+    std::uint32_t id = std::numeric_limits<std::uint32_t>::max();
+    std::size_t hash = 0;
+
+    bool operator==(const interned_string &other) const { return id == other.id; }
+    bool operator!=(const interned_string &other) const { return id != other.id; }
+
+    /**
+     * @brief Orders handles by intern order, which makes them usable in std::set and std::map.
+     *
+     * @note This is NOT lexicographic order of the underlying strings.
+     */
+    bool operator<(const interned_string &other) const { return id < other.id; }
+};
+
+}; // namespace collection_utils
+
+template <> struct std::hash<collection_utils::interned_string> {
+    std::size_t operator()(const collection_utils::interned_string &s) const noexcept { return s.hash; }
+};
+
+namespace collection_utils {
+
+/**
+ * @brief Thread-safe pool that stores each distinct string once and hands out interned_string handles for it.
+ *
+ * Lookups of strings that are already interned only take a shared lock, so concurrent readers do not contend.
+ * Handles and the string_views returned by view() stay valid for the lifetime of the interner.
+ *
+ * @example
+ * @code
+ * string_interner pool;
+ * std::unordered_map<interned_string, int> counts;
+ * counts[pool.intern("apple")] += 1;
+ * bool has_apple = contains_key(counts, pool.intern("apple")); // integer compare, precomputed hash
+ * @endcode
+ */
+class string_interner {
+  public:
+    string_interner() = default;
+    string_interner(const string_interner &) = delete;
+    string_interner &operator=(const string_interner &) = delete;
+
+    /**
+     * @brief Get the handle for a string, adding it to the pool if it is not there yet.
+     *
+     * @param s The string to intern.
+     * @return interned_string The handle for s.
+     *
+     * @throws std::length_error if the pool already holds 2^32 - 1 strings.
+     */
+    interned_string intern(std::string_view s) {
+        const std::size_t hash = std::hash<std::string_view>{}(s);
+        {
+            std::shared_lock lock(mutex);
+            if (auto it = ids.find(s); it != ids.end())
+                return {it->second, hash};
+        }
+
+        std::unique_lock lock(mutex);
+        // another thread may have interned it between the two locks
+        if (auto it = ids.find(s); it != ids.end())
+            return {it->second, hash};
+
+        if (strings.size() >= std::numeric_limits<std::uint32_t>::max()) {
+            throw std::length_error("string_interner is full");
+        }
+
+        const auto id = static_cast<std::uint32_t>(strings.size());
+        // NOTE: deque never relocates existing elements on push_back, so the string_view keys in ids stay valid
+        const std::string &stored = strings.emplace_back(s);
+        ids.emplace(std::string_view(stored), id);
+        return {id, hash};
+    }
+
+    /**
+     * @brief Get the handle for a string only if it was interned before.
+     *
+     * @param s The string to look up.
+     * @return std::optional<interned_string> The handle, or std::nullopt if s was never interned.
+     */
+    std::optional<interned_string> find(std::string_view s) const {
+        std::shared_lock lock(mutex);
+        if (auto it = ids.find(s); it != ids.end())
+            return interned_string{it->second, std::hash<std::string_view>{}(s)};
+        return std::nullopt;
+    }
+
+    /**
+     * @brief Get the characters behind a handle.
+     *
+     * @param handle A handle produced by this interner.
+     * @return std::string_view A view that stays valid for the lifetime of the interner.
+     *
+     * @throws std::out_of_range if the handle was not produced by this interner.
+     */
+    std::string_view view(interned_string handle) const {
+        std::shared_lock lock(mutex);
+        return strings.at(handle.id);
+    }
+
+    /**
+     * @brief Number of distinct strings in the pool.
+     */
+    std::size_t size() const {
+        std::shared_lock lock(mutex);
+        return strings.size();
+    }
+
+  private:
+    mutable std::shared_mutex mutex;
+    std::deque<std::string> strings;
+    std::unordered_map<std::string_view, std::uint32_t> ids;
+};
+
+/**
+ * @brief Re-key a string keyed map by interned handles.
+ *
+ * The resulting map hashes and compares keys as integers, so every contains_key, at_optional, erase,
+ * set_intersection or invert done on it afterwards avoids string hashing and comparison entirely.
+ *
+ * @tparam Map A map-like type whose key_type is convertible to std::string_view.
+ * @param map The map to convert.
+ * @param interner The pool the keys are interned into.
+ * @return std::unordered_map<interned_string, Map::mapped_type> The re-keyed map.
+ */
+template <typename Map>
+std::unordered_map<interned_string, typename Map::mapped_type> intern_keys(const Map &map, string_interner &interner) {
+    std::unordered_map<interned_string, typename Map::mapped_type> result;
+    result.reserve(map.size());
+    for (const auto &[key, value] : map) {
+        result.emplace(interner.intern(key), value);
+    }
+    return result;
+}
+
+/**
+ * @brief Intern every string in a vector.
+ *
+ * @tparam T Element type, must be convertible to std::string_view.
+ * @param vec The strings to intern.
+ * @param interner The pool the strings are interned into.
+ * @return std::vector<interned_string> The handles, in the same order as vec.
+ */
+template <typename T> std::vector<interned_string> intern_all(const std::vector<T> &vec, string_interner &interner) {
+    std::vector<interned_string> result;
+    result.reserve(vec.size());
+    for (const auto &s : vec) {
+        result.push_back(interner.intern(s));
+    }
+    return result;
+}
+
+// endfold
+
+// startfold slot map
+
+/**
+ * @brief Handle to an element of a slot_map.
+ *
+ * The generation lets the slot map tell a live handle apart from a stale one whose element was erased and whose
+ * slot was later reused.
+ */
+struct slot_map_handle {
+    std::uint32_t index = std::numeric_limits<std::uint32_t>::max();
+    std::uint32_t generation = 0;
+
+    bool operator==(const slot_map_handle &other) const {
+        return index == other.index && generation == other.generation;
+    }
+    bool operator!=(const slot_map_handle &other) const { return !(*this == other); }
+};
+
+/**
+ * @brief Associative container with O(1) insert, erase and lookup whose values are stored contiguously.
+ *
+ * Intended as a replacement for integer keyed std::unordered_map entity tables. Instead of choosing the key, the
+ * caller receives a slot_map_handle on insert. Values live in one dense vector (erase swaps the last value into the
+ * hole), and each handle goes through one level of indirection to find its value. Iterating over the values is a
+ * linear scan of that vector.
+ *
+ * Every slot carries a generation counter which is odd while the slot is occupied and even while it is free, so
+ * handles to erased elements are detected instead of silently aliasing whatever reused the slot.
+ *
+ * @tparam T Type of the stored values.
+ *
+ * @example
+ * @code
+ * slot_map<Entity> entities;
+ * slot_map_handle h = entities.insert(Entity{});
+ * if (auto e = at_optional(entities, h)) { ... }
+ * erase(entities, h);
+ * bool alive = contains_key(entities, h); // false
+ * @endcode
+ */
+template <typename T> class slot_map {
+  public:
+    using key_type = slot_map_handle;
+    using mapped_type = T;
+    using value_type = T;
+    using iterator = typename std::vector<T>::iterator;
+    using const_iterator = typename std::vector<T>::const_iterator;
+
+    /**
+     * @brief Construct a value in place and return its handle.
+     *
+     * @throws std::length_error if the map already holds 2^32 - 1 slots.
+     */
+    template <typename... Args> slot_map_handle emplace(Args &&...args) {
+        const bool reuse = free_head != npos;
+        std::uint32_t slot_index;
+        if (reuse) {
+            slot_index = free_head;
+        } else {
+            if (slots.size() >= npos) {
+                throw std::length_error("slot_map is full");
+            }
+            slot_index = static_cast<std::uint32_t>(slots.size());
+            slots.push_back({npos, 0});
+        }
+
+        // the free list is only advanced once the element exists, so a throwing constructor loses no slot
+        try {
+            dense.emplace_back(std::forward<Args>(args)...);
+            dense_to_slot.push_back(slot_index);
+        } catch (...) {
+            if (dense.size() != dense_to_slot.size())
+                dense.pop_back();
+            if (!reuse)
+                slots.pop_back();
+            throw;
+        }
+        if (reuse)
+            free_head = slots[slot_index].dense_index;
+
+        slot &s = slots[slot_index];
+        s.dense_index = static_cast<std::uint32_t>(dense.size() - 1);
+        ++s.generation; // becomes odd: occupied
+        return {slot_index, s.generation};
+    }
+
+    slot_map_handle insert(const T &value) { return emplace(value); }
+    slot_map_handle insert(T &&value) { return emplace(std::move(value)); }
+
+    /**
+     * @brief Erase the element referred to by a handle.
+     *
+     * @return true if the handle was live and its element was erased, false otherwise.
+     */
+    bool erase(slot_map_handle handle) {
+        if (!contains(handle))
+            return false;
+
+        slot &s = slots[handle.index];
+        const std::uint32_t hole = s.dense_index;
+        const std::uint32_t last = static_cast<std::uint32_t>(dense.size() - 1);
+        if (hole != last) {
+            dense[hole] = std::move(dense[last]);
+            dense_to_slot[hole] = dense_to_slot[last];
+            slots[dense_to_slot[hole]].dense_index = hole;
+        }
+        dense.pop_back();
+        dense_to_slot.pop_back();
+
+        ++s.generation; // becomes even: free
+        s.dense_index = free_head;
+        free_head = handle.index;
+        return true;
+    }
+
+    bool contains(slot_map_handle handle) const {
+        return handle.index < slots.size() && slots[handle.index].generation == handle.generation &&
+               (handle.generation & 1u) == 1u;
+    }
+
+    /**
+     * @brief Get a pointer to the value for a handle.
+     *
+     * @return A pointer to the value, or nullptr if the handle is stale or invalid. The pointer is invalidated by any
+     * insert or erase.
+     */
+    T *get(slot_map_handle handle) { return contains(handle) ? &dense[slots[handle.index].dense_index] : nullptr; }
+    const T *get(slot_map_handle handle) const {
+        return contains(handle) ? &dense[slots[handle.index].dense_index] : nullptr;
+    }
+
+    /**
+     * @brief Get the handle of the value at a position in the dense storage, i.e. of *(begin() + dense_index).
+     */
+    slot_map_handle handle_at(std::size_t dense_index) const {
+        const std::uint32_t slot_index = dense_to_slot[dense_index];
+        return {slot_index, slots[slot_index].generation};
+    }
+
+    void reserve(std::size_t n) {
+        dense.reserve(n);
+        dense_to_slot.reserve(n);
+        slots.reserve(n);
+    }
+
+    /**
+     * @brief Erase every element. All outstanding handles become stale.
+     */
+    void clear() {
+        while (!dense.empty()) {
+            erase(handle_at(dense.size() - 1));
+        }
+    }
+
+    std::size_t size() const { return dense.size(); }
+    bool empty() const { return dense.empty(); }
+
+    iterator begin() { return dense.begin(); }
+    iterator end() { return dense.end(); }
+    const_iterator begin() const { return dense.begin(); }
+    const_iterator end() const { return dense.end(); }
+
+    /**
+     * @brief The contiguous value storage, in no particular order.
+     */
+    const std::vector<T> &dense_values() const { return dense; }
+
+  private:
+    static constexpr std::uint32_t npos = std::numeric_limits<std::uint32_t>::max();
+
+    struct slot {
+        // index into dense while occupied, next free slot while free
+        std::uint32_t dense_index;
+        std::uint32_t generation;
+    };
+
+    std::vector<T> dense;
+    std::vector<std::uint32_t> dense_to_slot;
+    std::vector<slot> slots;
+    std::uint32_t free_head = npos;
+};
+
+/**
+ * @brief Check if a handle refers to a live element of a slot_map.
+ *
+ * @tparam T Type of the values in the slot map.
+ * @param map The slot map to search within.
+ * @param handle The handle to check.
+ * @return true if the handle is live, false if it is stale or invalid.
+ */
+template <typename T> bool contains_key(const slot_map<T> &map, const slot_map_handle &handle) {
+    return map.contains(handle);
+}
+
+/**
+ * @brief Check if a handle does NOT refer to a live element of a slot_map.
+ *
+ * @tparam T Type of the values in the slot map.
+ * @param map The slot map to search within.
+ * @param handle The handle to check.
+ * @return true if the handle is stale or invalid, false otherwise.
+ */
+template <typename T> bool does_not_contain_key(const slot_map<T> &map, const slot_map_handle &handle) {
+    return !map.contains(handle);
+}
+
+/**
+ * @brief Safely get a const reference to a value in a slot_map.
+ *
+ * @tparam T Type of the values in the slot map.
+ * @param map The slot map to query.
+ * @param handle The handle to look up.
+ * @return std::optional<std::reference_wrapper<const T>> The value, or std::nullopt if the handle is not live.
+ */
+template <typename T>
+std::optional<std::reference_wrapper<const T>> at_optional(const slot_map<T> &map, const slot_map_handle &handle) {
+    if (const T *value = map.get(handle))
+        return std::cref(*value);
+    return std::nullopt;
+}
+
+/**
+ * @brief Safely get a mutable reference to a value in a slot_map.
+ *
+ * @tparam T Type of the values in the slot map.
+ * @param map The slot map to query.
+ * @param handle The handle to look up.
+ * @return std::optional<std::reference_wrapper<T>> The value, or std::nullopt if the handle is not live.
+ */
+template <typename T>
+std::optional<std::reference_wrapper<T>> at_optional(slot_map<T> &map, const slot_map_handle &handle) {
+    if (T *value = map.get(handle))
+        return std::ref(*value);
+    return std::nullopt;
+}
+
+/**
+ * @brief Erase an element from a slot_map by handle, if it is live.
+ *
+ * @tparam T Type of the values in the slot map.
+ * @param map The slot map to modify.
+ * @param handle The handle of the element to erase.
+ * @return true if an element was erased, false otherwise.
+ */
+template <typename T> bool erase(slot_map<T> &map, const slot_map_handle &handle) { return map.erase(handle); }
+
+/**
+ * @brief Apply a function to each value in a slot_map, scanning the contiguous value storage.
+ *
+ * @tparam T Type of the values in the slot map.
+ * @tparam Func Type of the function to apply. Must be callable with T&.
+ * @param map The slot map whose values will be processed.
+ * @param func Function to apply to each value.
+ */
+template <typename T, typename Func> void for_each_value_in_map(slot_map<T> &map, Func func) {
+    for (auto &value : map) {
+        func(value);
+    }
+}
+
+/**
+ * @brief Apply a function to each live handle in a slot_map.
+ *
+ * @tparam T Type of the values in the slot map.
+ * @tparam Func Type of the function to apply. Must be callable with slot_map_handle.
+ * @param map The slot map whose handles will be processed.
+ * @param func Function to apply to each handle.
+ */
+template <typename T, typename Func> void for_each_key_in_map(const slot_map<T> &map, Func func) {
+    for (std::size_t i = 0; i < map.size(); ++i) {
+        func(map.handle_at(i));
+    }
+}
+
+/**
+ * @brief Apply a function to each handle-value pair of a slot_map.
+ *
+ * @tparam T Type of the values in the slot map.
+ * @tparam Func Type of the function to apply. Must be callable with (slot_map_handle, T&).
+ * @param map The slot map to process.
+ * @param func Function to apply to each handle-value pair.
+ */
+template <typename T, typename Func> void for_each_pair_in_map(slot_map<T> &map, Func func) {
+    for (std::size_t i = 0; i < map.size(); ++i) {
+        func(map.handle_at(i), *(map.begin() + static_cast<std::ptrdiff_t>(i)));
+    }
+}
+
+/**
+ * @brief Extracts all values from a slot_map into a vector.
+ *
+ * @tparam T Type of the values in the slot map.
+ * @param map The slot map to extract values from.
+ * @return std::vector<T> A copy of the dense value storage.
+ */
+template <typename T> std::vector<T> values(const slot_map<T> &map) { return map.dense_values(); }
+
+/**
+ * @brief Extracts all live handles from a slot_map into a vector.
+ *
+ * @tparam T Type of the values in the slot map.
+ * @param map The slot map to extract handles from.
+ * @return std::vector<slot_map_handle> The handles, in the same order as values(map).
+ */
+template <typename T> std::vector<slot_map_handle> keys(const slot_map<T> &map) {
+    std::vector<slot_map_handle> keys;
+    keys.reserve(map.size());
+    for (std::size_t i = 0; i < map.size(); ++i) {
+        keys.push_back(map.handle_at(i));
+    }
+    return keys;
+}
+
+// endfold
+
+// startfold sparse sets
+
+/**
+ * @brief Set of small unsigned integers in [0, universe) backed by a dense array and a sparse index array.
+ *
+ * insert, erase, contains and clear are all O(1); in particular clear does not touch the sparse array, it only
+ * forgets the dense elements. Iteration walks the dense array, so it costs O(size) rather than O(universe).
+ * The sparse array costs one 32 bit index per possible key and is zero initialized once on construction.
+ *
+ * @tparam Key An unsigned integer type.
+ *
+ * @example
+ * @code
+ * sparse_set<std::uint32_t> visible(4096);
+ * visible.insert(17);
+ * bool seen = contains_key(visible, 17u); // true
+ * visible.clear();                        // O(1)
+ * @endcode
+ */
+template <typename Key = std::uint32_t> class sparse_set {
+    static_assert(std::is_integral_v<Key> && std::is_unsigned_v<Key>, "sparse_set keys must be unsigned integers");
+
+  public:
+    using key_type = Key;
+    using value_type = Key;
+    using const_iterator = typename std::vector<Key>::const_iterator;
+    using iterator = const_iterator;
+
+    /**
+     * @param universe One past the largest key that will ever be stored.
+     *
+     * @throws std::length_error if universe does not fit in 32 bits.
+     */
+    explicit sparse_set(std::size_t universe) {
+        if (universe > std::numeric_limits<std::uint32_t>::max()) {
+            throw std::length_error("sparse_set universe must fit in 32 bits");
+        }
+        sparse.resize(universe);
+    }
+
+    /**
+     * @brief Insert a key.
+     *
+     * @return true if the key was inserted, false if it was already present.
+     *
+     * @throws std::out_of_range if key is not smaller than the universe.
+     */
+    bool insert(Key key) {
+        if (static_cast<std::size_t>(key) >= sparse.size()) {
+            throw std::out_of_range("sparse_set key outside of universe");
+        }
+        if (contains(key))
+            return false;
+        sparse[key] = static_cast<std::uint32_t>(dense.size());
+        dense.push_back(key);
+        return true;
+    }
+
+    /**
+     * @brief Erase a key by moving the last dense element into its place.
+     *
+     * @return true if the key was erased, false if it was not present.
+     */
+    bool erase(Key key) {
+        if (!contains(key))
+            return false;
+        const std::uint32_t hole = sparse[key];
+        const Key last = dense.back();
+        dense[hole] = last;
+        sparse[last] = hole;
+        dense.pop_back();
+        return true;
+    }
+
+    bool contains(Key key) const {
+        // NOTE: sparse entries for absent keys may hold any stale index, the dense back-reference validates it
+        return static_cast<std::size_t>(key) < sparse.size() && sparse[key] < dense.size() &&
+               dense[sparse[key]] == key;
+    }
+
+    void clear() { dense.clear(); }
+
+    std::size_t size() const { return dense.size(); }
+    bool empty() const { return dense.empty(); }
+    std::size_t universe() const { return sparse.size(); }
+
+    const_iterator begin() const { return dense.begin(); }
+    const_iterator end() const { return dense.end(); }
+
+    /**
+     * @brief The elements in insertion order, modulo reordering caused by erase.
+     */
+    const std::vector<Key> &dense_keys() const { return dense; }
+
+    /**
+     * @brief Position of a key in dense_keys(). Only meaningful if contains(key).
+     */
+    std::size_t index_of(Key key) const { return sparse[key]; }
+
+  private:
+    std::vector<Key> dense;
+    std::vector<std::uint32_t> sparse;
+};
+
+/**
+ * @brief Map from small unsigned integers in [0, universe) to values, using the same layout as sparse_set.
+ *
+ * Keys and values are stored in parallel dense arrays, so iterating over either of them is a linear scan.
+ * clear only destroys the stored values, it never touches the sparse array.
+ *
+ * @tparam Key An unsigned integer type.
+ * @tparam Value Type of the mapped values.
+ */
+template <typename Key, typename Value> class sparse_map {
+    static_assert(std::is_integral_v<Key> && std::is_unsigned_v<Key>, "sparse_map keys must be unsigned integers");
+
+  public:
+    using key_type = Key;
+    using mapped_type = Value;
+
+    /**
+     * @param universe One past the largest key that will ever be stored.
+     *
+     * @throws std::length_error if universe does not fit in 32 bits.
+     */
+    explicit sparse_map(std::size_t universe) : keys_set(universe) {}
+
+    /**
+     * @brief Insert a value if the key is not present yet.
+     *
+     * @return true if the value was inserted, false if the key was already present (the map is left unchanged).
+     *
+     * @throws std::out_of_range if key is not smaller than the universe.
+     */
+    template <typename... Args> bool emplace(Key key, Args &&...args) {
+        if (keys_set.contains(key))
+            return false;
+        // the value goes in first, so a throwing constructor leaves no key without a value behind it
+        dense_values.emplace_back(std::forward<Args>(args)...);
+        try {
+            keys_set.insert(key);
+        } catch (...) {
+            dense_values.pop_back();
+            throw;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Insert a value or overwrite the existing one.
+     *
+     * @throws std::out_of_range if key is not smaller than the universe.
+     */
+    template <typename V> void insert_or_assign(Key key, V &&value) {
+        if (Value *existing = get(key)) {
+            *existing = std::forward<V>(value);
+        } else {
+            emplace(key, std::forward<V>(value));
+        }
+    }
+
+    bool erase(Key key) {
+        if (!keys_set.contains(key))
+            return false;
+        const std::size_t hole = index_of(key);
+        if (hole != dense_values.size() - 1) {
+            dense_values[hole] = std::move(dense_values.back());
+        }
+        dense_values.pop_back();
+        // sparse_set::erase performs the same swap on the key array
+        keys_set.erase(key);
+        return true;
+    }
+
+    bool contains(Key key) const { return keys_set.contains(key); }
+
+    Value *get(Key key) { return keys_set.contains(key) ? &dense_values[index_of(key)] : nullptr; }
+    const Value *get(Key key) const { return keys_set.contains(key) ? &dense_values[index_of(key)] : nullptr; }
+
+    void clear() {
+        keys_set.clear();
+        dense_values.clear();
+    }
+
+    std::size_t size() const { return dense_values.size(); }
+    bool empty() const { return dense_values.empty(); }
+    std::size_t universe() const { return keys_set.universe(); }
+
+    const std::vector<Key> &dense_keys() const { return keys_set.dense_keys(); }
+    std::vector<Value> &values() { return dense_values; }
+    const std::vector<Value> &values() const { return dense_values; }
+
+  private:
+    std::size_t index_of(Key key) const { return keys_set.index_of(key); }
+
+    sparse_set<Key> keys_set;
+    std::vector<Value> dense_values;
+};
+
+/**
+ * @brief Check if a key exists in a sparse_set.
+ *
+ * @tparam Key Type of the keys in the set.
+ * @param set The sparse set to search within.
+ * @param key The key to search for.
+ * @return true if the key exists, false otherwise.
+ */
+template <typename Key>
+bool contains_key(const sparse_set<Key> &set, const typename sparse_set<Key>::key_type &key) {
+    return set.contains(key);
+}
+
+/**
+ * @brief Check if a key does NOT exist in a sparse_set.
+ *
+ * @tparam Key Type of the keys in the set.
+ * @param set The sparse set to search within.
+ * @param key The key to check for absence.
+ * @return true if the key does NOT exist, false otherwise.
+ */
+template <typename Key>
+bool does_not_contain_key(const sparse_set<Key> &set, const typename sparse_set<Key>::key_type &key) {
+    return !set.contains(key);
+}
+
+/**
+ * @brief Check if a key exists in a sparse_map.
+ *
+ * @tparam Key Type of the keys in the map.
+ * @tparam Value Type of the values in the map.
+ * @param map The sparse map to search within.
+ * @param key The key to search for.
+ * @return true if the key exists in the map, false otherwise.
+ */
+template <typename Key, typename Value>
+bool contains_key(const sparse_map<Key, Value> &map, const typename sparse_map<Key, Value>::key_type &key) {
+    return map.contains(key);
+}
+
+/**
+ * @brief Check if a key does NOT exist in a sparse_map.
+ *
+ * @tparam Key Type of the keys in the map.
+ * @tparam Value Type of the values in the map.
+ * @param map The sparse map to search within.
+ * @param key The key to check for absence.
+ * @return true if the key does NOT exist in the map, false otherwise.
+ */
+template <typename Key, typename Value>
+bool does_not_contain_key(const sparse_map<Key, Value> &map, const typename sparse_map<Key, Value>::key_type &key) {
+    return !map.contains(key);
+}
+
+/**
+ * @brief Erase a key from a sparse_set, if it exists.
+ *
+ * @tparam Key Type of the keys in the set.
+ * @param set The set to modify.
+ * @param key The key to erase.
+ * @return true if the key was erased, false otherwise.
+ */
+template <typename Key> bool erase(sparse_set<Key> &set, const typename sparse_set<Key>::key_type &key) {
+    return set.erase(key);
+}
+
+/**
+ * @brief Erase an entry from a sparse_map by key, if it exists.
+ *
+ * @tparam Key Type of the keys in the map.
+ * @tparam Value Type of the values in the map.
+ * @param map The sparse map to modify.
+ * @param key The key of the entry to erase.
+ * @return true if an entry was erased, false otherwise.
+ */
+template <typename Key, typename Value>
+bool erase(sparse_map<Key, Value> &map, const typename sparse_map<Key, Value>::key_type &key) {
+    return map.erase(key);
+}
+
+/**
+ * @brief Safely get a const reference to a value in a sparse_map.
+ *
+ * @tparam Key Type of the keys in the map.
+ * @tparam Value Type of the values in the map.
+ * @param map The sparse map to query.
+ * @param key The key to look for.
+ * @return std::optional<std::reference_wrapper<const Value>> The value, or std::nullopt if the key is not found.
+ */
+template <typename Key, typename Value>
+std::optional<std::reference_wrapper<const Value>>
+at_optional(const sparse_map<Key, Value> &map, const typename sparse_map<Key, Value>::key_type &key) {
+    if (const Value *value = map.get(key))
+        return std::cref(*value);
+    return std::nullopt;
+}
+
+/**
+ * @brief Safely get a mutable reference to a value in a sparse_map.
+ *
+ * @tparam Key Type of the keys in the map.
+ * @tparam Value Type of the values in the map.
+ * @param map The sparse map to query.
+ * @param key The key to look for.
+ * @return std::optional<std::reference_wrapper<Value>> The value, or std::nullopt if the key is not found.
+ */
+template <typename Key, typename Value>
+std::optional<std::reference_wrapper<Value>> at_optional(sparse_map<Key, Value> &map,
+                                                         const typename sparse_map<Key, Value>::key_type &key) {
+    if (Value *value = map.get(key))
+        return std::ref(*value);
+    return std::nullopt;
+}
+
+/**
+ * @brief Apply a function to each key in a sparse_map, scanning the dense key array.
+ *
+ * @tparam Key Type of the keys in the map.
+ * @tparam Value Type of the values in the map.
+ * @tparam Func Type of the function to apply. Must be callable with const Key&.
+ * @param map The sparse map whose keys will be processed.
+ * @param func Function to apply to each key.
+ */
+template <typename Key, typename Value, typename Func>
+void for_each_key_in_map(const sparse_map<Key, Value> &map, Func func) {
+    for (const auto &key : map.dense_keys()) {
+        func(key);
+    }
+}
+
+/**
+ * @brief Apply a function to each value in a sparse_map, scanning the dense value array.
+ *
+ * @tparam Key Type of the keys in the map.
+ * @tparam Value Type of the values in the map.
+ * @tparam Func Type of the function to apply. Must be callable with Value&.
+ * @param map The sparse map whose values will be processed.
+ * @param func Function to apply to each value.
+ */
+template <typename Key, typename Value, typename Func>
+void for_each_value_in_map(sparse_map<Key, Value> &map, Func func) {
+    for (auto &value : map.values()) {
+        func(value);
+    }
+}
+
+/**
+ * @brief Apply a function to each key-value pair of a sparse_map.
+ *
+ * @tparam Key Type of the keys in the map.
+ * @tparam Value Type of the values in the map.
+ * @tparam Func Type of the function to apply. Must be callable with (const Key&, Value&).
+ * @param map The sparse map to process.
+ * @param func Function to apply to each key-value pair.
+ */
+template <typename Key, typename Value, typename Func>
+void for_each_pair_in_map(sparse_map<Key, Value> &map, Func func) {
+    const auto &dense_keys = map.dense_keys();
+    auto &dense_values = map.values();
+    for (std::size_t i = 0; i < dense_keys.size(); ++i) {
+        func(dense_keys[i], dense_values[i]);
+    }
+}
+
+/**
+ * @brief Extracts all keys from a sparse_map into a vector.
+ *
+ * @tparam Key Type of the keys in the map.
+ * @tparam Value Type of the values in the map.
+ * @param map The sparse map to extract keys from.
+ * @return std::vector<Key> A copy of the dense key array.
+ */
+template <typename Key, typename Value> std::vector<Key> keys(const sparse_map<Key, Value> &map) {
+    return map.dense_keys();
+}
+
+/**
+ * @brief Extracts all values from a sparse_map into a vector.
+ *
+ * @tparam Key Type of the keys in the map.
+ * @tparam Value Type of the values in the map.
+ * @param map The sparse map to extract values from.
+ * @return std::vector<Value> A copy of the dense value array, in the same order as keys(map).
+ */
+template <typename Key, typename Value> std::vector<Value> values(const sparse_map<Key, Value> &map) {
+    return map.values();
+}
+
+/**
+ * @brief Converts a vector of small unsigned integers into a sparse_set, removing duplicates.
+ *
+ * @tparam Key Type of the elements in the vector.
+ * @param vec The vector to convert.
+ * @param universe One past the largest key the set will ever hold.
+ * @return sparse_set<Key> A sparse set containing all unique elements from the vector.
+ *
+ * @throws std::out_of_range if an element is not smaller than universe.
+ */
+template <typename Key> sparse_set<Key> to_sparse_set(const std::vector<Key> &vec, std::size_t universe) {
+    sparse_set<Key> result(universe);
+    for (const auto &key : vec) {
+        result.insert(key);
+    }
+    return result;
+}
+
+/**
+ * @brief Computes the intersection of two sparse_sets.
+ *
+ * Only the dense array of the smaller set is iterated, each element is checked against the larger one in O(1),
+ * so this costs O(min(|a|, |b|)) plus allocating the result's sparse array.
+ *
+ * @tparam Key Type of the elements.
+ * @param a First set.
+ * @param b Second set.
+ * @return sparse_set<Key> A new set over the smaller of the two universes containing the elements present in both.
+ */
+template <typename Key> sparse_set<Key> set_intersection(const sparse_set<Key> &a, const sparse_set<Key> &b) {
+    const sparse_set<Key> &smaller = a.size() <= b.size() ? a : b;
+    const sparse_set<Key> &larger = a.size() <= b.size() ? b : a;
+
+    sparse_set<Key> result(std::min(a.universe(), b.universe()));
+    for (const auto &key : smaller) {
+        if (larger.contains(key)) {
+            result.insert(key);
+        }
+    }
+    return result;
+}
+
+// endfold
+
+// startfold dense maps
+
+namespace detail {
+/**
+ * @brief Index of the lowest set bit. bits must not be zero.
+ */
+inline unsigned count_trailing_zeros(std::uint64_t bits) {
+#if defined(__cpp_lib_bitops)
+    return static_cast<unsigned>(std::countr_zero(bits));
+#elif defined(__GNUC__) || defined(__clang__)
+    return static_cast<unsigned>(__builtin_ctzll(bits));
+#else
+    unsigned n = 0;
+    while ((bits & 1u) == 0) {
+        bits >>= 1;
+        ++n;
+    }
+    return n;
+#endif
+}
+
+/**
+ * @brief Map an integer or enum key onto unsigned long long without changing its order, so the offset between two
+ * keys is an exact unsigned subtraction even for the extreme int64 and uint64 values.
+ */
+template <typename Key> unsigned long long dense_key_to_unsigned(Key key) {
+    if constexpr (std::is_enum_v<Key>) {
+        return dense_key_to_unsigned(static_cast<std::underlying_type_t<Key>>(key));
+    } else if constexpr (std::is_signed_v<Key>) {
+        return static_cast<unsigned long long>(static_cast<long long>(key)) ^ (1ull << 63);
+    } else {
+        return static_cast<unsigned long long>(key);
+    }
+}
+
+/**
+ * @brief Inverse of dense_key_to_unsigned.
+ */
+template <typename Key> Key dense_key_from_unsigned(unsigned long long value) {
+    if constexpr (std::is_enum_v<Key>) {
+        return static_cast<Key>(dense_key_from_unsigned<std::underlying_type_t<Key>>(value));
+    } else if constexpr (std::is_signed_v<Key>) {
+        return static_cast<Key>(static_cast<long long>(value ^ (1ull << 63)));
+    } else {
+        return static_cast<Key>(value);
+    }
+}
+
+template <typename Key> long long dense_key_to_integer(Key key) {
+    if constexpr (std::is_enum_v<Key>) {
+        return static_cast<long long>(static_cast<std::underlying_type_t<Key>>(key));
+    } else {
+        return static_cast<long long>(key);
+    }
+}
+} // namespace detail
+
+/**
+ * @brief Map for integer or enum keys in a small contiguous range, stored as a directly indexed array.
+ *
+ * A key k lives at index k - min_key, and a presence bitmap records which indices hold a value, so lookups are a
+ * subtraction and a bit test instead of a hash and a bucket walk. Iteration skips empty words of the bitmap 64
+ * entries at a time and visits keys in ascending order.
+ *
+ * @tparam Key An integral or enum type.
+ * @tparam Value Type of the mapped values, must be default constructible (unused slots hold Value{}).
+ *
+ * @example
+ * @code
+ * enum class Slot { head, chest, legs, count };
+ * enum_map<Slot, Item> equipped(static_cast<std::size_t>(Slot::count));
+ * equipped.insert_or_assign(Slot::head, helmet);
+ * bool wearing_helmet = contains_key(equipped, Slot::head);
+ * @endcode
+ */
+template <typename Key, typename Value> class dense_map {
+    static_assert(std::is_integral_v<Key> || std::is_enum_v<Key>, "dense_map keys must be integers or enums");
+
+  public:
+    using key_type = Key;
+    using mapped_type = Value;
+
+    /**
+     * @brief Create a map for keys in [min_key, min_key + capacity).
+     */
+    dense_map(Key min_key, std::size_t capacity)
+        : min_key(min_key), slots(capacity), presence((capacity + 63) / 64, 0) {}
+
+    /**
+     * @brief Create a map for keys in [0, capacity).
+     */
+    explicit dense_map(std::size_t capacity) : dense_map(Key{}, capacity) {}
+
+    /**
+     * @brief Insert a value if the key is not present yet.
+     *
+     * @return true if the value was inserted, false if the key was already present (the map is left unchanged).
+     *
+     * @throws std::out_of_range if the key is outside of the map's range.
+     */
+    template <typename V> bool insert(Key key, V &&value) {
+        const std::size_t i = checked_index(key);
+        if (test(i))
+            return false;
+        slots[i] = std::forward<V>(value);
+        set(i);
+        ++count;
+        return true;
+    }
+
+    /**
+     * @brief Insert a value or overwrite the existing one.
+     *
+     * @throws std::out_of_range if the key is outside of the map's range.
+     */
+    template <typename V> void insert_or_assign(Key key, V &&value) {
+        const std::size_t i = checked_index(key);
+        slots[i] = std::forward<V>(value);
+        if (!test(i)) {
+            set(i);
+            ++count;
+        }
+    }
+
+    bool erase(Key key) {
+        if (!contains(key))
+            return false;
+        const std::size_t i = index_of(key);
+        slots[i] = Value{}; // release whatever the value owns
+        presence[i / 64] &= ~(std::uint64_t{1} << (i % 64));
+        --count;
+        return true;
+    }
+
+    bool contains(Key key) const { return in_range(key) && test(index_of(key)); }
+
+    Value *get(Key key) { return contains(key) ? &slots[index_of(key)] : nullptr; }
+    const Value *get(Key key) const { return contains(key) ? &slots[index_of(key)] : nullptr; }
+
+    void clear() {
+        for_each([](Key, Value &value) { value = Value{}; });
+        std::fill(presence.begin(), presence.end(), 0);
+        count = 0;
+    }
+
+    std::size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    std::size_t capacity() const { return slots.size(); }
+    Key lowest_key() const { return min_key; }
+
+    /**
+     * @brief Apply a function to every present entry in ascending key order.
+     *
+     * @tparam Func Callable with (Key, Value&).
+     */
+    template <typename Func> void for_each(Func &&func) {
+        for_each_index([&](std::size_t i) { func(key_at(i), slots[i]); });
+    }
+
+    /**
+     * @brief Apply a function to every present entry in ascending key order.
+     *
+     * @tparam Func Callable with (Key, const Value&).
+     */
+    template <typename Func> void for_each(Func &&func) const {
+        for_each_index([&](std::size_t i) { func(key_at(i), slots[i]); });
+    }
+
+  private:
+    bool in_range(Key key) const {
+        const unsigned long long k = detail::dense_key_to_unsigned(key);
+        const unsigned long long lowest = detail::dense_key_to_unsigned(min_key);
+        return k >= lowest && k - lowest < slots.size();
+    }
+
+    std::size_t index_of(Key key) const {
+        return static_cast<std::size_t>(detail::dense_key_to_unsigned(key) - detail::dense_key_to_unsigned(min_key));
+    }
+
+    std::size_t checked_index(Key key) const {
+        if (!in_range(key)) {
+            throw std::out_of_range("dense_map key outside of range");
+        }
+        return index_of(key);
+    }
+
+    Key key_at(std::size_t i) const {
+        return detail::dense_key_from_unsigned<Key>(detail::dense_key_to_unsigned(min_key) + i);
+    }
+
+    bool test(std::size_t i) const { return (presence[i / 64] >> (i % 64)) & 1u; }
+    void set(std::size_t i) { presence[i / 64] |= std::uint64_t{1} << (i % 64); }
+
+    template <typename Func> void for_each_index(Func &&func) const {
+        for (std::size_t w = 0; w < presence.size(); ++w) {
+            std::uint64_t bits = presence[w];
+            while (bits != 0) {
+                func(w * 64 + detail::count_trailing_zeros(bits));
+                bits &= bits - 1; // clear lowest set bit
+            }
+        }
+    }
+
+    Key min_key;
+    std::vector<Value> slots;
+    std::vector<std::uint64_t> presence;
+    std::size_t count = 0;
+};
+
+/**
+ * @brief A dense_map keyed by an enum. Give it the number of enumerators (or one past the largest) as capacity.
+ */
+template <typename Enum, typename Value> using enum_map = dense_map<Enum, Value>;
+
+/**
+ * @brief Check if a key exists in a dense_map.
+ *
+ * @tparam Key Type of the keys in the map.
+ * @tparam Value Type of the values in the map.
+ * @param map The dense map to search within.
+ * @param key The key to search for.
+ * @return true if the key exists in the map, false otherwise.
+ */
+template <typename Key, typename Value>
+bool contains_key(const dense_map<Key, Value> &map, const typename dense_map<Key, Value>::key_type &key) {
+    return map.contains(key);
+}
+
+/**
+ * @brief Check if a key does NOT exist in a dense_map.
+ *
+ * @tparam Key Type of the keys in the map.
+ * @tparam Value Type of the values in the map.
+ * @param map The dense map to search within.
+ * @param key The key to check for absence.
+ * @return true if the key does NOT exist in the map, false otherwise.
+ */
+template <typename Key, typename Value>
+bool does_not_contain_key(const dense_map<Key, Value> &map, const typename dense_map<Key, Value>::key_type &key) {
+    return !map.contains(key);
+}
+
+/**
+ * @brief Erase an entry from a dense_map by key, if it exists.
+ *
+ * @tparam Key Type of the keys in the map.
+ * @tparam Value Type of the values in the map.
+ * @param map The dense map to modify.
+ * @param key The key of the entry to erase.
+ * @return true if an entry was erased, false otherwise.
+ */
+template <typename Key, typename Value>
+bool erase(dense_map<Key, Value> &map, const typename dense_map<Key, Value>::key_type &key) {
+    return map.erase(key);
+}
+
+/**
+ * @brief Safely get a const reference to a value in a dense_map.
+ *
+ * @tparam Key Type of the keys in the map.
+ * @tparam Value Type of the values in the map.
+ * @param map The dense map to query.
+ * @param key The key to look for.
+ * @return std::optional<std::reference_wrapper<const Value>> The value, or std::nullopt if the key is not found.
+ */
+template <typename Key, typename Value>
+std::optional<std::reference_wrapper<const Value>>
+at_optional(const dense_map<Key, Value> &map, const typename dense_map<Key, Value>::key_type &key) {
+    if (const Value *value = map.get(key))
+        return std::cref(*value);
+    return std::nullopt;
+}
+
+/**
+ * @brief Safely get a mutable reference to a value in a dense_map.
+ *
+ * @tparam Key Type of the keys in the map.
+ * @tparam Value Type of the values in the map.
+ * @param map The dense map to query.
+ * @param key The key to look for.
+ * @return std::optional<std::reference_wrapper<Value>> The value, or std::nullopt if the key is not found.
+ */
+template <typename Key, typename Value>
+std::optional<std::reference_wrapper<Value>> at_optional(dense_map<Key, Value> &map,
+                                                         const typename dense_map<Key, Value>::key_type &key) {
+    if (Value *value = map.get(key))
+        return std::ref(*value);
+    return std::nullopt;
+}
+
+/**
+ * @brief Apply a function to each key in a dense_map, in ascending key order.
+ *
+ * @tparam Key Type of the keys in the map.
+ * @tparam Value Type of the values in the map.
+ * @tparam Func Type of the function to apply. Must be callable with Key.
+ * @param map The dense map whose keys will be processed.
+ * @param func Function to apply to each key.
+ */
+template <typename Key, typename Value, typename Func>
+void for_each_key_in_map(const dense_map<Key, Value> &map, Func func) {
+    map.for_each([&](Key key, const Value &) { func(key); });
+}
+
+/**
+ * @brief Apply a function to each value in a dense_map, in ascending key order.
+ *
+ * @tparam Key Type of the keys in the map.
+ * @tparam Value Type of the values in the map.
+ * @tparam Func Type of the function to apply. Must be callable with Value&.
+ * @param map The dense map whose values will be processed.
+ * @param func Function to apply to each value.
+ */
+template <typename Key, typename Value, typename Func>
+void for_each_value_in_map(dense_map<Key, Value> &map, Func func) {
+    map.for_each([&](Key, Value &value) { func(value); });
+}
+
+/**
+ * @brief Apply a function to each key-value pair of a dense_map, in ascending key order.
+ *
+ * @tparam Key Type of the keys in the map.
+ * @tparam Value Type of the values in the map.
+ * @tparam Func Type of the function to apply. Must be callable with (Key, Value&).
+ * @param map The dense map to process.
+ * @param func Function to apply to each key-value pair.
+ */
+template <typename Key, typename Value, typename Func>
+void for_each_pair_in_map(dense_map<Key, Value> &map, Func func) {
+    map.for_each(func);
+}
+
+/**
+ * @brief Transform the values of a dense_map by applying a function to each value.
+ *
+ * @tparam Key Type of the keys in the map.
+ * @tparam Value Type of the input values in the map.
+ * @tparam Func Type of the function to apply. Must be callable with const Value&.
+ * @param input_map Input dense_map.
+ * @param func Function to apply to each value.
+ * @return A new dense_map over the same key range with transformed values.
+ */
+template <typename Key, typename Value, typename Func>
+auto map_values(const dense_map<Key, Value> &input_map, Func func) {
+    using ValueType = decltype(func(std::declval<const Value &>()));
+    dense_map<Key, ValueType> result(input_map.lowest_key(), input_map.capacity());
+    input_map.for_each([&](Key key, const Value &value) { result.insert(key, func(value)); });
+    return result;
+}
+
+/**
+ * @brief Filter a dense_map based on a predicate applied to key-value pairs.
+ *
+ * @tparam Key Type of keys in the map.
+ * @tparam Value Type of values in the map.
+ * @tparam Pred Type of the predicate. Must be callable with (const Key&, const Value&).
+ * @param input_map Input dense_map to filter.
+ * @param pred Predicate function that returns true to keep an element, false to remove it.
+ * @return A new dense_map over the same key range containing only the entries for which pred(key, value) is true.
+ */
+template <typename Key, typename Value, typename Pred>
+dense_map<Key, Value> filter_map(const dense_map<Key, Value> &input_map, Pred pred) {
+    dense_map<Key, Value> result(input_map.lowest_key(), input_map.capacity());
+    input_map.for_each([&](Key key, const Value &value) {
+        if (pred(key, value)) {
+            result.insert(key, value);
+        }
+    });
+    return result;
+}
+
+/**
+ * @brief Filter a dense_map based on a predicate applied to its keys.
+ *
+ * @tparam Key Type of keys in the map.
+ * @tparam Value Type of values in the map.
+ * @tparam Pred Type of the predicate. Must be callable with (const Key&).
+ * @param input_map Input dense_map to filter.
+ * @param pred Predicate function that returns true to keep an element, false to remove it.
+ * @return A new dense_map containing only the entries for which pred(key) is true.
+ */
+template <typename Key, typename Value, typename Pred>
+dense_map<Key, Value> filter_map_by_keys(const dense_map<Key, Value> &input_map, Pred pred) {
+    return filter_map(input_map, [&](const Key &key, const Value &) { return pred(key); });
+}
+
+/**
+ * @brief Filter a dense_map based on a predicate applied to its values.
+ *
+ * @tparam Key Type of keys in the map.
+ * @tparam Value Type of values in the map.
+ * @tparam Pred Type of the predicate. Must be callable with (const Value&).
+ * @param input_map Input dense_map to filter.
+ * @param pred Predicate function that returns true to keep an element, false to remove it.
+ * @return A new dense_map containing only the entries for which pred(value) is true.
+ */
+template <typename Key, typename Value, typename Pred>
+dense_map<Key, Value> filter_map_by_values(const dense_map<Key, Value> &input_map, Pred pred) {
+    return filter_map(input_map, [&](const Key &, const Value &value) { return pred(value); });
+}
+
+/**
+ * @brief Inverts a dense_map into a hash map of value to key.
+ *
+ * @tparam Key Type of keys in the map.
+ * @tparam Value Type of values in the map, must be hashable.
+ * @param m The dense map to invert.
+ * @return std::unordered_map<Value, Key> A new unordered map containing reversed key/value pairs.
+ *
+ * @note If several keys share a value, the smallest of those keys is kept.
+ */
+template <typename Key, typename Value> std::unordered_map<Value, Key> invert(const dense_map<Key, Value> &m) {
+    std::unordered_map<Value, Key> result;
+    result.reserve(m.size());
+    m.for_each([&](Key key, const Value &value) { result.emplace(value, key); });
+    return result;
+}
+
+/**
+ * @brief Extracts all keys from a dense_map into a vector.
+ *
+ * @tparam Key Type of the keys in the map.
+ * @tparam Value Type of the values in the map.
+ * @param map The dense map to extract keys from.
+ * @return std::vector<Key> The keys in ascending order.
+ */
+template <typename Key, typename Value> std::vector<Key> keys(const dense_map<Key, Value> &map) {
+    std::vector<Key> keys;
+    keys.reserve(map.size());
+    map.for_each([&](Key key, const Value &) { keys.push_back(key); });
+    return keys;
+}
+
+/**
+ * @brief Extracts all values from a dense_map into a vector.
+ *
+ * @tparam Key Type of the keys in the map.
+ * @tparam Value Type of the values in the map.
+ * @param map The dense map to extract values from.
+ * @return std::vector<Value> The values in ascending key order.
+ */
+template <typename Key, typename Value> std::vector<Value> values(const dense_map<Key, Value> &map) {
+    std::vector<Value> values;
+    values.reserve(map.size());
+    map.for_each([&](Key, const Value &value) { values.push_back(value); });
+    return values;
+}
+
+/**
+ * @brief Build a map from a vector of objects, picking a dense_map when the keys fall in a compact range.
+ *
+ * The keys are extracted once to find their range. If the range spans at most max_dense_capacity keys and at most
+ * max_slots_per_item keys per object, a dense_map over exactly that range is built, otherwise a std::unordered_map is
+ * built as build_map_from_vector would.
+ *
+ * @tparam Key Type of the key to use in the map, an integer or enum type.
+ * @tparam Value Type of the objects in the vector.
+ * @tparam KeyFunc Callable type that takes a const Value& and returns a Key.
+ * @param vec Vector of objects to convert to a map.
+ * @param key_func Function that extracts the key from a Value.
+ * @param max_dense_capacity Largest key range for which a dense_map is built.
+ * @param max_slots_per_item Largest ratio of key range to vec.size() for which a dense_map is built, so sparse keys
+ *        do not pay for mostly empty slots.
+ * @return std::variant<dense_map<Key, Value>, std::unordered_map<Key, Value>> The resulting map. Every map helper
+ *         has an overload for both alternatives, so the result can be consumed with std::visit.
+ *
+ * @note As with build_map_from_vector, the first object for each key wins.
+ *
+ * @example
+ * @code
+ * auto by_id = build_map_from_vector_auto<int>(items, [](const Item &i) { return i.id; });
+ * std::visit([](auto &map) { for_each_value_in_map(map, [](Item &i) { ... }); }, by_id);
+ * @endcode
+ */
+template <typename Key, typename Value, typename KeyFunc>
+std::variant<dense_map<Key, Value>, std::unordered_map<Key, Value>>
+build_map_from_vector_auto(const std::vector<Value> &vec, KeyFunc key_func, std::size_t max_dense_capacity = 4096,
+                           std::size_t max_slots_per_item = 4) {
+    if (!vec.empty()) {
+        std::vector<Key> item_keys;
+        item_keys.reserve(vec.size());
+        for (const auto &item : vec) {
+            item_keys.push_back(key_func(item));
+        }
+        const auto [lo, hi] = std::minmax_element(item_keys.begin(), item_keys.end());
+        const unsigned long long distance = detail::dense_key_to_unsigned(*hi) - detail::dense_key_to_unsigned(*lo);
+        // NOTE: a few keys far apart would still fit under max_dense_capacity, so also bound the slots per item
+        if (distance < max_dense_capacity &&
+            distance < static_cast<unsigned long long>(max_slots_per_item) * vec.size()) {
+            dense_map<Key, Value> result(*lo, static_cast<std::size_t>(distance) + 1);
+            for (std::size_t i = 0; i < vec.size(); ++i) {
+                result.insert(item_keys[i], vec[i]); // first occurrence wins
+            }
+            return result;
+        }
+    }
+    return build_map_from_vector<Key>(vec, key_func);
+}
+
+// endfold
+
+// startfold bimaps
+
+template <typename Bimap, bool Left> class bimap_side;
+
+/**
+ * @brief One-to-one map that can be looked up from either side in O(1).
+ *
+ * Each left value is stored once as a key of the left index and each right value once as a key of the right index.
+ * The two indices point at each other's keys (node based hash maps never move their elements), so both directions
+ * stay consistent on every insert and erase and nothing has to be rebuilt with invert().
+ *
+ * The generic map helpers work per direction through left() and right():
+ *
+ * @code
+ * bimap<int, std::string> names;
+ * names.insert(7, "alice");
+ * auto name = at_optional(names.left(), 7);         // "alice"
+ * bool known = contains_key(names.right(), "alice"); // true
+ * erase(names.right(), "alice");                     // removes 7 <-> "alice" from both sides
+ * @endcode
+ *
+ * @tparam L Type of the left values, must be hashable.
+ * @tparam R Type of the right values, must be hashable.
+ */
+template <typename L, typename R> class bimap {
+  public:
+    using left_type = L;
+    using right_type = R;
+
+    bimap() = default;
+
+    bimap(const bimap &other) { copy_from(other); }
+
+    bimap &operator=(const bimap &other) {
+        if (this != &other) {
+            clear();
+            copy_from(other);
+        }
+        return *this;
+    }
+
+    // NOTE: moving an unordered_map moves ownership of its nodes without relocating them, so the cross pointers stay
+    // valid
+    bimap(bimap &&) noexcept = default;
+    bimap &operator=(bimap &&) noexcept = default;
+
+    /**
+     * @brief Insert a pair if neither side is present yet.
+     *
+     * @return true if the pair was inserted, false if either value already takes part in another pair.
+     */
+    bool insert(const L &left, const R &right) {
+        if (left_index.count(left) || right_index.count(right))
+            return false;
+        auto left_it = left_index.emplace(left, nullptr).first;
+        try {
+            auto right_it = right_index.emplace(right, &left_it->first).first;
+            left_it->second = &right_it->first;
+        } catch (...) {
+            // a left entry without a partner would be dereferenced by erase_left
+            left_index.erase(left_it);
+            throw;
+        }
+        return true;
+    }
+
+    bool contains_left(const L &left) const { return left_index.count(left) != 0; }
+    bool contains_right(const R &right) const { return right_index.count(right) != 0; }
+
+    /**
+     * @brief Get the right value paired with a left value, or nullptr if there is none.
+     */
+    const R *find_left(const L &left) const {
+        auto it = left_index.find(left);
+        return it == left_index.end() ? nullptr : it->second;
+    }
+
+    /**
+     * @brief Get the left value paired with a right value, or nullptr if there is none.
+     */
+    const L *find_right(const R &right) const {
+        auto it = right_index.find(right);
+        return it == right_index.end() ? nullptr : it->second;
+    }
+
+    /**
+     * @brief Erase the pair containing a left value.
+     *
+     * @return true if a pair was erased, false otherwise.
+     */
+    bool erase_left(const L &left) {
+        auto it = left_index.find(left);
+        if (it == left_index.end())
+            return false;
+        right_index.erase(*it->second);
+        left_index.erase(it);
+        return true;
+    }
+
+    /**
+     * @brief Erase the pair containing a right value.
+     *
+     * @return true if a pair was erased, false otherwise.
+     */
+    bool erase_right(const R &right) {
+        auto it = right_index.find(right);
+        if (it == right_index.end())
+            return false;
+        left_index.erase(*it->second);
+        right_index.erase(it);
+        return true;
+    }
+
+    void clear() {
+        left_index.clear();
+        right_index.clear();
+    }
+
+    void reserve(std::size_t n) {
+        left_index.reserve(n);
+        right_index.reserve(n);
+    }
+
+    std::size_t size() const { return left_index.size(); }
+    bool empty() const { return left_index.empty(); }
+
+    /**
+     * @brief Apply a function to every pair.
+     *
+     * @tparam Func Callable with (const L&, const R&).
+     */
+    template <typename Func> void for_each(Func &&func) const {
+        for (const auto &[left, right] : left_index) {
+            func(left, *right);
+        }
+    }
+
+    bimap_side<bimap, true> left() { return bimap_side<bimap, true>(*this); }
+    bimap_side<const bimap, true> left() const { return bimap_side<const bimap, true>(*this); }
+    bimap_side<bimap, false> right() { return bimap_side<bimap, false>(*this); }
+    bimap_side<const bimap, false> right() const { return bimap_side<const bimap, false>(*this); }
+
+  private:
+    void copy_from(const bimap &other) {
+        reserve(other.size());
+        other.for_each([this](const L &left, const R &right) { insert(left, right); });
+    }
+
+    std::unordered_map<L, const R *> left_index;
+    std::unordered_map<R, const L *> right_index;
+};
+
+/**
+ * @brief Lightweight view of one direction of a bimap, usable with contains_key, at_optional and erase.
+ *
+ * @tparam Bimap The bimap type, const qualified for read-only views.
+ * @tparam Left true to look up by left values, false to look up by right values.
+ */
+template <typename Bimap, bool Left> class bimap_side {
+    using bare = std::remove_const_t<Bimap>;
+
+  public:
+    using key_type = std::conditional_t<Left, typename bare::left_type, typename bare::right_type>;
+    using mapped_type = std::conditional_t<Left, typename bare::right_type, typename bare::left_type>;
+
+    explicit bimap_side(Bimap &owner) : owner(&owner) {}
+
+    bool contains(const key_type &key) const {
+        if constexpr (Left) {
+            return owner->contains_left(key);
+        } else {
+            return owner->contains_right(key);
+        }
+    }
+
+    const mapped_type *get(const key_type &key) const {
+        if constexpr (Left) {
+            return owner->find_left(key);
+        } else {
+            return owner->find_right(key);
+        }
+    }
+
+    bool erase(const key_type &key) const {
+        if constexpr (Left) {
+            return owner->erase_left(key);
+        } else {
+            return owner->erase_right(key);
+        }
+    }
+
+    std::size_t size() const { return owner->size(); }
+
+  private:
+    Bimap *owner;
+};
+
+/**
+ * @brief Check if a key exists on one side of a bimap.
+ *
+ * @tparam Bimap The bimap type.
+ * @tparam Left Which side is searched.
+ * @param side bimap.left() or bimap.right().
+ * @param key The key to search for.
+ * @return true if the key exists on that side, false otherwise.
+ */
+template <typename Bimap, bool Left>
+bool contains_key(const bimap_side<Bimap, Left> &side, const typename bimap_side<Bimap, Left>::key_type &key) {
+    return side.contains(key);
+}
+
+/**
+ * @brief Check if a key does NOT exist on one side of a bimap.
+ *
+ * @tparam Bimap The bimap type.
+ * @tparam Left Which side is searched.
+ * @param side bimap.left() or bimap.right().
+ * @param key The key to check for absence.
+ * @return true if the key does NOT exist on that side, false otherwise.
+ */
+template <typename Bimap, bool Left>
+bool does_not_contain_key(const bimap_side<Bimap, Left> &side,
+                          const typename bimap_side<Bimap, Left>::key_type &key) {
+    return !side.contains(key);
+}
+
+/**
+ * @brief Safely get the value paired with a key on one side of a bimap.
+ *
+ * Only const access is offered: changing a value in place would desynchronize the other side's index.
+ *
+ * @tparam Bimap The bimap type.
+ * @tparam Left Which side is searched.
+ * @param side bimap.left() or bimap.right().
+ * @param key The key to look for.
+ * @return std::optional<std::reference_wrapper<const mapped_type>> The paired value, or std::nullopt.
+ */
+template <typename Bimap, bool Left>
+std::optional<std::reference_wrapper<const typename bimap_side<Bimap, Left>::mapped_type>>
+at_optional(const bimap_side<Bimap, Left> &side, const typename bimap_side<Bimap, Left>::key_type &key) {
+    if (const auto *value = side.get(key))
+        return std::cref(*value);
+    return std::nullopt;
+}
+
+/**
+ * @brief Erase the pair containing a key on one side of a bimap. Both sides are updated.
+ *
+ * @tparam Bimap The (non-const) bimap type.
+ * @tparam Left Which side the key belongs to.
+ * @param side bimap.left() or bimap.right().
+ * @param key The key of the pair to erase.
+ * @return true if a pair was erased, false otherwise.
+ */
+template <typename Bimap, bool Left>
+bool erase(bimap_side<Bimap, Left> side, const typename bimap_side<Bimap, Left>::key_type &key) {
+    return side.erase(key);
+}
+
+/**
+ * @brief Apply a function to each pair of a bimap.
+ *
+ * @tparam L Type of the left values.
+ * @tparam R Type of the right values.
+ * @tparam Func Type of the function to apply. Must be callable with (const L&, const R&).
+ * @param map The bimap to process.
+ * @param func Function to apply to each pair.
+ */
+template <typename L, typename R, typename Func> void for_each_pair_in_map(const bimap<L, R> &map, Func func) {
+    map.for_each(func);
+}
+
+/**
+ * @brief Build a bimap from a one-to-one map.
+ *
+ * @tparam Map A map-like type whose values are unique.
+ * @param map The map to convert.
+ * @return bimap<Map::key_type, Map::mapped_type> The resulting bimap.
+ *
+ * @note If several keys share a value, only the first one encountered is kept.
+ */
+template <typename Map> bimap<typename Map::key_type, typename Map::mapped_type> to_bimap(const Map &map) {
+    bimap<typename Map::key_type, typename Map::mapped_type> result;
+    result.reserve(map.size());
+    for (const auto &[key, value] : map) {
+        result.insert(key, value);
+    }
+    return result;
+}
+
+// endfold
+
+// startfold caches
+
+/**
+ * @brief Eviction policy of a bounded_cache.
+ */
+enum class cache_policy {
+    /// evict the least recently used entry
+    lru,
+    /// second chance approximation of lru: a hand sweeps the slots and evicts the first entry not referenced since
+    /// the last sweep, hits only set a flag
+    clock,
+    /// S3-FIFO: new keys go through a small probationary fifo, keys that were hit there or recently evicted from it
+    /// (remembered in a ghost fifo) go to the main fifo; resists scans much better than lru
+    s3fifo,
+};
+
+/**
+ * @brief Fixed capacity key-value cache with O(1) get, put and erase.
+ *
+ * Entries live in one preallocated array and recency is tracked intrusively through 32 bit indices stored in the
+ * entries themselves, so a cache hit never allocates and each entry costs a single hash index node instead of a
+ * hash node plus a list node.
+ *
+ * @tparam Key Type of the keys, must be hashable.
+ * @tparam Value Type of the cached values.
+ * @tparam Policy Eviction policy, see cache_policy.
+ *
+ * @example
+ * @code
+ * bounded_cache<std::string, Texture, cache_policy::s3fifo> textures(256);
+ * textures.set_eviction_callback([](const std::string &path, Texture &t) { t.unload(); });
+ * if (auto t = textures.get(path)) { draw(t->get()); } else { textures.put(path, load(path)); }
+ * @endcode
+ */
+template <typename Key, typename Value, cache_policy Policy = cache_policy::lru> class bounded_cache {
+  public:
+    using key_type = Key;
+    using mapped_type = Value;
+    using eviction_callback = std::function<void(const Key &, Value &)>;
+
+    /**
+     * @throws std::invalid_argument if capacity is zero or does not fit in 32 bits.
+     */
+    explicit bounded_cache(std::size_t capacity) : max_entries(capacity) {
+        if (capacity == 0 || capacity >= npos) {
+            throw std::invalid_argument("bounded_cache capacity must be in [1, 2^32 - 1)");
+        }
+        entries.reserve(capacity);
+        index.reserve(capacity);
+        if constexpr (Policy == cache_policy::s3fifo) {
+            // the usual S3-FIFO split: 10% probationary, 90% main, and a ghost as large as the main queue
+            small_target = std::max<std::size_t>(1, capacity / 10);
+            ghost_ring.assign(std::max<std::size_t>(1, capacity - small_target), 0);
+            // at most half full, so probe sequences stay short
+            std::size_t table_size = 2;
+            ghost_shift = 63;
+            while (table_size < 2 * ghost_ring.size()) {
+                table_size *= 2;
+                --ghost_shift;
+            }
+            ghost_table.assign(table_size, 0);
+        }
+    }
+
+    /**
+     * @brief Look up a key and record the access for the eviction policy.
+     *
+     * @return A reference to the cached value, or std::nullopt on a miss. The reference is invalidated by the next
+     * put or erase.
+     */
+    std::optional<std::reference_wrapper<Value>> get(const Key &key) {
+        auto it = index.find(key);
+        if (it == index.end()) {
+            ++miss_count;
+            return std::nullopt;
+        }
+        ++hit_count;
+        touch(it->second);
+        return std::ref(entries[it->second].value);
+    }
+
+    /**
+     * @brief Look up a key without counting it as an access or a hit/miss.
+     */
+    const Value *peek(const Key &key) const {
+        auto it = index.find(key);
+        return it == index.end() ? nullptr : &entries[it->second].value;
+    }
+
+    bool contains(const Key &key) const { return index.find(key) != index.end(); }
+
+    /**
+     * @brief Insert or overwrite a value, evicting one entry first if the cache is full.
+     */
+    template <typename V> void put(const Key &key, V &&value) {
+        if (auto it = index.find(key); it != index.end()) {
+            entries[it->second].value = std::forward<V>(value);
+            touch(it->second);
+            return;
+        }
+
+        if (index.size() == max_entries) {
+            evict_one();
+        }
+
+        std::uint32_t i;
+        if (free_head != npos) {
+            i = free_head;
+            free_head = entries[i].next;
+            entries[i].key = key;
+            entries[i].value = std::forward<V>(value);
+        } else {
+            i = static_cast<std::uint32_t>(entries.size());
+            entries.push_back(entry{key, Value(std::forward<V>(value))});
+        }
+        entry &e = entries[i];
+        e.live = true;
+        e.frequency = 0;
+        index.emplace(key, i);
+
+        if constexpr (Policy == cache_policy::lru) {
+            link_front(lists[0], i);
+        } else if constexpr (Policy == cache_policy::s3fifo) {
+            link_front(lists[in_ghost(key) ? main_queue : small_queue], i);
+        }
+    }
+
+    /**
+     * @brief Remove a key without invoking the eviction callback.
+     *
+     * @return true if the key was cached, false otherwise.
+     */
+    bool erase(const Key &key) {
+        auto it = index.find(key);
+        if (it == index.end())
+            return false;
+        release(it->second);
+        index.erase(it);
+        return true;
+    }
+
+    /**
+     * @brief Remove every entry without invoking the eviction callback. Statistics are kept.
+     */
+    void clear() {
+        entries.clear();
+        index.clear();
+        lists[0] = lists[1] = queue{};
+        free_head = npos;
+        hand = 0;
+        std::fill(ghost_ring.begin(), ghost_ring.end(), 0);
+        std::fill(ghost_table.begin(), ghost_table.end(), 0);
+        ghost_pos = 0;
+        ghost_size = 0;
+    }
+
+    /**
+     * @brief Set a function called with each entry right before it is evicted to make room.
+     */
+    void set_eviction_callback(eviction_callback callback) { on_evict = std::move(callback); }
+
+    std::size_t hits() const { return hit_count; }
+    std::size_t misses() const { return miss_count; }
+    double hit_rate() const {
+        const std::size_t total = hit_count + miss_count;
+        return total == 0 ? 0.0 : static_cast<double>(hit_count) / static_cast<double>(total);
+    }
+    void reset_stats() { hit_count = miss_count = 0; }
+
+    std::size_t size() const { return index.size(); }
+    std::size_t capacity() const { return max_entries; }
+    bool empty() const { return index.empty(); }
+
+  private:
+    static constexpr std::uint32_t npos = std::numeric_limits<std::uint32_t>::max();
+    static constexpr std::uint8_t small_queue = 0;
+    static constexpr std::uint8_t main_queue = 1;
+    static constexpr std::uint8_t max_frequency = 3;
+
+    struct entry {
+        Key key;
+        Value value;
+        // neighbours in the entry's recency queue; next doubles as the free list link for released slots
+        std::uint32_t prev = npos;
+        std::uint32_t next = npos;
+        // lru: unused, clock: referenced bit, s3fifo: saturating access counter
+        std::uint8_t frequency = 0;
+        std::uint8_t queue_id = small_queue;
+        bool live = true;
+    };
+
+    struct queue {
+        std::uint32_t head = npos; // most recently inserted
+        std::uint32_t tail = npos; // next eviction candidate
+        std::size_t size = 0;
+    };
+
+    void link_front(queue &q, std::uint32_t i) {
+        entry &e = entries[i];
+        e.queue_id = static_cast<std::uint8_t>(&q - lists);
+        e.prev = npos;
+        e.next = q.head;
+        if (q.head != npos)
+            entries[q.head].prev = i;
+        q.head = i;
+        if (q.tail == npos)
+            q.tail = i;
+        ++q.size;
+    }
+
+    void unlink(queue &q, std::uint32_t i) {
+        entry &e = entries[i];
+        if (e.prev != npos)
+            entries[e.prev].next = e.next;
+        else
+            q.head = e.next;
+        if (e.next != npos)
+            entries[e.next].prev = e.prev;
+        else
+            q.tail = e.prev;
+        --q.size;
+    }
+
+    void touch(std::uint32_t i) {
+        if constexpr (Policy == cache_policy::lru) {
+            unlink(lists[0], i);
+            link_front(lists[0], i);
+        } else if constexpr (Policy == cache_policy::clock) {
+            entries[i].frequency = 1;
+        } else {
+            entry &e = entries[i];
+            if (e.frequency < max_frequency)
+                ++e.frequency;
+        }
+    }
+
+    /**
+     * @brief Take an entry out of its queue and put its slot on the free list.
+     */
+    void release(std::uint32_t i) {
+        if constexpr (Policy != cache_policy::clock) {
+            unlink(lists[entries[i].queue_id], i);
+        }
+        entry &e = entries[i];
+        e.live = false;
+        if constexpr (std::is_default_constructible_v<Value>) {
+            e.value = Value(); // drop whatever the value owns now rather than when the slot is reused
+        }
+        e.next = free_head;
+        free_head = i;
+    }
+
+    void evict(std::uint32_t i) {
+        entry &e = entries[i];
+        if (on_evict)
+            on_evict(e.key, e.value);
+        index.erase(e.key);
+        release(i);
+    }
+
+    void evict_one() {
+        if constexpr (Policy == cache_policy::lru) {
+            evict(lists[0].tail);
+        } else if constexpr (Policy == cache_policy::clock) {
+            // every live entry loses its reference bit at most once, so this ends within two sweeps
+            while (true) {
+                if (hand >= entries.size())
+                    hand = 0;
+                entry &e = entries[hand];
+                if (e.live) {
+                    if (e.frequency == 0) {
+                        evict(static_cast<std::uint32_t>(hand++));
+                        return;
+                    }
+                    e.frequency = 0;
+                }
+                ++hand;
+            }
+        } else {
+            while (true) {
+                if (lists[small_queue].size >= small_target || lists[main_queue].size == 0) {
+                    const std::uint32_t i = lists[small_queue].tail;
+                    if (entries[i].frequency > 0) {
+                        // accessed while on probation: promote
+                        entries[i].frequency = 0;
+                        unlink(lists[small_queue], i);
+                        link_front(lists[main_queue], i);
+                        continue;
+                    }
+                    remember_ghost(entries[i].key);
+                    evict(i);
+                    return;
+                }
+
+                const std::uint32_t i = lists[main_queue].tail;
+                if (entries[i].frequency > 0) {
+                    --entries[i].frequency;
+                    unlink(lists[main_queue], i);
+                    link_front(lists[main_queue], i);
+                    continue;
+                }
+                evict(i);
+                return;
+            }
+        }
+    }
+
+    /**
+     * @brief Hash of a key as stored in the ghost table, where 0 marks an empty slot.
+     */
+    static std::size_t ghost_hash(const Key &key) {
+        const std::size_t h = std::hash<Key>{}(key);
+        return h == 0 ? 1 : h;
+    }
+
+    std::size_t ghost_home(std::size_t h) const {
+        return static_cast<std::size_t>((static_cast<std::uint64_t>(h) * 0x9E3779B97F4A7C15ull) >> ghost_shift);
+    }
+
+    /**
+     * @brief Append a key to the ghost fifo, forgetting the oldest ghost once the fifo is full.
+     *
+     * The fifo and its lookup table are sized in the constructor, so this never allocates.
+     */
+    void remember_ghost(const Key &key) {
+        if (ghost_size == ghost_ring.size()) {
+            forget_ghost(ghost_ring[ghost_pos]);
+        } else {
+            ++ghost_size;
+        }
+        const std::size_t h = ghost_hash(key);
+        ghost_ring[ghost_pos] = h;
+        ghost_pos = (ghost_pos + 1) % ghost_ring.size();
+        const std::size_t mask = ghost_table.size() - 1;
+        std::size_t slot = ghost_home(h);
+        while (ghost_table[slot] != 0)
+            slot = (slot + 1) & mask;
+        ghost_table[slot] = h; // the same hash may be stored more than once, one copy per fifo entry
+    }
+
+    /**
+     * @brief Remove one copy of h from the linear probing table, shifting later entries of the probe run back so
+     * lookups never stop early at the hole.
+     */
+    void forget_ghost(std::size_t h) {
+        const std::size_t mask = ghost_table.size() - 1;
+        std::size_t hole = ghost_home(h);
+        while (ghost_table[hole] != h)
+            hole = (hole + 1) & mask;
+        for (std::size_t next = (hole + 1) & mask; ghost_table[next] != 0; next = (next + 1) & mask) {
+            const std::size_t home = ghost_home(ghost_table[next]);
+            // an entry may move into the hole only if the hole lies on its probe path from home to next
+            if (((next - home) & mask) >= ((next - hole) & mask)) {
+                ghost_table[hole] = ghost_table[next];
+                hole = next;
+            }
+        }
+        ghost_table[hole] = 0;
+    }
+
+    /**
+     * @brief Whether the key was recently evicted from the small queue.
+     *
+     * @note Ghosts are tracked by hash only, a collision merely promotes a key to the main queue early.
+     */
+    bool in_ghost(const Key &key) const {
+        if (ghost_size == 0)
+            return false;
+        const std::size_t h = ghost_hash(key);
+        const std::size_t mask = ghost_table.size() - 1;
+        for (std::size_t slot = ghost_home(h); ghost_table[slot] != 0; slot = (slot + 1) & mask) {
+            if (ghost_table[slot] == h)
+                return true;
+        }
+        return false;
+    }
+
+    std::size_t max_entries;
+    std::vector<entry> entries;
+    std::unordered_map<Key, std::uint32_t> index;
+    queue lists[2];
+    std::uint32_t free_head = npos;
+    std::size_t hand = 0;
+
+    std::size_t small_target = 0;
+    std::vector<std::size_t> ghost_ring;  // hashes of the last evicted probationary keys, oldest at ghost_pos
+    std::vector<std::size_t> ghost_table; // the same hashes in a linear probing multiset, 0 marks an empty slot
+    unsigned ghost_shift = 63;            // 64 - log2(ghost_table.size()), to take the top bits of the mixed hash
+    std::size_t ghost_pos = 0;
+    std::size_t ghost_size = 0;
+
+    eviction_callback on_evict;
+    std::size_t hit_count = 0;
+    std::size_t miss_count = 0;
+};
+
+/**
+ * @brief Check if a key is cached, without affecting recency or statistics.
+ *
+ * @tparam Key Type of the keys in the cache.
+ * @tparam Value Type of the values in the cache.
+ * @tparam Policy Eviction policy of the cache.
+ * @param cache The cache to search within.
+ * @param key The key to search for.
+ * @return true if the key is cached, false otherwise.
+ */
+template <typename Key, typename Value, cache_policy Policy>
+bool contains_key(const bounded_cache<Key, Value, Policy> &cache,
+                  const typename bounded_cache<Key, Value, Policy>::key_type &key) {
+    return cache.contains(key);
+}
+
+/**
+ * @brief Look up a cached value, counting it as an access (same as cache.get(key)).
+ *
+ * @tparam Key Type of the keys in the cache.
+ * @tparam Value Type of the values in the cache.
+ * @tparam Policy Eviction policy of the cache.
+ * @param cache The cache to query.
+ * @param key The key to look for.
+ * @return std::optional<std::reference_wrapper<Value>> The cached value, or std::nullopt on a miss.
+ */
+template <typename Key, typename Value, cache_policy Policy>
+std::optional<std::reference_wrapper<Value>>
+at_optional(bounded_cache<Key, Value, Policy> &cache, const typename bounded_cache<Key, Value, Policy>::key_type &key) {
+    return cache.get(key);
+}
+
+/**
+ * @brief Remove a key from a cache, if it is cached.
+ *
+ * @tparam Key Type of the keys in the cache.
+ * @tparam Value Type of the values in the cache.
+ * @tparam Policy Eviction policy of the cache.
+ * @param cache The cache to modify.
+ * @param key The key to remove.
+ * @return true if the key was removed, false otherwise.
+ */
+template <typename Key, typename Value, cache_policy Policy>
+bool erase(bounded_cache<Key, Value, Policy> &cache, const typename bounded_cache<Key, Value, Policy>::key_type &key) {
+    return cache.erase(key);
+}
+
+// endfold
+
+// startfold concurrent caches
+
+/**
+ * @brief Thread-safe bounded cache, sharded by key hash, with CLOCK eviction per shard.
+ *
+ * Each shard owns its own hash index, slot array and reader-writer lock, so threads working on different keys rarely
+ * meet. A hit only takes the shard's lock in shared mode: recording the access is a relaxed store to the slot's
+ * atomic reference bit, so concurrent readers never serialize on recency bookkeeping the way they would with an lru
+ * list. Misses and inserts take the shard's lock exclusively.
+ *
+ * Values are returned by copy, since a reference into the cache could be invalidated by another thread at any time.
+ * Use a cheap-to-copy Value (e.g. std::shared_ptr<const T>) for large objects.
+ *
+ * @tparam Key Type of the keys.
+ * @tparam Value Type of the values, must be copy constructible.
+ * @tparam Hash Hash function for keys.
+ *
+ * @example
+ * @code
+ * concurrent_cache<std::string, std::shared_ptr<const Mesh>> meshes(4096);
+ * // from any thread; concurrent misses on the same path load it only once
+ * auto mesh = meshes.get_or_compute(path, [&] { return load_mesh(path); });
+ * @endcode
+ */
+template <typename Key, typename Value, typename Hash = std::hash<Key>> class concurrent_cache {
+  public:
+    using key_type = Key;
+    using mapped_type = Value;
+
+    /**
+     * @param capacity Total number of entries, spread evenly over the shards.
+     * @param shard_count Number of independently locked shards.
+     *
+     * @throws std::invalid_argument if capacity or shard_count is zero.
+     */
+    explicit concurrent_cache(std::size_t capacity, std::size_t shard_count = 16) {
+        if (capacity == 0 || shard_count == 0) {
+            throw std::invalid_argument("concurrent_cache needs a non zero capacity and shard count");
+        }
+        shard_count = std::min(shard_count, capacity);
+        shards.reserve(shard_count);
+        for (std::size_t i = 0; i < shard_count; ++i) {
+            // the first capacity % shard_count shards take one extra entry, so the total is exactly capacity
+            shards.push_back(std::make_unique<shard>(capacity / shard_count + (i < capacity % shard_count ? 1 : 0)));
+        }
+    }
+
+    /**
+     * @brief Look up a key.
+     *
+     * @return A copy of the cached value, or std::nullopt on a miss.
+     */
+    std::optional<Value> get(const Key &key) const {
+        shard &s = shard_for(key);
+        std::shared_lock lock(s.mutex);
+        auto it = s.index.find(key);
+        if (it == s.index.end()) {
+            s.misses.fetch_add(1, std::memory_order_relaxed);
+            return std::nullopt;
+        }
+        s.referenced[it->second].store(1, std::memory_order_relaxed);
+        s.hits.fetch_add(1, std::memory_order_relaxed);
+        return s.slots[it->second].value;
+    }
+
+    bool contains(const Key &key) const {
+        shard &s = shard_for(key);
+        std::shared_lock lock(s.mutex);
+        return s.index.find(key) != s.index.end();
+    }
+
+    /**
+     * @brief Insert or overwrite a value, evicting an entry of the key's shard if that shard is full.
+     */
+    void put(const Key &key, Value value) {
+        shard &s = shard_for(key);
+        std::unique_lock lock(s.mutex);
+        s.insert_or_assign(key, std::move(value));
+    }
+
+    /**
+     * @return true if the key was cached, false otherwise.
+     */
+    bool erase(const Key &key) {
+        shard &s = shard_for(key);
+        std::unique_lock lock(s.mutex);
+        return s.erase(key);
+    }
+
+    /**
+     * @brief Get the cached value for a key, computing and caching it on a miss.
+     *
+     * If several threads miss on the same key at the same time, only the first one calls compute; the others wait
+     * for its result. If compute throws, the exception is rethrown in every waiting thread and nothing is cached.
+     *
+     * @tparam Func Callable with no arguments returning something convertible to Value.
+     * @param key The key to look up.
+     * @param compute Produces the value on a miss. Called without any lock held.
+     * @return Value The cached or freshly computed value.
+     */
+    template <typename Func> Value get_or_compute(const Key &key, Func compute) {
+        if (auto cached = get(key))
+            return *std::move(cached);
+
+        shard &s = shard_for(key);
+        std::promise<Value> promise;
+        {
+            std::unique_lock lock(s.mutex);
+            if (auto it = s.index.find(key); it != s.index.end()) {
+                return s.slots[it->second].value; // another thread finished computing it in the meantime
+            }
+            if (auto it = s.in_flight.find(key); it != s.in_flight.end()) {
+                std::shared_future<Value> pending = it->second;
+                lock.unlock();
+                return pending.get();
+            }
+            s.in_flight.emplace(key, promise.get_future().share());
+        }
+
+        try {
+            Value value = compute();
+            {
+                std::unique_lock lock(s.mutex);
+                s.insert_or_assign(key, value);
+                s.in_flight.erase(key);
+            }
+            promise.set_value(value);
+            return value;
+        } catch (...) {
+            {
+                std::unique_lock lock(s.mutex);
+                s.in_flight.erase(key);
+            }
+            promise.set_exception(std::current_exception());
+            throw;
+        }
+    }
+
+    void clear() {
+        for (auto &s : shards) {
+            std::unique_lock lock(s->mutex);
+            s->clear();
+        }
+    }
+
+    std::size_t size() const {
+        std::size_t total = 0;
+        for (const auto &s : shards) {
+            std::shared_lock lock(s->mutex);
+            total += s->index.size();
+        }
+        return total;
+    }
+
+    std::size_t hits() const {
+        std::size_t total = 0;
+        for (const auto &s : shards)
+            total += s->hits.load(std::memory_order_relaxed);
+        return total;
+    }
+
+    std::size_t misses() const {
+        std::size_t total = 0;
+        for (const auto &s : shards)
+            total += s->misses.load(std::memory_order_relaxed);
+        return total;
+    }
+
+    std::size_t shard_count() const { return shards.size(); }
+
+  private:
+    struct slot {
+        Key key;
+        Value value;
+        bool live;
+    };
+
+    // NOTE: aligned so that two shards' locks and counters never share a cache line
+    struct alignas(64) shard {
+        explicit shard(std::size_t capacity)
+            : capacity(capacity), referenced(std::make_unique<std::atomic<std::uint8_t>[]>(capacity)) {
+            slots.reserve(capacity);
+            index.reserve(capacity);
+        }
+
+        void insert_or_assign(const Key &key, Value value) {
+            if (auto it = index.find(key); it != index.end()) {
+                slots[it->second].value = std::move(value);
+                referenced[it->second].store(1, std::memory_order_relaxed);
+                return;
+            }
+
+            std::size_t i;
+            if (!free_slots.empty()) {
+                i = free_slots.back();
+                free_slots.pop_back();
+                slots[i].key = key;
+                slots[i].value = std::move(value);
+                slots[i].live = true;
+            } else if (slots.size() < capacity) {
+                i = slots.size();
+                slots.push_back(slot{key, std::move(value), true});
+            } else {
+                i = evict_one();
+                slots[i].key = key;
+                slots[i].value = std::move(value);
+                slots[i].live = true;
+            }
+            // new entries start unreferenced so a burst of one-off keys cannot flush the shard
+            referenced[i].store(0, std::memory_order_relaxed);
+            index.emplace(key, i);
+        }
+
+        bool erase(const Key &key) {
+            auto it = index.find(key);
+            if (it == index.end())
+                return false;
+            slot &s = slots[it->second];
+            s.live = false;
+            if constexpr (std::is_default_constructible_v<Value>) {
+                s.value = Value(); // drop whatever the value owns now rather than when the slot is reused
+            }
+            free_slots.push_back(it->second);
+            index.erase(it);
+            return true;
+        }
+
+        /**
+         * @brief Evict the first entry the clock hand finds unreferenced and return its slot.
+         */
+        std::size_t evict_one() {
+            while (true) {
+                if (hand >= slots.size())
+                    hand = 0;
+                const std::size_t i = hand++;
+                if (!slots[i].live)
+                    continue;
+                if (referenced[i].exchange(0, std::memory_order_relaxed) == 0) {
+                    index.erase(slots[i].key);
+                    return i;
+                }
+            }
+        }
+
+        void clear() {
+            slots.clear();
+            index.clear();
+            free_slots.clear();
+            hand = 0;
+        }
+
+        mutable std::shared_mutex mutex;
+        std::size_t capacity;
+        std::vector<slot> slots;
+        std::unique_ptr<std::atomic<std::uint8_t>[]> referenced;
+        std::vector<std::size_t> free_slots;
+        std::unordered_map<Key, std::size_t, Hash> index;
+        std::unordered_map<Key, std::shared_future<Value>, Hash> in_flight;
+        std::size_t hand = 0;
+        std::atomic<std::size_t> hits{0};
+        std::atomic<std::size_t> misses{0};
+    };
+
+    shard &shard_for(const Key &key) const {
+        // NOTE: std::hash is the identity for integers on common standard libraries, so mix the bits before picking
+        // a shard, otherwise sequential keys would all land in the same few shards
+        const std::uint64_t mixed = static_cast<std::uint64_t>(Hash{}(key)) * 0x9E3779B97F4A7C15ull;
+        return *shards[static_cast<std::size_t>(mixed >> 32) % shards.size()];
+    }
+
+    std::vector<std::unique_ptr<shard>> shards;
+};
+
+/**
+ * @brief Check if a key is in a concurrent_cache.
+ *
+ * @tparam Key Type of the keys in the cache.
+ * @tparam Value Type of the values in the cache.
+ * @tparam Hash Hash function of the cache.
+ * @param cache The cache to search within.
+ * @param key The key to search for.
+ * @return true if the key is cached, false otherwise.
+ */
+template <typename Key, typename Value, typename Hash>
+bool contains_key(const concurrent_cache<Key, Value, Hash> &cache,
+                  const typename concurrent_cache<Key, Value, Hash>::key_type &key) {
+    return cache.contains(key);
+}
+
+/**
+ * @brief Look up a value in a concurrent_cache.
+ *
+ * @note Unlike at_optional on ordinary maps this returns a copy, because another thread may evict the entry at any
+ * moment.
+ *
+ * @tparam Key Type of the keys in the cache.
+ * @tparam Value Type of the values in the cache.
+ * @tparam Hash Hash function of the cache.
+ * @param cache The cache to query.
+ * @param key The key to look for.
+ * @return std::optional<Value> A copy of the cached value, or std::nullopt on a miss.
+ */
+template <typename Key, typename Value, typename Hash>
+std::optional<Value> at_optional(const concurrent_cache<Key, Value, Hash> &cache,
+                                 const typename concurrent_cache<Key, Value, Hash>::key_type &key) {
+    return cache.get(key);
+}
+
+/**
+ * @brief Remove a key from a concurrent_cache, if it is cached.
+ *
+ * @tparam Key Type of the keys in the cache.
+ * @tparam Value Type of the values in the cache.
+ * @tparam Hash Hash function of the cache.
+ * @param cache The cache to modify.
+ * @param key The key to remove.
+ * @return true if the key was removed, false otherwise.
+ */
+template <typename Key, typename Value, typename Hash>
+bool erase(concurrent_cache<Key, Value, Hash> &cache,
+           const typename concurrent_cache<Key, Value, Hash>::key_type &key) {
+    return cache.erase(key);
+}
+
+// endfold
+
+// startfold multi index
+
+/**
+ * @brief Key extractor reading a data member, for use as the KeyFunc of a multi_index index.
+ *
+ * @tparam Member Pointer to data member, e.g. &Employee::id.
+ */
+template <auto Member> struct member_key {
+    template <typename Record> const auto &operator()(const Record &record) const { return record.*Member; }
+};
+
+/// multi_index index: hash lookup, at most one record per key
+template <typename KeyFunc> struct hashed_unique {
+    using key_func = KeyFunc;
+    static constexpr bool unique = true;
+    static constexpr bool ordered = false;
+};
+
+/// multi_index index: hash lookup, any number of records per key
+template <typename KeyFunc> struct hashed_non_unique {
+    using key_func = KeyFunc;
+    static constexpr bool unique = false;
+    static constexpr bool ordered = false;
+};
+
+/// multi_index index: ordered by key, at most one record per key
+template <typename KeyFunc> struct ordered_unique {
+    using key_func = KeyFunc;
+    static constexpr bool unique = true;
+    static constexpr bool ordered = true;
+};
+
+/// multi_index index: ordered by key, any number of records per key
+template <typename KeyFunc> struct ordered_non_unique {
+    using key_func = KeyFunc;
+    static constexpr bool unique = false;
+    static constexpr bool ordered = true;
+};
+
+namespace detail {
+/**
+ * @brief One index of a multi_index: maps keys to positions in the record store.
+ */
+template <typename Record, typename Spec> class multi_index_index {
+  public:
+    using key_func = typename Spec::key_func;
+    using key_type = std::decay_t<decltype(std::declval<key_func>()(std::declval<const Record &>()))>;
+
+    static key_type key_of(const Record &record) { return key_func{}(record); }
+
+    bool accepts(const Record &record) const {
+        if constexpr (Spec::unique) {
+            return positions.find(key_of(record)) == positions.end();
+        } else {
+            return true;
+        }
+    }
+
+    void insert(const Record &record, std::size_t pos) {
+        if constexpr (Spec::unique) {
+            positions.emplace(key_of(record), pos);
+        } else {
+            auto &bucket = positions[key_of(record)];
+            if (slot_in_bucket.size() <= pos)
+                slot_in_bucket.resize(pos + 1);
+            slot_in_bucket[pos] = bucket.size();
+            bucket.push_back(pos);
+        }
+    }
+
+    void erase(const Record &record, std::size_t pos) {
+        auto it = positions.find(key_of(record));
+        if constexpr (Spec::unique) {
+            positions.erase(it);
+        } else {
+            // swap the last position of the bucket into the erased one's slot
+            auto &bucket = it->second;
+            const std::size_t slot = slot_in_bucket[pos];
+            bucket[slot] = bucket.back();
+            slot_in_bucket[bucket[slot]] = slot;
+            bucket.pop_back();
+            if (bucket.empty())
+                positions.erase(it);
+        }
+    }
+
+    void relocate(const Record &record, std::size_t from, std::size_t to) {
+        auto it = positions.find(key_of(record));
+        if constexpr (Spec::unique) {
+            it->second = to;
+        } else {
+            const std::size_t slot = slot_in_bucket[from];
+            it->second[slot] = to;
+            slot_in_bucket[to] = slot;
+        }
+    }
+
+    std::optional<std::size_t> first_position(const key_type &key) const {
+        auto it = positions.find(key);
+        if (it == positions.end())
+            return std::nullopt;
+        if constexpr (Spec::unique) {
+            return it->second;
+        } else {
+            return it->second.front();
+        }
+    }
+
+    std::size_t count(const key_type &key) const {
+        if constexpr (Spec::unique) {
+            return positions.count(key);
+        } else {
+            auto it = positions.find(key);
+            return it == positions.end() ? 0 : it->second.size();
+        }
+    }
+
+    /**
+     * @brief Apply a function to the position of every record with this key.
+     */
+    template <typename Func> void for_each_position(const key_type &key, Func &&func) const {
+        auto it = positions.find(key);
+        if (it == positions.end())
+            return;
+        if constexpr (Spec::unique) {
+            func(it->second);
+        } else {
+            for (std::size_t pos : it->second)
+                func(pos);
+        }
+    }
+
+    /**
+     * @brief Apply a function to every (key, position) pair, in key order for ordered indices.
+     */
+    template <typename Func> void for_each(Func &&func) const {
+        for (const auto &[key, entry] : positions) {
+            if constexpr (Spec::unique) {
+                func(key, entry);
+            } else {
+                for (std::size_t pos : entry)
+                    func(key, pos);
+            }
+        }
+    }
+
+    void reserve(std::size_t n) {
+        if constexpr (!Spec::ordered) {
+            positions.reserve(n);
+        }
+        if constexpr (!Spec::unique) {
+            slot_in_bucket.reserve(n);
+        }
+    }
+
+    void clear() {
+        positions.clear();
+        slot_in_bucket.clear();
+    }
+
+  private:
+    // NOTE: a non-unique index keeps one bucket of positions per key plus each record's slot in its bucket, so
+    // erasing or relocating one of k records with the same key is O(1) instead of a scan of the key's k entries
+    using mapped = std::conditional_t<Spec::unique, std::size_t, std::vector<std::size_t>>;
+    using container =
+        std::conditional_t<Spec::ordered, std::map<key_type, mapped>, std::unordered_map<key_type, mapped>>;
+
+    container positions;
+    std::vector<std::size_t> slot_in_bucket; // non-unique only: position -> index in its key's bucket
+};
+} // namespace detail
+
+template <typename MultiIndex, std::size_t I> class multi_index_view;
+
+/**
+ * @brief A record store with several lookup indices kept consistent automatically.
+ *
+ * Records live once, contiguously, in a vector. Each index spec (hashed_unique, hashed_non_unique, ordered_unique,
+ * ordered_non_unique) maps the key its extractor produces to record positions. Inserting checks every unique index
+ * before touching any of them, and erasing through any index removes the record from all of them, so the indices
+ * can never drift apart the way several hand-maintained maps do.
+ *
+ * @tparam Record Type of the stored records.
+ * @tparam Specs One index spec per index; index I is reached through get<I>().
+ *
+ * @example
+ * @code
+ * struct Employee { int id; std::string name; int department; };
+ * using Staff = multi_index<Employee, hashed_unique<member_key<&Employee::id>>,
+ *                           ordered_unique<member_key<&Employee::name>>,
+ *                           hashed_non_unique<member_key<&Employee::department>>>;
+ * Staff staff(employees);                                  // bulk build
+ * auto bob = at_optional(staff.get<1>(), std::string("bob"));
+ * auto sales = staff.get<2>().equal_range(3);              // all records of department 3
+ * erase(staff.get<0>(), 42);                               // removed from all three indices
+ * @endcode
+ */
+template <typename Record, typename... Specs> class multi_index {
+    static_assert(sizeof...(Specs) > 0, "multi_index needs at least one index");
+
+  public:
+    using value_type = Record;
+    using const_iterator = typename std::vector<Record>::const_iterator;
+
+    multi_index() = default;
+
+    /**
+     * @brief Bulk build from a vector of records.
+     *
+     * @note As with build_map_from_vector, a record that collides with an earlier one on a unique index is dropped.
+     */
+    explicit multi_index(const std::vector<Record> &source) {
+        reserve(source.size());
+        for (const auto &record : source) {
+            insert(record);
+        }
+    }
+
+    /**
+     * @brief Insert a record if it does not collide with an existing record on any unique index.
+     *
+     * @return true if the record was inserted, false if it was rejected (nothing is modified).
+     */
+    bool insert(Record record) {
+        const bool accepted = std::apply([&](const auto &...index) { return (index.accepts(record) && ...); }, indices);
+        if (!accepted)
+            return false;
+        records.push_back(std::move(record));
+        const std::size_t pos = records.size() - 1;
+        std::apply([&](auto &...index) { (index.insert(records[pos], pos), ...); }, indices);
+        return true;
+    }
+
+    /**
+     * @brief Erase the record stored at a position of the record store.
+     *
+     * The last record is moved into the hole, so positions (and pointers to records) other than the last one stay
+     * valid.
+     */
+    void erase_at(std::size_t pos) {
+        std::apply([&](auto &...index) { (index.erase(records[pos], pos), ...); }, indices);
+        const std::size_t last = records.size() - 1;
+        if (pos != last) {
+            std::apply([&](auto &...index) { (index.relocate(records[last], last, pos), ...); }, indices);
+            records[pos] = std::move(records[last]);
+        }
+        records.pop_back();
+    }
+
+    /**
+     * @brief Replace the record at a position, re-indexing it under every index.
+     *
+     * @return true if the record was replaced, false if the new record collides with another record on a unique
+     * index (nothing is modified).
+     */
+    bool replace_at(std::size_t pos, Record record) {
+        std::apply([&](auto &...index) { (index.erase(records[pos], pos), ...); }, indices);
+        const bool accepted = std::apply([&](const auto &...index) { return (index.accepts(record) && ...); }, indices);
+        if (accepted) {
+            records[pos] = std::move(record);
+        }
+        std::apply([&](auto &...index) { (index.insert(records[pos], pos), ...); }, indices);
+        return accepted;
+    }
+
+    template <std::size_t I> multi_index_view<multi_index, I> get() { return multi_index_view<multi_index, I>(*this); }
+    template <std::size_t I> multi_index_view<const multi_index, I> get() const {
+        return multi_index_view<const multi_index, I>(*this);
+    }
+
+    void reserve(std::size_t n) {
+        records.reserve(n);
+        std::apply([&](auto &...index) { (index.reserve(n), ...); }, indices);
+    }
+
+    void clear() {
+        records.clear();
+        std::apply([](auto &...index) { (index.clear(), ...); }, indices);
+    }
+
+    std::size_t size() const { return records.size(); }
+    bool empty() const { return records.empty(); }
+
+    /**
+     * @brief Iterate over the record store. Only const access is offered, use replace_at to change a record.
+     */
+    const_iterator begin() const { return records.begin(); }
+    const_iterator end() const { return records.end(); }
+    const Record &operator[](std::size_t pos) const { return records[pos]; }
+
+  private:
+    template <typename MultiIndex, std::size_t I> friend class multi_index_view;
+
+    std::vector<Record> records;
+    std::tuple<detail::multi_index_index<Record, Specs>...> indices;
+};
+
+/**
+ * @brief Access to a multi_index through one of its indices.
+ *
+ * @tparam MultiIndex The multi_index type, const qualified for read-only views.
+ * @tparam I Position of the index in the multi_index's spec list.
+ */
+template <typename MultiIndex, std::size_t I> class multi_index_view {
+    using bare = std::remove_const_t<MultiIndex>;
+    using index_type = std::decay_t<decltype(std::get<I>(std::declval<bare &>().indices))>;
+
+  public:
+    using key_type = typename index_type::key_type;
+    using mapped_type = typename bare::value_type;
+
+    explicit multi_index_view(MultiIndex &owner) : owner(&owner) {}
+
+    /**
+     * @brief Position in the record store of the first record with this key, if any.
+     */
+    std::optional<std::size_t> position_of(const key_type &key) const {
+        return std::get<I>(owner->indices).first_position(key);
+    }
+
+    /**
+     * @brief The first record with this key, or nullptr.
+     */
+    const mapped_type *find(const key_type &key) const {
+        auto pos = position_of(key);
+        return pos ? &owner->records[*pos] : nullptr;
+    }
+
+    bool contains(const key_type &key) const { return position_of(key).has_value(); }
+
+    std::size_t count(const key_type &key) const { return std::get<I>(owner->indices).count(key); }
+
+    /**
+     * @brief All records with this key. For ordered indices the records are visited in key order.
+     */
+    std::vector<const mapped_type *> equal_range(const key_type &key) const {
+        std::vector<const mapped_type *> result;
+        std::get<I>(owner->indices).for_each_position(key,
+                                                      [&](std::size_t pos) { result.push_back(&owner->records[pos]); });
+        return result;
+    }
+
+    /**
+     * @brief Apply a function to every record, in key order for ordered indices.
+     *
+     * @tparam Func Callable with (const key_type&, const Record&).
+     */
+    template <typename Func> void for_each(Func &&func) const {
+        std::get<I>(owner->indices).for_each(
+            [&](const key_type &key, std::size_t pos) { func(key, owner->records[pos]); });
+    }
+
+    /**
+     * @brief Erase every record with this key from the whole container.
+     *
+     * @return The number of records erased.
+     */
+    std::size_t erase(const key_type &key) const {
+        std::size_t erased = 0;
+        while (auto pos = position_of(key)) {
+            owner->erase_at(*pos);
+            ++erased;
+        }
+        return erased;
+    }
+
+    std::size_t size() const { return owner->size(); }
+
+  private:
+    MultiIndex *owner;
+};
+
+/**
+ * @brief Check if a key exists in one index of a multi_index.
+ *
+ * @tparam MultiIndex The multi_index type.
+ * @tparam I Position of the index.
+ * @param view multi_index.get<I>().
+ * @param key The key to search for.
+ * @return true if at least one record has this key, false otherwise.
+ */
+template <typename MultiIndex, std::size_t I>
+bool contains_key(const multi_index_view<MultiIndex, I> &view,
+                  const typename multi_index_view<MultiIndex, I>::key_type &key) {
+    return view.contains(key);
+}
+
+/**
+ * @brief Check if a key does NOT exist in one index of a multi_index.
+ *
+ * @tparam MultiIndex The multi_index type.
+ * @tparam I Position of the index.
+ * @param view multi_index.get<I>().
+ * @param key The key to check for absence.
+ * @return true if no record has this key, false otherwise.
+ */
+template <typename MultiIndex, std::size_t I>
+bool does_not_contain_key(const multi_index_view<MultiIndex, I> &view,
+                          const typename multi_index_view<MultiIndex, I>::key_type &key) {
+    return !view.contains(key);
+}
+
+/**
+ * @brief Safely get the (first) record with a key in one index of a multi_index.
+ *
+ * @tparam MultiIndex The multi_index type.
+ * @tparam I Position of the index.
+ * @param view multi_index.get<I>().
+ * @param key The key to look for.
+ * @return std::optional<std::reference_wrapper<const Record>> The record, or std::nullopt if no record has this key.
+ */
+template <typename MultiIndex, std::size_t I>
+std::optional<std::reference_wrapper<const typename multi_index_view<MultiIndex, I>::mapped_type>>
+at_optional(const multi_index_view<MultiIndex, I> &view,
+            const typename multi_index_view<MultiIndex, I>::key_type &key) {
+    if (const auto *record = view.find(key))
+        return std::cref(*record);
+    return std::nullopt;
+}
+
+/**
+ * @brief Erase every record with a key in one index from the whole multi_index.
+ *
+ * @tparam MultiIndex The (non-const) multi_index type.
+ * @tparam I Position of the index.
+ * @param view multi_index.get<I>().
+ * @param key The key of the records to erase.
+ * @return true if at least one record was erased, false otherwise.
+ */
+template <typename MultiIndex, std::size_t I>
+bool erase(multi_index_view<MultiIndex, I> view, const typename multi_index_view<MultiIndex, I>::key_type &key) {
+    return view.erase(key) > 0;
+}
+
+// endfold
+
+// startfold interval maps
+
+/**
+ * @brief Half-open range [lo, hi).
+ */
+template <typename Key> struct half_open_interval {
+    Key lo;
+    Key hi;
+
+    bool contains(const Key &x) const { return !(x < lo) && x < hi; }
+    bool operator==(const half_open_interval &other) const { return lo == other.lo && hi == other.hi; }
+    bool operator!=(const half_open_interval &other) const { return !(*this == other); }
+};
+
+namespace detail {
+template <typename T, typename = void> struct is_equality_comparable : std::false_type {};
+template <typename T>
+struct is_equality_comparable<T, std::void_t<decltype(std::declval<const T &>() == std::declval<const T &>())>>
+    : std::true_type {};
+} // namespace detail
+
+/**
+ * @brief Map from disjoint half-open key ranges to values, answering "which range contains x" in O(log n).
+ *
+ * Ranges are kept sorted in one flat vector. Assigning a value to a range overwrites whatever the range overlapped
+ * (partially covered neighbours are trimmed or split), and adjacent ranges with equal values are merged, so the map
+ * always holds the minimal set of segments.
+ *
+ * @tparam Key Type of the range bounds, must support operator<.
+ * @tparam Value Type of the mapped values; coalescing happens only if it supports operator==.
+ *
+ * @example
+ * @code
+ * interval_map<int, std::string> zones;
+ * zones.assign(0, 100, "shallow");
+ * zones.assign(100, 500, "deep");
+ * zones.assign(50, 60, "reef");            // splits "shallow" into [0, 50) and [60, 100)
+ * auto zone = at_optional(zones, 55);      // "reef"
+ * @endcode
+ */
+template <typename Key, typename Value> class interval_map {
+  public:
+    using key_type = Key;
+    using mapped_type = Value;
+    using interval_type = half_open_interval<Key>;
+
+    struct entry {
+        interval_type range;
+        Value value;
+    };
+
+    using const_iterator = typename std::vector<entry>::const_iterator;
+
+    interval_map() = default;
+
+    /**
+     * @brief Bulk build from a vector of ranges.
+     *
+     * If the ranges do not overlap this is a sort plus one merging pass. Otherwise the ranges are assigned one by
+     * one in input order, so where ranges overlap the later one wins.
+     */
+    explicit interval_map(std::vector<entry> ranges) {
+        ranges.erase(std::remove_if(ranges.begin(), ranges.end(),
+                                    [](const entry &e) { return !(e.range.lo < e.range.hi); }),
+                     ranges.end());
+
+        std::vector<entry> sorted = ranges;
+        std::stable_sort(sorted.begin(), sorted.end(),
+                         [](const entry &a, const entry &b) { return a.range.lo < b.range.lo; });
+        bool disjoint = true;
+        for (std::size_t i = 1; i < sorted.size() && disjoint; ++i) {
+            disjoint = !(sorted[i].range.lo < sorted[i - 1].range.hi);
+        }
+
+        if (disjoint) {
+            segments.reserve(sorted.size());
+            for (auto &e : sorted) {
+                if (!segments.empty() && can_merge(segments.back(), e.range.lo, e.value)) {
+                    segments.back().range.hi = e.range.hi;
+                } else {
+                    segments.push_back(std::move(e));
+                }
+            }
+        } else {
+            for (auto &e : ranges) {
+                assign(e.range.lo, e.range.hi, std::move(e.value));
+            }
+        }
+    }
+
+    /**
+     * @brief Map every key in [lo, hi) to value, overwriting what was there. Does nothing if the range is empty.
+     */
+    void assign(const Key &lo, const Key &hi, Value value) {
+        if (!(lo < hi))
+            return;
+        std::size_t pos = erase_range(lo, hi);
+
+        segments.insert(segments.begin() + static_cast<std::ptrdiff_t>(pos), entry{{lo, hi}, std::move(value)});
+        if (pos + 1 < segments.size() &&
+            can_merge(segments[pos], segments[pos + 1].range.lo, segments[pos + 1].value)) {
+            segments[pos].range.hi = segments[pos + 1].range.hi;
+            segments.erase(segments.begin() + static_cast<std::ptrdiff_t>(pos + 1));
+        }
+        if (pos > 0 && can_merge(segments[pos - 1], segments[pos].range.lo, segments[pos].value)) {
+            segments[pos - 1].range.hi = segments[pos].range.hi;
+            segments.erase(segments.begin() + static_cast<std::ptrdiff_t>(pos));
+        }
+    }
+
+    /**
+     * @brief Remove every key in [lo, hi) from the map, trimming or splitting partially covered ranges.
+     */
+    void erase(const Key &lo, const Key &hi) {
+        if (lo < hi)
+            erase_range(lo, hi);
+    }
+
+    /**
+     * @brief Find the range containing x.
+     *
+     * @return A pointer to the entry whose range contains x, or nullptr.
+     */
+    const entry *find(const Key &x) const {
+        // first segment starting after x; the only candidate is the one before it
+        auto it = std::upper_bound(segments.begin(), segments.end(), x,
+                                   [](const Key &k, const entry &e) { return k < e.range.lo; });
+        if (it == segments.begin())
+            return nullptr;
+        --it;
+        return x < it->range.hi ? &*it : nullptr;
+    }
+
+    bool contains(const Key &x) const { return find(x) != nullptr; }
+
+    /**
+     * @brief Apply a function to every range overlapping [lo, hi), in ascending order.
+     *
+     * Costs O(log n + number of overlapping ranges).
+     *
+     * @tparam Func Callable with (const half_open_interval<Key>&, const Value&).
+     */
+    template <typename Func> void for_each_overlapping(const Key &lo, const Key &hi, Func &&func) const {
+        for (auto it = first_ending_after(lo); it != segments.end() && it->range.lo < hi; ++it) {
+            func(it->range, it->value);
+        }
+    }
+
+    /**
+     * @brief All ranges overlapping [lo, hi), in ascending order.
+     */
+    std::vector<entry> overlapping(const Key &lo, const Key &hi) const {
+        std::vector<entry> result;
+        for_each_overlapping(lo, hi, [&](const interval_type &range, const Value &value) {
+            result.push_back({range, value});
+        });
+        return result;
+    }
+
+    void clear() { segments.clear(); }
+    std::size_t size() const { return segments.size(); }
+    bool empty() const { return segments.empty(); }
+
+    const_iterator begin() const { return segments.begin(); }
+    const_iterator end() const { return segments.end(); }
+
+  private:
+    typename std::vector<entry>::const_iterator first_ending_after(const Key &x) const {
+        return std::partition_point(segments.begin(), segments.end(),
+                                    [&](const entry &e) { return !(x < e.range.hi); });
+    }
+
+    static bool can_merge(const entry &left, const Key &right_lo, const Value &right_value) {
+        if constexpr (detail::is_equality_comparable<Value>::value) {
+            return left.range.hi == right_lo && left.value == right_value;
+        } else {
+            return false;
+        }
+    }
+
+    /**
+     * @brief Clear [lo, hi) and return the position where a segment starting at lo now belongs.
+     */
+    std::size_t erase_range(const Key &lo, const Key &hi) {
+        std::size_t i = static_cast<std::size_t>(first_ending_after(lo) - segments.cbegin());
+        if (i == segments.size())
+            return i;
+
+        entry &first = segments[i];
+        if (first.range.lo < lo && hi < first.range.hi) {
+            // [lo, hi) is strictly inside one segment: split it in two
+            entry right{{hi, first.range.hi}, first.value};
+            first.range.hi = lo;
+            segments.insert(segments.begin() + static_cast<std::ptrdiff_t>(i + 1), std::move(right));
+            return i + 1;
+        }
+        if (first.range.lo < lo) {
+            first.range.hi = lo;
+            ++i;
+        }
+
+        std::size_t j = i;
+        while (j < segments.size() && !(hi < segments[j].range.hi)) {
+            ++j; // fully covered
+        }
+        if (j < segments.size() && segments[j].range.lo < hi) {
+            segments[j].range.lo = hi;
+        }
+        segments.erase(segments.begin() + static_cast<std::ptrdiff_t>(i),
+                       segments.begin() + static_cast<std::ptrdiff_t>(j));
+        return i;
+    }
+
+    std::vector<entry> segments;
+};
+
+/**
+ * @brief Check if a point is covered by a range of an interval_map.
+ *
+ * @tparam Key Type of the range bounds.
+ * @tparam Value Type of the mapped values.
+ * @param map The interval map to search within.
+ * @param x The point to look up.
+ * @return true if some range contains x, false otherwise.
+ */
+template <typename Key, typename Value>
+bool contains_key(const interval_map<Key, Value> &map, const typename interval_map<Key, Value>::key_type &x) {
+    return map.contains(x);
+}
+
+/**
+ * @brief Check if a point is NOT covered by any range of an interval_map.
+ *
+ * @tparam Key Type of the range bounds.
+ * @tparam Value Type of the mapped values.
+ * @param map The interval map to search within.
+ * @param x The point to look up.
+ * @return true if no range contains x, false otherwise.
+ */
+template <typename Key, typename Value>
+bool does_not_contain_key(const interval_map<Key, Value> &map, const typename interval_map<Key, Value>::key_type &x) {
+    return !map.contains(x);
+}
+
+/**
+ * @brief Safely get the value of the range containing a point, in O(log n).
+ *
+ * Only const access is offered since changing a value in place could break the coalescing of equal neighbours; use
+ * assign instead.
+ *
+ * @tparam Key Type of the range bounds.
+ * @tparam Value Type of the mapped values.
+ * @param map The interval map to query.
+ * @param x The point to look up.
+ * @return std::optional<std::reference_wrapper<const Value>> The value, or std::nullopt if no range contains x.
+ */
+template <typename Key, typename Value>
+std::optional<std::reference_wrapper<const Value>> at_optional(const interval_map<Key, Value> &map,
+                                                               const typename interval_map<Key, Value>::key_type &x) {
+    if (const auto *e = map.find(x))
+        return std::cref(e->value);
+    return std::nullopt;
+}
+
+/**
+ * @brief Apply a function to each range-value pair of an interval_map, in ascending order.
+ *
+ * @tparam Key Type of the range bounds.
+ * @tparam Value Type of the mapped values.
+ * @tparam Func Type of the function to apply. Must be callable with (const half_open_interval<Key>&, const Value&).
+ * @param map The interval map to process.
+ * @param func Function to apply to each range-value pair.
+ */
+template <typename Key, typename Value, typename Func>
+void for_each_pair_in_map(const interval_map<Key, Value> &map, Func func) {
+    for (const auto &e : map) {
+        func(e.range, e.value);
+    }
+}
+
+/**
+ * @brief Filter an interval_map based on a predicate applied to range-value pairs.
+ *
+ * @tparam Key Type of the range bounds.
+ * @tparam Value Type of the mapped values.
+ * @tparam Pred Type of the predicate. Must be callable with (const half_open_interval<Key>&, const Value&).
+ * @param input_map Input interval_map to filter.
+ * @param pred Predicate function that returns true to keep a range, false to remove it.
+ * @return A new interval_map containing only the ranges for which pred(range, value) is true.
+ */
+template <typename Key, typename Value, typename Pred>
+interval_map<Key, Value> filter_map(const interval_map<Key, Value> &input_map, Pred pred) {
+    std::vector<typename interval_map<Key, Value>::entry> kept;
+    for (const auto &e : input_map) {
+        if (pred(e.range, e.value)) {
+            kept.push_back(e);
+        }
+    }
+    return interval_map<Key, Value>(std::move(kept));
+}
+
+/**
+ * @brief Extracts all ranges from an interval_map into a vector, in ascending order.
+ *
+ * @tparam Key Type of the range bounds.
+ * @tparam Value Type of the mapped values.
+ * @param map The interval map to extract ranges from.
+ * @return std::vector<half_open_interval<Key>> The ranges.
+ */
+template <typename Key, typename Value> std::vector<half_open_interval<Key>> keys(const interval_map<Key, Value> &map) {
+    std::vector<half_open_interval<Key>> keys;
+    keys.reserve(map.size());
+    for (const auto &e : map) {
+        keys.push_back(e.range);
+    }
+    return keys;
+}
+
+/**
+ * @brief Extracts all values from an interval_map into a vector, in ascending range order.
+ *
+ * @tparam Key Type of the range bounds.
+ * @tparam Value Type of the mapped values.
+ * @param map The interval map to extract values from.
+ * @return std::vector<Value> The values.
+ */
+template <typename Key, typename Value> std::vector<Value> values(const interval_map<Key, Value> &map) {
+    std::vector<Value> values;
+    values.reserve(map.size());
+    for (const auto &e : map) {
+        values.push_back(e.value);
+    }
+    return values;
+}
+
+// endfold
+
+// startfold radix trees
+
+/**
+ * @brief String keyed map stored as a path compressed radix tree, for fast prefix queries.
+ *
+ * Chains of single-child nodes are collapsed into one edge label, so a lookup costs O(|key|) byte compares no matter
+ * how many keys are stored. Each node keeps the first bytes of its outgoing edges in a sorted byte array next to the
+ * child pointers, so small nodes stay small and child selection is a short scan of contiguous bytes. Children are
+ * visited in byte order, which makes iteration lexicographic.
+ *
+ * Enumerating every key with a given prefix costs O(|prefix| + size of the output) instead of a scan of the map.
+ *
+ * @tparam Value Type of the mapped values.
+ *
+ * @example
+ * @code
+ * radix_tree<int> routes = to_radix_tree(route_table); // bulk load from an existing string keyed map
+ * routes.for_each_with_prefix("/api/v2/", [](const std::string &path, const int &handler) { ... });
+ * @endcode
+ */
+template <typename Value> class radix_tree {
+  public:
+    using key_type = std::string;
+    using mapped_type = Value;
+
+    radix_tree() : root(std::make_unique<node>()) {}
+
+    radix_tree(const radix_tree &other) : root(clone(*other.root)), count(other.count) {}
+    radix_tree &operator=(const radix_tree &other) {
+        if (this != &other) {
+            root = clone(*other.root);
+            count = other.count;
+        }
+        return *this;
+    }
+    radix_tree(radix_tree &&other) noexcept : root(std::move(other.root)), count(other.count) {
+        other.root = std::make_unique<node>();
+        other.count = 0;
+    }
+    radix_tree &operator=(radix_tree &&other) noexcept {
+        std::swap(root, other.root);
+        std::swap(count, other.count);
+        return *this;
+    }
+
+    /**
+     * @brief Insert a value if the key is not present yet.
+     *
+     * @return true if the value was inserted, false if the key was already present (the tree is left unchanged).
+     */
+    template <typename V> bool insert(std::string_view key, V &&value) {
+        node &n = find_or_create(key);
+        if (n.value)
+            return false;
+        n.value.emplace(std::forward<V>(value));
+        ++count;
+        return true;
+    }
+
+    /**
+     * @brief Insert a value or overwrite the existing one.
+     */
+    template <typename V> void insert_or_assign(std::string_view key, V &&value) {
+        node &n = find_or_create(key);
+        if (!n.value)
+            ++count;
+        n.value = std::forward<V>(value);
+    }
+
+    /**
+     * @brief Get a pointer to the value for a key, or nullptr.
+     */
+    Value *find(std::string_view key) {
+        node *n = find_node(key);
+        return n && n->value ? &*n->value : nullptr;
+    }
+    const Value *find(std::string_view key) const { return const_cast<radix_tree *>(this)->find(key); }
+
+    bool contains(std::string_view key) const { return find(key) != nullptr; }
+
+    /**
+     * @brief Erase a key, merging nodes that are left with a single child.
+     *
+     * @return true if the key was erased, false if it was not present.
+     */
+    bool erase(std::string_view key) {
+        if (!erase_from(*root, key))
+            return false;
+        --count;
+        return true;
+    }
+
+    void clear() {
+        root = std::make_unique<node>();
+        count = 0;
+    }
+
+    std::size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    /**
+     * @brief Apply a function to every entry in lexicographic key order.
+     *
+     * @tparam Func Callable with (const std::string&, const Value&).
+     */
+    template <typename Func> void for_each(Func &&func) const {
+        std::string key;
+        visit(*root, key, func);
+    }
+
+    /**
+     * @brief Apply a function to every entry in lexicographic key order.
+     *
+     * @tparam Func Callable with (const std::string&, Value&).
+     */
+    template <typename Func> void for_each(Func &&func) {
+        std::string key;
+        visit(*root, key, func);
+    }
+
+    /**
+     * @brief Apply a function to every entry whose key starts with prefix, in lexicographic key order.
+     *
+     * @tparam Func Callable with (const std::string&, const Value&).
+     */
+    template <typename Func> void for_each_with_prefix(std::string_view prefix, Func &&func) const {
+        // walk down until the prefix is used up; it may end in the middle of an edge label
+        const node *n = root.get();
+        std::string key;
+        std::size_t i = 0;
+        while (i < prefix.size()) {
+            const node *child = n->child(static_cast<unsigned char>(prefix[i]));
+            if (!child)
+                return;
+            const std::size_t common = common_prefix(child->label, prefix.substr(i));
+            if (common < child->label.size() && i + common < prefix.size())
+                return; // mismatch inside the edge label
+            key += child->label;
+            i += child->label.size();
+            n = child;
+        }
+        visit(*n, key, func);
+    }
+
+    /**
+     * @brief Copy out every entry whose key starts with prefix, in lexicographic key order.
+     */
+    std::vector<std::pair<std::string, Value>> prefix_range(std::string_view prefix) const {
+        std::vector<std::pair<std::string, Value>> result;
+        for_each_with_prefix(prefix,
+                             [&](const std::string &key, const Value &value) { result.emplace_back(key, value); });
+        return result;
+    }
+
+  private:
+    struct node {
+        // bytes on the edge from the parent to this node
+        std::string label;
+        std::optional<Value> value;
+        // first byte of each child's label, sorted, parallel to children
+        std::vector<unsigned char> child_bytes;
+        std::vector<std::unique_ptr<node>> children;
+
+        std::size_t child_index(unsigned char byte) const {
+            return static_cast<std::size_t>(std::lower_bound(child_bytes.begin(), child_bytes.end(), byte) -
+                                            child_bytes.begin());
+        }
+
+        node *child(unsigned char byte) const {
+            const std::size_t i = child_index(byte);
+            return i < child_bytes.size() && child_bytes[i] == byte ? children[i].get() : nullptr;
+        }
+
+        void add_child(std::unique_ptr<node> c) {
+            const unsigned char byte = static_cast<unsigned char>(c->label[0]);
+            const std::size_t i = child_index(byte);
+            child_bytes.insert(child_bytes.begin() + static_cast<std::ptrdiff_t>(i), byte);
+            children.insert(children.begin() + static_cast<std::ptrdiff_t>(i), std::move(c));
+        }
+    };
+
+    static std::size_t common_prefix(std::string_view a, std::string_view b) {
+        const std::size_t n = std::min(a.size(), b.size());
+        std::size_t i = 0;
+        while (i < n && a[i] == b[i])
+            ++i;
+        return i;
+    }
+
+    static std::unique_ptr<node> clone(const node &n) {
+        auto copy = std::make_unique<node>();
+        copy->label = n.label;
+        copy->value = n.value;
+        copy->child_bytes = n.child_bytes;
+        copy->children.reserve(n.children.size());
+        for (const auto &c : n.children)
+            copy->children.push_back(clone(*c));
+        return copy;
+    }
+
+    node *find_node(std::string_view key) const {
+        node *n = root.get();
+        while (!key.empty()) {
+            node *child = n->child(static_cast<unsigned char>(key[0]));
+            if (!child || key.substr(0, child->label.size()) != child->label)
+                return nullptr;
+            key.remove_prefix(child->label.size());
+            n = child;
+        }
+        return n;
+    }
+
+    node &find_or_create(std::string_view key) {
+        node *n = root.get();
+        while (!key.empty()) {
+            const unsigned char byte = static_cast<unsigned char>(key[0]);
+            const std::size_t i = n->child_index(byte);
+            if (i == n->child_bytes.size() || n->child_bytes[i] != byte) {
+                auto leaf = std::make_unique<node>();
+                leaf->label = std::string(key);
+                node *raw = leaf.get();
+                n->add_child(std::move(leaf));
+                return *raw;
+            }
+
+            node *child = n->children[i].get();
+            const std::size_t common = common_prefix(child->label, key);
+            if (common < child->label.size()) {
+                // the key leaves the edge part way through: split the edge at that point
+                auto middle = std::make_unique<node>();
+                middle->label = child->label.substr(0, common);
+                child->label.erase(0, common);
+                middle->child_bytes.push_back(static_cast<unsigned char>(child->label[0]));
+                middle->children.push_back(std::move(n->children[i]));
+                n->children[i] = std::move(middle);
+                child = n->children[i].get();
+            }
+            key.remove_prefix(common);
+            n = child;
+        }
+        return *n;
+    }
+
+    bool erase_from(node &n, std::string_view key) {
+        if (key.empty()) {
+            if (!n.value)
+                return false;
+            n.value.reset();
+            return true;
+        }
+
+        const unsigned char byte = static_cast<unsigned char>(key[0]);
+        const std::size_t i = n.child_index(byte);
+        if (i == n.child_bytes.size() || n.child_bytes[i] != byte)
+            return false;
+        node &child = *n.children[i];
+        if (key.substr(0, child.label.size()) != child.label)
+            return false;
+        if (!erase_from(child, key.substr(child.label.size())))
+            return false;
+
+        if (!child.value && child.children.empty()) {
+            n.child_bytes.erase(n.child_bytes.begin() + static_cast<std::ptrdiff_t>(i));
+            n.children.erase(n.children.begin() + static_cast<std::ptrdiff_t>(i));
+        } else if (!child.value && child.children.size() == 1) {
+            // keep the tree path compressed: fold the only grandchild into the child
+            std::unique_ptr<node> grandchild = std::move(child.children[0]);
+            child.label += grandchild->label;
+            child.value = std::move(grandchild->value);
+            child.child_bytes = std::move(grandchild->child_bytes);
+            child.children = std::move(grandchild->children);
+        }
+        return true;
+    }
+
+    template <typename Node, typename Func> static void visit(Node &n, std::string &key, Func &func) {
+        if (n.value)
+            func(static_cast<const std::string &>(key), *n.value);
+        for (const auto &c : n.children) {
+            key += c->label;
+            visit(static_cast<Node &>(*c), key, func);
+            key.resize(key.size() - c->label.size());
+        }
+    }
+
+    std::unique_ptr<node> root;
+    std::size_t count = 0;
+};
+
+/**
+ * @brief Bulk load a radix_tree from a string keyed map.
+ *
+ * @tparam Map A map-like type whose key_type is convertible to std::string_view.
+ * @param map The map to convert.
+ * @return radix_tree<Map::mapped_type> A tree holding the same entries.
+ */
+template <typename Map> radix_tree<typename Map::mapped_type> to_radix_tree(const Map &map) {
+    radix_tree<typename Map::mapped_type> result;
+    for (const auto &[key, value] : map) {
+        result.insert(key, value);
+    }
+    return result;
+}
+
+/**
+ * @brief Check if a key exists in a radix_tree.
+ *
+ * @tparam Value Type of the values in the tree.
+ * @param tree The radix tree to search within.
+ * @param key The key to search for.
+ * @return true if the key exists in the tree, false otherwise.
+ */
+template <typename Value> bool contains_key(const radix_tree<Value> &tree, std::string_view key) {
+    return tree.contains(key);
+}
+
+/**
+ * @brief Check if a key does NOT exist in a radix_tree.
+ *
+ * @tparam Value Type of the values in the tree.
+ * @param tree The radix tree to search within.
+ * @param key The key to check for absence.
+ * @return true if the key does NOT exist in the tree, false otherwise.
+ */
+template <typename Value> bool does_not_contain_key(const radix_tree<Value> &tree, std::string_view key) {
+    return !tree.contains(key);
+}
+
+/**
+ * @brief Erase a key from a radix_tree, if it exists.
+ *
+ * @tparam Value Type of the values in the tree.
+ * @param tree The radix tree to modify.
+ * @param key The key to erase.
+ * @return true if the key was erased, false otherwise.
+ */
+template <typename Value> bool erase(radix_tree<Value> &tree, std::string_view key) { return tree.erase(key); }
+
+/**
+ * @brief Safely get a const reference to a value in a radix_tree.
+ *
+ * @tparam Value Type of the values in the tree.
+ * @param tree The radix tree to query.
+ * @param key The key to look for.
+ * @return std::optional<std::reference_wrapper<const Value>> The value, or std::nullopt if the key is not found.
+ */
+template <typename Value>
+std::optional<std::reference_wrapper<const Value>> at_optional(const radix_tree<Value> &tree, std::string_view key) {
+    if (const Value *value = tree.find(key))
+        return std::cref(*value);
+    return std::nullopt;
+}
+
+/**
+ * @brief Safely get a mutable reference to a value in a radix_tree.
+ *
+ * @tparam Value Type of the values in the tree.
+ * @param tree The radix tree to query.
+ * @param key The key to look for.
+ * @return std::optional<std::reference_wrapper<Value>> The value, or std::nullopt if the key is not found.
+ */
+template <typename Value>
+std::optional<std::reference_wrapper<Value>> at_optional(radix_tree<Value> &tree, std::string_view key) {
+    if (Value *value = tree.find(key))
+        return std::ref(*value);
+    return std::nullopt;
+}
+
+/**
+ * @brief Apply a function to each key-value pair of a radix_tree, in lexicographic key order.
+ *
+ * @tparam Value Type of the values in the tree.
+ * @tparam Func Type of the function to apply. Must be callable with (const std::string&, Value&).
+ * @param tree The radix tree to process.
+ * @param func Function to apply to each key-value pair.
+ */
+template <typename Value, typename Func> void for_each_pair_in_map(radix_tree<Value> &tree, Func func) {
+    tree.for_each(func);
+}
+
+/**
+ * @brief Keep only the entries of a radix_tree whose keys start with a prefix.
+ *
+ * This is the radix tree counterpart of filter_map_by_keys with a starts_with predicate, but it only visits the
+ * matching subtree: O(|prefix| + number of matches).
+ *
+ * @tparam Value Type of the values in the tree.
+ * @param tree The radix tree to filter.
+ * @param prefix The prefix every kept key must start with.
+ * @return radix_tree<Value> A new tree with the matching entries.
+ */
+template <typename Value>
+radix_tree<Value> filter_map_by_prefix(const radix_tree<Value> &tree, std::string_view prefix) {
+    radix_tree<Value> result;
+    tree.for_each_with_prefix(prefix, [&](const std::string &key, const Value &value) { result.insert(key, value); });
+    return result;
+}
+
+/**
+ * @brief Extracts all keys from a radix_tree into a vector.
+ *
+ * @tparam Value Type of the values in the tree.
+ * @param tree The radix tree to extract keys from.
+ * @return std::vector<std::string> The keys in lexicographic order.
+ */
+template <typename Value> std::vector<std::string> keys(const radix_tree<Value> &tree) {
+    std::vector<std::string> keys;
+    keys.reserve(tree.size());
+    tree.for_each([&](const std::string &key, const Value &) { keys.push_back(key); });
+    return keys;
+}
+
+/**
+ * @brief Extracts all values from a radix_tree into a vector.
+ *
+ * @tparam Value Type of the values in the tree.
+ * @param tree The radix tree to extract values from.
+ * @return std::vector<Value> The values in lexicographic key order.
+ */
+template <typename Value> std::vector<Value> values(const radix_tree<Value> &tree) {
+    std::vector<Value> values;
+    values.reserve(tree.size());
+    tree.for_each([&](const std::string &, const Value &value) { values.push_back(value); });
+    return values;
+}
+
+// endfold
+
+// startfold spatial hash grids
+
+/**
+ * @brief Uniform grid over 2D or 3D space for radius and box neighbour queries.
+ *
+ * Space is cut into cubic cells of a fixed size and each cell is hashed into a power of two bucket table. The grid
+ * is rebuilt in bulk: items are counting sorted by bucket, so every bucket's items (with their positions and cells)
+ * sit next to each other in memory and a query touches a few contiguous runs instead of one hash node per item.
+ * Hash collisions between cells are filtered by storing each item's cell coordinates.
+ *
+ * The grid is designed to be rebuilt every frame/step rather than updated incrementally.
+ *
+ * @tparam T Type of the stored items (often an index into another array).
+ * @tparam Dim Number of dimensions, 2 or 3.
+ * @tparam Scalar Coordinate type.
+ *
+ * @example
+ * @code
+ * spatial_hash_grid<std::size_t, 3> grid(2.0f);
+ * grid.rebuild(particle_ids, [&](std::size_t id) { return particles[id].position; });
+ * grid.query_radius(p, 1.5f, [&](std::size_t other, const auto &other_pos) { ... });
+ * @endcode
+ */
+template <typename T, std::size_t Dim = 3, typename Scalar = float> class spatial_hash_grid {
+    static_assert(Dim == 2 || Dim == 3, "spatial_hash_grid supports 2D and 3D");
+
+  public:
+    using position_type = std::array<Scalar, Dim>;
+    using cell_type = std::array<std::int32_t, Dim>;
+
+    /**
+     * @param cell_size Edge length of a cell; radius queries are cheapest when it is close to the typical radius.
+     *
+     * @throws std::invalid_argument if cell_size is not positive.
+     */
+    explicit spatial_hash_grid(Scalar cell_size) : cell_size(cell_size), inverse_cell_size(Scalar(1) / cell_size) {
+        if (!(cell_size > Scalar(0))) {
+            throw std::invalid_argument("spatial_hash_grid cell size must be positive");
+        }
+    }
+
+    /**
+     * @brief Replace the contents of the grid.
+     *
+     * @tparam PositionFunc Callable with const T& returning something convertible to position_type.
+     * @param source The items to store.
+     * @param position_of Extracts an item's position.
+     *
+     * @throws std::invalid_argument if a position has a NaN coordinate; the grid is left unchanged.
+     */
+    template <typename PositionFunc> void rebuild(const std::vector<T> &source, PositionFunc position_of) {
+        const std::size_t n = source.size();
+        std::vector<position_type> unsorted_positions(n);
+        std::vector<cell_type> unsorted_cells(n);
+        for (std::size_t i = 0; i < n; ++i) {
+            unsorted_positions[i] = position_of(source[i]);
+            unsorted_cells[i] = cell_of(unsorted_positions[i]);
+        }
+
+        std::size_t table_size = 1;
+        while (table_size < 2 * n)
+            table_size <<= 1;
+        bucket_mask = table_size - 1;
+
+        std::vector<std::size_t> item_buckets(n);
+        bucket_offsets.assign(table_size + 1, 0);
+        for (std::size_t i = 0; i < n; ++i) {
+            item_buckets[i] = bucket_of(unsorted_cells[i]);
+            ++bucket_offsets[item_buckets[i] + 1];
+        }
+        for (std::size_t b = 0; b < table_size; ++b) {
+            bucket_offsets[b + 1] += bucket_offsets[b];
+        }
+
+        // counting sort: scatter every item to the next free slot of its bucket
+        std::vector<std::size_t> cursor(bucket_offsets.begin(), bucket_offsets.end() - 1);
+        std::vector<std::size_t> order(n);
+        for (std::size_t i = 0; i < n; ++i) {
+            order[cursor[item_buckets[i]]++] = i;
+        }
+
+        items.clear();
+        items.reserve(n);
+        positions.resize(n);
+        cells.resize(n);
+        for (std::size_t slot = 0; slot < n; ++slot) {
+            const std::size_t i = order[slot];
+            items.push_back(source[i]);
+            positions[slot] = unsorted_positions[i];
+            cells[slot] = unsorted_cells[i];
+        }
+    }
+
+    /**
+     * @brief The cell a position falls in.
+     *
+     * Cell coordinates beyond the 32 bit range are clamped to it, so far away positions share the outermost cells
+     * (queries still filter by the exact position).
+     *
+     * @throws std::invalid_argument if a coordinate is NaN.
+     */
+    cell_type cell_of(const position_type &p) const {
+        cell_type c;
+        for (std::size_t d = 0; d < Dim; ++d) {
+            const Scalar scaled = std::floor(p[d] * inverse_cell_size);
+            if (scaled != scaled) {
+                throw std::invalid_argument("spatial_hash_grid position has a NaN coordinate");
+            }
+            // NOTE: 2^31 is exact in float and double, unlike INT32_MAX
+            if (scaled < Scalar(-2147483648.0)) {
+                c[d] = std::numeric_limits<std::int32_t>::min();
+            } else if (scaled >= Scalar(2147483648.0)) {
+                c[d] = std::numeric_limits<std::int32_t>::max();
+            } else {
+                c[d] = static_cast<std::int32_t>(scaled);
+            }
+        }
+        return c;
+    }
+
+    /**
+     * @brief Apply a function to every item stored in one cell.
+     *
+     * @tparam Func Callable with (const T&, const position_type&).
+     */
+    template <typename Func> void for_each_in_cell(const cell_type &cell, Func &&func) const {
+        if (items.empty())
+            return;
+        const std::size_t b = bucket_of(cell);
+        for (std::size_t slot = bucket_offsets[b]; slot < bucket_offsets[b + 1]; ++slot) {
+            if (cells[slot] == cell)
+                func(items[slot], positions[slot]);
+        }
+    }
+
+    bool cell_is_occupied(const cell_type &cell) const {
+        bool found = false;
+        for_each_in_cell(cell, [&](const T &, const position_type &) { found = true; });
+        return found;
+    }
+
+    /**
+     * @brief Apply a function to every item inside the axis aligned box [lo, hi] (bounds inclusive).
+     *
+     * @tparam Func Callable with (const T&, const position_type&).
+     */
+    template <typename Func> void query_aabb(const position_type &lo, const position_type &hi, Func &&func) const {
+        for_each_in_cells_between(cell_of(lo), cell_of(hi), [&](const T &item, const position_type &p) {
+            for (std::size_t d = 0; d < Dim; ++d) {
+                if (p[d] < lo[d] || hi[d] < p[d])
+                    return;
+            }
+            func(item, p);
+        });
+    }
+
+    /**
+     * @brief Apply a function to every item within radius of center (distance <= radius).
+     *
+     * @tparam Func Callable with (const T&, const position_type&).
+     */
+    template <typename Func> void query_radius(const position_type &center, Scalar radius, Func &&func) const {
+        position_type lo, hi;
+        for (std::size_t d = 0; d < Dim; ++d) {
+            lo[d] = center[d] - radius;
+            hi[d] = center[d] + radius;
+        }
+        const Scalar radius_squared = radius * radius;
+        for_each_in_cells_between(cell_of(lo), cell_of(hi), [&](const T &item, const position_type &p) {
+            Scalar distance_squared = 0;
+            for (std::size_t d = 0; d < Dim; ++d) {
+                const Scalar delta = p[d] - center[d];
+                distance_squared += delta * delta;
+            }
+            if (distance_squared <= radius_squared)
+                func(item, p);
+        });
+    }
+
+    /**
+     * @brief Apply a function to every item, bucket by bucket.
+     *
+     * @tparam Func Callable with (const T&, const position_type&).
+     */
+    template <typename Func> void for_each(Func &&func) const {
+        for (std::size_t slot = 0; slot < items.size(); ++slot) {
+            func(items[slot], positions[slot]);
+        }
+    }
+
+    /**
+     * @brief Collect the items for which a predicate holds.
+     *
+     * @tparam Pred Callable with (const T&, const position_type&).
+     */
+    template <typename Pred> std::vector<T> filter(Pred &&pred) const {
+        std::vector<T> result;
+        for_each([&](const T &item, const position_type &p) {
+            if (pred(item, p))
+                result.push_back(item);
+        });
+        return result;
+    }
+
+    void clear() {
+        items.clear();
+        positions.clear();
+        cells.clear();
+        bucket_offsets.clear();
+    }
+
+    std::size_t size() const { return items.size(); }
+    bool empty() const { return items.empty(); }
+    Scalar get_cell_size() const { return cell_size; }
+
+  private:
+    std::size_t bucket_of(const cell_type &cell) const {
+        // the usual large primes of Teschner et al. for spatial hashing
+        static constexpr std::uint32_t primes[3] = {73856093u, 19349663u, 83492791u};
+        std::uint32_t h = 0;
+        for (std::size_t d = 0; d < Dim; ++d) {
+            h ^= static_cast<std::uint32_t>(cell[d]) * primes[d];
+        }
+        return static_cast<std::size_t>(h) & bucket_mask;
+    }
+
+    /**
+     * @brief Apply func(item, position) to every item whose cell lies in the box [lo, hi] of cells.
+     *
+     * A box spanning more cells than there are items (a large radius relative to the cell size) is answered with one
+     * pass over all items instead, so a query never costs more than a full scan.
+     */
+    template <typename Func>
+    void for_each_in_cells_between(const cell_type &lo, const cell_type &hi, Func &&func) const {
+        if (items.empty())
+            return;
+        double cell_count = 1;
+        for (std::size_t d = 0; d < Dim; ++d) {
+            if (hi[d] < lo[d])
+                return;
+            cell_count *= static_cast<double>(hi[d]) - static_cast<double>(lo[d]) + 1;
+        }
+        if (cell_count > static_cast<double>(items.size())) {
+            for (std::size_t slot = 0; slot < items.size(); ++slot) {
+                bool inside = true;
+                for (std::size_t d = 0; d < Dim; ++d)
+                    inside = inside && lo[d] <= cells[slot][d] && cells[slot][d] <= hi[d];
+                if (inside)
+                    func(items[slot], positions[slot]);
+            }
+            return;
+        }
+        for_each_cell_between(lo, hi, [&](const cell_type &cell) { for_each_in_cell(cell, func); });
+    }
+
+    template <typename Func> void for_each_cell_between(const cell_type &lo, const cell_type &hi, Func &&func) const {
+        // NOTE: 64 bit counters, a range ending at the largest cell coordinate would overflow an int32 one
+        cell_type c = lo;
+        if constexpr (Dim == 2) {
+            for (std::int64_t y = lo[1]; y <= hi[1]; ++y) {
+                c[1] = static_cast<std::int32_t>(y);
+                for (std::int64_t x = lo[0]; x <= hi[0]; ++x) {
+                    c[0] = static_cast<std::int32_t>(x);
+                    func(c);
+                }
+            }
+        } else {
+            for (std::int64_t z = lo[2]; z <= hi[2]; ++z) {
+                c[2] = static_cast<std::int32_t>(z);
+                for (std::int64_t y = lo[1]; y <= hi[1]; ++y) {
+                    c[1] = static_cast<std::int32_t>(y);
+                    for (std::int64_t x = lo[0]; x <= hi[0]; ++x) {
+                        c[0] = static_cast<std::int32_t>(x);
+                        func(c);
+                    }
+                }
+            }
+        }
+    }
+
+    Scalar cell_size;
+    Scalar inverse_cell_size;
+    std::size_t bucket_mask = 0;
+    // bucket b owns slots [bucket_offsets[b], bucket_offsets[b + 1]) of the three parallel arrays below
+    std::vector<std::size_t> bucket_offsets;
+    std::vector<T> items;
+    std::vector<position_type> positions;
+    std::vector<cell_type> cells;
+};
+
+/**
+ * @brief Build a spatial_hash_grid over a vector of positions, storing each position's index.
+ *
+ * @tparam Dim Number of dimensions.
+ * @tparam Scalar Coordinate type.
+ * @param positions The positions to index.
+ * @param cell_size Edge length of a grid cell.
+ * @return spatial_hash_grid<std::size_t, Dim, Scalar> A grid whose items are indices into positions.
+ */
+template <std::size_t Dim, typename Scalar>
+spatial_hash_grid<std::size_t, Dim, Scalar>
+build_spatial_hash_grid(const std::vector<std::array<Scalar, Dim>> &positions, Scalar cell_size) {
+    std::vector<std::size_t> indices(positions.size());
+    for (std::size_t i = 0; i < indices.size(); ++i)
+        indices[i] = i;
+    spatial_hash_grid<std::size_t, Dim, Scalar> grid(cell_size);
+    grid.rebuild(indices, [&](std::size_t i) { return positions[i]; });
+    return grid;
+}
+
+/**
+ * @brief Check if any item of a spatial_hash_grid lies in a cell.
+ *
+ * @tparam T Type of the stored items.
+ * @tparam Dim Number of dimensions.
+ * @tparam Scalar Coordinate type.
+ * @param grid The grid to search within.
+ * @param cell The cell coordinates, as returned by grid.cell_of.
+ * @return true if the cell holds at least one item, false otherwise.
+ */
+template <typename T, std::size_t Dim, typename Scalar>
+bool contains_key(const spatial_hash_grid<T, Dim, Scalar> &grid,
+                  const typename spatial_hash_grid<T, Dim, Scalar>::cell_type &cell) {
+    return grid.cell_is_occupied(cell);
+}
+
+// endfold
+
+// startfold indexed priority queues
+
+/**
+ * @brief d-ary heap of (key, priority) pairs that can change or remove the priority of any key in O(log n).
+ *
+ * The heap is one contiguous vector and a hash index remembers where each key currently sits in it, so
+ * decrease-key is done in place instead of pushing duplicates and skipping stale entries on pop. A 4-ary heap is
+ * shallower than a binary one and keeps each node's children in a single cache line for small pairs.
+ *
+ * With the default std::less the element with the SMALLEST priority is on top (unlike std::priority_queue), which
+ * is what shortest-path searches want.
+ *
+ * @tparam Key Type of the keys, must be hashable.
+ * @tparam Priority Type of the priorities.
+ * @tparam Compare Strict weak ordering; top() is the element that compares before all others.
+ * @tparam Arity Number of children per heap node.
+ *
+ * @example
+ * @code
+ * indexed_priority_queue<Node, float> frontier;
+ * frontier.push(start, 0.0f);
+ * while (!frontier.empty()) {
+ *     auto [node, distance] = frontier.pop();
+ *     for (auto [next, weight] : edges(node)) {
+ *         auto known = frontier.priority_of(next);
+ *         if (!visited(next) && (!known || distance + weight < *known))
+ *             frontier.push_or_update(next, distance + weight); // decrease-key
+ *     }
+ * }
+ * @endcode
+ */
+template <typename Key, typename Priority, typename Compare = std::less<Priority>, std::size_t Arity = 4>
+class indexed_priority_queue {
+    static_assert(Arity >= 2, "a heap needs at least two children per node");
+
+  public:
+    using key_type = Key;
+    using mapped_type = Priority;
+    using value_type = std::pair<Key, Priority>;
+
+    explicit indexed_priority_queue(Compare compare = Compare()) : compare(std::move(compare)) {}
+
+    /**
+     * @brief Add a key with a priority.
+     *
+     * @return true if the key was added, false if it was already queued (its priority is left unchanged).
+     */
+    bool push(const Key &key, Priority priority) {
+        if (positions.count(key))
+            return false;
+        heap.emplace_back(key, std::move(priority));
+        positions.emplace(key, heap.size() - 1);
+        sift_up(heap.size() - 1);
+        return true;
+    }
+
+    /**
+     * @brief Add a key, or change its priority if it is already queued.
+     */
+    void push_or_update(const Key &key, Priority priority) {
+        if (!update(key, priority))
+            push(key, std::move(priority));
+    }
+
+    /**
+     * @brief Change the priority of a queued key (decrease-key and increase-key), moving it up or down as needed.
+     *
+     * @return true if the key was queued, false otherwise.
+     */
+    bool update(const Key &key, Priority priority) {
+        auto it = positions.find(key);
+        if (it == positions.end())
+            return false;
+        const std::size_t i = it->second;
+        const bool moves_up = compare(priority, heap[i].second);
+        heap[i].second = std::move(priority);
+        if (moves_up)
+            sift_up(i);
+        else
+            sift_down(i);
+        return true;
+    }
+
+    /**
+     * @brief The element with the highest precedence. The queue must not be empty.
+     */
+    const value_type &top() const { return heap.front(); }
+
+    /**
+     * @brief Remove and return the element with the highest precedence. The queue must not be empty.
+     */
+    value_type pop() {
+        value_type result = std::move(heap.front());
+        positions.erase(result.first);
+        remove_at(0);
+        return result;
+    }
+
+    /**
+     * @brief Remove a key wherever it is in the heap.
+     *
+     * @return true if the key was queued, false otherwise.
+     */
+    bool erase(const Key &key) {
+        auto it = positions.find(key);
+        if (it == positions.end())
+            return false;
+        const std::size_t i = it->second;
+        positions.erase(it);
+        remove_at(i);
+        return true;
+    }
+
+    bool contains(const Key &key) const { return positions.count(key) != 0; }
+
+    /**
+     * @brief Get a pointer to the current priority of a key, or nullptr if it is not queued.
+     */
+    const Priority *find(const Key &key) const {
+        auto it = positions.find(key);
+        return it == positions.end() ? nullptr : &heap[it->second].second;
+    }
+
+    std::optional<Priority> priority_of(const Key &key) const {
+        if (const Priority *p = find(key))
+            return *p;
+        return std::nullopt;
+    }
+
+    void reserve(std::size_t n) {
+        heap.reserve(n);
+        positions.reserve(n);
+    }
+
+    void clear() {
+        heap.clear();
+        positions.clear();
+    }
+
+    std::size_t size() const { return heap.size(); }
+    bool empty() const { return heap.empty(); }
+
+  private:
+    /**
+     * @brief Fill slot i with the last element and restore the heap. The index entry of slot i must already be gone.
+     */
+    void remove_at(std::size_t i) {
+        const std::size_t last = heap.size() - 1;
+        if (i != last) {
+            heap[i] = std::move(heap[last]);
+            positions[heap[i].first] = i;
+            heap.pop_back();
+            // the moved element may belong above or below slot i
+            if (i > 0 && compare(heap[i].second, heap[(i - 1) / Arity].second))
+                sift_up(i);
+            else
+                sift_down(i);
+        } else {
+            heap.pop_back();
+        }
+    }
+
+    void sift_up(std::size_t i) {
+        value_type moving = std::move(heap[i]);
+        while (i > 0) {
+            const std::size_t parent = (i - 1) / Arity;
+            if (!compare(moving.second, heap[parent].second))
+                break;
+            heap[i] = std::move(heap[parent]);
+            positions[heap[i].first] = i;
+            i = parent;
+        }
+        heap[i] = std::move(moving);
+        positions[heap[i].first] = i;
+    }
+
+    void sift_down(std::size_t i) {
+        const std::size_t n = heap.size();
+        value_type moving = std::move(heap[i]);
+        while (true) {
+            const std::size_t first_child = i * Arity + 1;
+            if (first_child >= n)
+                break;
+            const std::size_t last_child = std::min(first_child + Arity, n);
+            std::size_t best = first_child;
+            for (std::size_t c = first_child + 1; c < last_child; ++c) {
+                if (compare(heap[c].second, heap[best].second))
+                    best = c;
+            }
+            if (!compare(heap[best].second, moving.second))
+                break;
+            heap[i] = std::move(heap[best]);
+            positions[heap[i].first] = i;
+            i = best;
+        }
+        heap[i] = std::move(moving);
+        positions[heap[i].first] = i;
+    }
+
+    std::vector<value_type> heap;
+    std::unordered_map<Key, std::size_t> positions;
+    Compare compare;
+};
+
+/**
+ * @brief Check if a key is queued in an indexed_priority_queue.
+ *
+ * @tparam Key Type of the keys.
+ * @tparam Priority Type of the priorities.
+ * @tparam Compare Ordering of the queue.
+ * @tparam Arity Number of children per heap node.
+ * @param queue The queue to search within.
+ * @param key The key to search for.
+ * @return true if the key is queued, false otherwise.
+ */
+template <typename Key, typename Priority, typename Compare, std::size_t Arity>
+bool contains_key(const indexed_priority_queue<Key, Priority, Compare, Arity> &queue,
+                  const typename indexed_priority_queue<Key, Priority, Compare, Arity>::key_type &key) {
+    return queue.contains(key);
+}
+
+/**
+ * @brief Safely get the current priority of a queued key.
+ *
+ * Only const access is offered since changing a priority must go through update() to keep the heap ordered.
+ *
+ * @tparam Key Type of the keys.
+ * @tparam Priority Type of the priorities.
+ * @tparam Compare Ordering of the queue.
+ * @tparam Arity Number of children per heap node.
+ * @param queue The queue to query.
+ * @param key The key to look for.
+ * @return std::optional<std::reference_wrapper<const Priority>> The priority, or std::nullopt if not queued.
+ */
+template <typename Key, typename Priority, typename Compare, std::size_t Arity>
+std::optional<std::reference_wrapper<const Priority>>
+at_optional(const indexed_priority_queue<Key, Priority, Compare, Arity> &queue,
+            const typename indexed_priority_queue<Key, Priority, Compare, Arity>::key_type &key) {
+    if (const Priority *priority = queue.find(key))
+        return std::cref(*priority);
+    return std::nullopt;
+}
+
+/**
+ * @brief Remove a key from an indexed_priority_queue, if it is queued.
+ *
+ * @tparam Key Type of the keys.
+ * @tparam Priority Type of the priorities.
+ * @tparam Compare Ordering of the queue.
+ * @tparam Arity Number of children per heap node.
+ * @param queue The queue to modify.
+ * @param key The key to remove.
+ * @return true if the key was removed, false otherwise.
+ */
+template <typename Key, typename Priority, typename Compare, std::size_t Arity>
+bool erase(indexed_priority_queue<Key, Priority, Compare, Arity> &queue,
+           const typename indexed_priority_queue<Key, Priority, Compare, Arity>::key_type &key) {
+    return queue.erase(key);
+}
+
+// endfold
+
+// startfold concurrent queues
+
+namespace detail {
+
+inline constexpr std::size_t cache_line_size = 64;
+
+inline void cpu_relax() {
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_ia32_pause();
+#elif (defined(__GNUC__) || defined(__clang__)) && defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+inline std::size_t round_up_to_power_of_two(std::size_t n) {
+    std::size_t p = 1;
+    while (p < n)
+        p <<= 1;
+    return p;
+}
+
+/**
+ * @brief Lets threads sleep until another thread signals progress, without a mutex.
+ *
+ * Sleeping is done with std::atomic::wait (a futex on Linux) when the standard library provides it, and by
+ * yielding otherwise. Signalling is a fence and a load while nobody is asleep, so the fast path of a queue pays
+ * almost nothing for the ability to block. Each event fills its own cache line, so the events of the two sides of a
+ * queue do not false share with each other or with the queue's counters.
+ */
+class alignas(cache_line_size) wait_event {
+  public:
+    /**
+     * @brief Announce that this thread is about to sleep and return the epoch to sleep on.
+     *
+     * The caller must re-check its condition after this call and before sleep(), then always call done().
+     */
+    std::uint32_t prepare() {
+        sleepers.fetch_add(1, std::memory_order_seq_cst);
+#if !defined(__SANITIZE_THREAD__)
+        // pairs with the fence in notify(): either the notifier sees this sleeper, or the re-check sees its update
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+#endif
+        return epoch.load(std::memory_order_acquire);
+    }
+
+    void sleep(std::uint32_t seen) {
+#if defined(__cpp_lib_atomic_wait)
+        epoch.wait(seen, std::memory_order_acquire);
+#else
+        while (epoch.load(std::memory_order_acquire) == seen)
+            std::this_thread::yield();
+#endif
+    }
+
+    void done() { sleepers.fetch_sub(1, std::memory_order_relaxed); }
+
+    /**
+     * @brief Wake every sleeper. Must be called after the state change the sleepers wait for is published.
+     */
+    void notify() {
+#if defined(__SANITIZE_THREAD__)
+        // ThreadSanitizer does not model fences, so use a read-modify-write with the same ordering under it
+        const std::uint32_t waiting = sleepers.fetch_add(0, std::memory_order_seq_cst);
+#else
+        // a fence rather than a read-modify-write, so the uncontended path never takes the line away from sleepers
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        const std::uint32_t waiting = sleepers.load(std::memory_order_relaxed);
+#endif
+        if (waiting != 0)
+            wake();
+    }
+
+    void wake() {
+        epoch.fetch_add(1, std::memory_order_release);
+#if defined(__cpp_lib_atomic_wait)
+        epoch.notify_all();
+#endif
+    }
+
+  private:
+    std::atomic<std::uint32_t> epoch{0};
+    std::atomic<std::uint32_t> sleepers{0};
+};
+
+/**
+ * @brief Blocking on top of a non-blocking try operation: spin with exponential backoff, then yield, then sleep.
+ *
+ * @return true once try_op succeeds, false if the queue was closed and a last attempt still failed.
+ */
+template <typename TryOp> bool wait_for(TryOp &&try_op, wait_event &event, const std::atomic<bool> &closed) {
+    for (unsigned round = 0;; ++round) {
+        if (try_op())
+            return true;
+        if (closed.load(std::memory_order_acquire))
+            return try_op();
+
+        if (round < 6) {
+            for (unsigned i = 0; i < (1u << round); ++i)
+                cpu_relax();
+        } else if (round < 10) {
+            std::this_thread::yield();
+        } else {
+            const std::uint32_t seen = event.prepare();
+            const bool ready = try_op();
+            if (!ready && !closed.load(std::memory_order_acquire))
+                event.sleep(seen);
+            event.done();
+            if (ready)
+                return true;
+        }
+    }
+}
+
+/**
+ * @brief Uninitialized, suitably aligned storage for one T.
+ */
+template <typename T> struct raw_slot {
+    alignas(T) unsigned char bytes[sizeof(T)];
+
+    T *get() { return std::launder(reinterpret_cast<T *>(bytes)); }
+};
+
+} // namespace detail
+
+/**
+ * @brief Bounded lock-free multi-producer multi-consumer queue (Dmitry Vyukov's array queue).
+ *
+ * Each slot carries a sequence number telling producers and consumers whose turn it is. Claiming a slot is a
+ * single CAS on the shared head or tail counter, and the two counters live on separate cache lines so producers
+ * and consumers do not false share. Blocking variants spin, then yield, then sleep on a futex; close() wakes every
+ * blocked thread.
+ *
+ * Exceptions leave the queue usable: if constructing an element throws, the claimed slot is published as empty and
+ * skipped by consumers; if handing a popped element to its destination throws, that element is destroyed and its
+ * slot released before the exception propagates, so the element is lost.
+ *
+ * @tparam T Type of the elements, must be move constructible.
+ *
+ * @example
+ * @code
+ * mpmc_queue<std::vector<Record>> batches(64);
+ * // producers
+ * batches.push(parse_batch(...));       // blocks while full
+ * // consumers
+ * while (auto batch = batches.pop()) {  // std::nullopt once closed and drained
+ *     process(*batch);
+ * }
+ * // when every producer is done
+ * batches.close();
+ * @endcode
+ */
+template <typename T> class mpmc_queue {
+  public:
+    using value_type = T;
+
+    /**
+     * @param capacity Minimum number of elements the queue can hold; rounded up to a power of two.
+     */
+    explicit mpmc_queue(std::size_t capacity)
+        : mask(detail::round_up_to_power_of_two(std::max<std::size_t>(capacity, 2)) - 1),
+          cells(std::make_unique<cell[]>(mask + 1)) {
+        for (std::size_t i = 0; i <= mask; ++i)
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    mpmc_queue(const mpmc_queue &) = delete;
+    mpmc_queue &operator=(const mpmc_queue &) = delete;
+
+    ~mpmc_queue() {
+        while (pop_one([](T &&) {})) {
+        }
+    }
+
+    /**
+     * @brief Push without blocking.
+     *
+     * @return true if the element was pushed, false if the queue was full or closed.
+     */
+    template <typename V> bool try_push(V &&value) {
+        if (closed.load(std::memory_order_relaxed) || !push_one(std::forward<V>(value)))
+            return false;
+        not_empty.notify();
+        return true;
+    }
+
+    /**
+     * @brief Pop without blocking.
+     *
+     * @return true if an element was popped into out, false if the queue was empty.
+     */
+    bool try_pop(T &out) {
+        if (!pop_one([&](T &&element) { out = std::move(element); }))
+            return false;
+        not_full.notify();
+        return true;
+    }
+
+    /**
+     * @brief Push as many elements of [first, last) as fit without blocking, waking consumers once.
+     *
+     * The pushed elements are moved out of the range, which keeps them in a moved-from state.
+     *
+     * @return The number of elements pushed; they are the first ones of the range.
+     */
+    template <typename It> std::size_t try_push_batch(It first, It last) {
+        if (closed.load(std::memory_order_relaxed))
+            return 0;
+        std::size_t pushed = 0;
+        for (; first != last && push_one(std::move(*first)); ++first)
+            ++pushed;
+        if (pushed > 0)
+            not_empty.notify();
+        return pushed;
+    }
+
+    /**
+     * @brief Pop up to max_count elements without blocking, waking producers once.
+     *
+     * @return The number of elements written to out.
+     */
+    template <typename OutputIt> std::size_t try_pop_batch(OutputIt out, std::size_t max_count) {
+        std::size_t popped = 0;
+        while (popped < max_count && pop_one([&](T &&element) { *out++ = std::move(element); }))
+            ++popped;
+        if (popped > 0)
+            not_full.notify();
+        return popped;
+    }
+
+    /**
+     * @brief Push, waiting while the queue is full.
+     *
+     * @return true if the element was pushed, false if the queue was closed.
+     */
+    template <typename V> bool push(V &&value) {
+        return detail::wait_for([&] { return try_push(std::forward<V>(value)); }, not_full, closed);
+    }
+
+    /**
+     * @brief Pop, waiting while the queue is empty.
+     *
+     * @return The element, or std::nullopt once the queue is closed and empty.
+     */
+    std::optional<T> pop() {
+        std::optional<T> value;
+        detail::wait_for(
+            [&] {
+                if (!pop_one([&](T &&element) { value.emplace(std::move(element)); }))
+                    return false;
+                not_full.notify();
+                return true;
+            },
+            not_empty, closed);
+        return value;
+    }
+
+    /**
+     * @brief Wait until at least one element is available, then pop up to max_count elements.
+     *
+     * @return The number of elements written to out, 0 only once the queue is closed and empty.
+     */
+    template <typename OutputIt> std::size_t pop_batch(OutputIt out, std::size_t max_count) {
+        std::size_t popped = 0;
+        detail::wait_for([&] { return (popped = try_pop_batch(out, max_count)) > 0; }, not_empty, closed);
+        return popped;
+    }
+
+    /**
+     * @brief Reject further pushes and wake every blocked thread. Elements already queued can still be popped.
+     */
+    void close() {
+        closed.store(true, std::memory_order_release);
+        not_empty.wake();
+        not_full.wake();
+    }
+
+    bool is_closed() const { return closed.load(std::memory_order_acquire); }
+
+    std::size_t capacity() const { return mask + 1; }
+
+    /**
+     * @brief Approximate number of queued elements; exact only when no other thread is using the queue.
+     */
+    std::size_t size_approx() const {
+        const std::size_t tail = enqueue_pos.load(std::memory_order_relaxed);
+        const std::size_t head = dequeue_pos.load(std::memory_order_relaxed);
+        return tail >= head ? tail - head : 0;
+    }
+
+  private:
+    struct cell {
+        std::atomic<std::size_t> sequence;
+        bool has_value = false; // false for a slot whose element constructor threw, consumers skip it
+        detail::raw_slot<T> slot;
+    };
+
+    template <typename V> bool push_one(V &&value) {
+        std::size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        cell *c;
+        while (true) {
+            c = &cells[pos & mask];
+            const std::size_t sequence = c->sequence.load(std::memory_order_acquire);
+            const auto diff = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(pos);
+            if (diff == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false; // the slot still holds an element from one lap ago: full
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        // the slot is claimed now, so it has to be published even if the constructor throws, or every later lap
+        // would wait on it forever
+        try {
+            ::new (static_cast<void *>(c->slot.bytes)) T(std::forward<V>(value));
+            c->has_value = true;
+        } catch (...) {
+            c->has_value = false;
+            c->sequence.store(pos + 1, std::memory_order_release);
+            throw;
+        }
+        c->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    template <typename Sink> bool pop_one(Sink &&sink) {
+        while (true) {
+            std::size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+            cell *c;
+            while (true) {
+                c = &cells[pos & mask];
+                const std::size_t sequence = c->sequence.load(std::memory_order_acquire);
+                const auto diff = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(pos + 1);
+                if (diff == 0) {
+                    if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                        break;
+                } else if (diff < 0) {
+                    return false; // nothing published in this slot yet: empty
+                } else {
+                    pos = dequeue_pos.load(std::memory_order_relaxed);
+                }
+            }
+            if (!c->has_value) {
+                // left empty by a throwing push: release it and try the next slot
+                c->sequence.store(pos + mask + 1, std::memory_order_release);
+                not_full.notify();
+                continue;
+            }
+            T *element = c->slot.get();
+            try {
+                sink(std::move(*element));
+            } catch (...) {
+                element->~T();
+                c->sequence.store(pos + mask + 1, std::memory_order_release);
+                throw;
+            }
+            element->~T();
+            c->sequence.store(pos + mask + 1, std::memory_order_release);
+            return true;
+        }
+    }
+
+    const std::size_t mask;
+    std::unique_ptr<cell[]> cells;
+    alignas(detail::cache_line_size) std::atomic<std::size_t> enqueue_pos{0};
+    alignas(detail::cache_line_size) std::atomic<std::size_t> dequeue_pos{0};
+    alignas(detail::cache_line_size) std::atomic<bool> closed{false};
+    detail::wait_event not_empty;
+    detail::wait_event not_full;
+};
+
+/**
+ * @brief Bounded lock-free single-producer single-consumer ring buffer.
+ *
+ * The fast path for a pipeline stage feeding exactly one other stage: no CAS at all, each side only publishes its own
+ * counter, and keeps a cached copy of the other side's counter so it touches the shared cache line only when the
+ * ring looks full (producer) or empty (consumer). Same blocking and close() behaviour as mpmc_queue.
+ *
+ * @warning Exactly one thread may push and exactly one thread may pop.
+ *
+ * Exceptions behave as in mpmc_queue: a throwing element constructor pushes nothing, and an element whose hand-off
+ * to its destination throws is destroyed and its slot released.
+ *
+ * @tparam T Type of the elements, must be move constructible.
+ */
+template <typename T> class spsc_queue {
+  public:
+    using value_type = T;
+
+    /**
+     * @param capacity Minimum number of elements the queue can hold; rounded up to a power of two.
+     */
+    explicit spsc_queue(std::size_t capacity)
+        : mask(detail::round_up_to_power_of_two(std::max<std::size_t>(capacity, 1)) - 1),
+          slots(std::make_unique<detail::raw_slot<T>[]>(mask + 1)) {}
+
+    spsc_queue(const spsc_queue &) = delete;
+    spsc_queue &operator=(const spsc_queue &) = delete;
+
+    ~spsc_queue() {
+        const std::size_t tail = producer.position.load(std::memory_order_relaxed);
+        for (std::size_t head = consumer.position.load(std::memory_order_relaxed); head != tail; ++head)
+            slots[head & mask].get()->~T();
+    }
+
+    template <typename V> bool try_push(V &&value) {
+        if (closed.load(std::memory_order_relaxed) || !push_one(std::forward<V>(value)))
+            return false;
+        not_empty.notify();
+        return true;
+    }
+
+    bool try_pop(T &out) {
+        if (!pop_one([&](T &&element) { out = std::move(element); }))
+            return false;
+        not_full.notify();
+        return true;
+    }
+
+    /**
+     * @brief Push as many elements of [first, last) as fit, moving them out of the range; see mpmc_queue.
+     */
+    template <typename It> std::size_t try_push_batch(It first, It last) {
+        if (closed.load(std::memory_order_relaxed))
+            return 0;
+        std::size_t pushed = 0;
+        for (; first != last && push_one(std::move(*first)); ++first)
+            ++pushed;
+        if (pushed > 0)
+            not_empty.notify();
+        return pushed;
+    }
+
+    template <typename OutputIt> std::size_t try_pop_batch(OutputIt out, std::size_t max_count) {
+        std::size_t popped = 0;
+        while (popped < max_count && pop_one([&](T &&element) { *out++ = std::move(element); }))
+            ++popped;
+        if (popped > 0)
+            not_full.notify();
+        return popped;
+    }
+
+    template <typename V> bool push(V &&value) {
+        return detail::wait_for([&] { return try_push(std::forward<V>(value)); }, not_full, closed);
+    }
+
+    std::optional<T> pop() {
+        std::optional<T> value;
+        detail::wait_for(
+            [&] {
+                if (!pop_one([&](T &&element) { value.emplace(std::move(element)); }))
+                    return false;
+                not_full.notify();
+                return true;
+            },
+            not_empty, closed);
+        return value;
+    }
+
+    template <typename OutputIt> std::size_t pop_batch(OutputIt out, std::size_t max_count) {
+        std::size_t popped = 0;
+        detail::wait_for([&] { return (popped = try_pop_batch(out, max_count)) > 0; }, not_empty, closed);
+        return popped;
+    }
+
+    void close() {
+        closed.store(true, std::memory_order_release);
+        not_empty.wake();
+        not_full.wake();
+    }
+
+    bool is_closed() const { return closed.load(std::memory_order_acquire); }
+
+    std::size_t capacity() const { return mask + 1; }
+
+    std::size_t size_approx() const {
+        return producer.position.load(std::memory_order_relaxed) - consumer.position.load(std::memory_order_relaxed);
+    }
+
+  private:
+    // each side's published counter and its cached view of the other side share a cache line that only that side
+    // writes to
+    struct alignas(detail::cache_line_size) side {
+        std::atomic<std::size_t> position{0};
+        std::size_t cached_other = 0;
+    };
+
+    template <typename V> bool push_one(V &&value) {
+        const std::size_t tail = producer.position.load(std::memory_order_relaxed);
+        if (tail - producer.cached_other > mask) {
+            producer.cached_other = consumer.position.load(std::memory_order_acquire);
+            if (tail - producer.cached_other > mask)
+                return false;
+        }
+        ::new (static_cast<void *>(slots[tail & mask].bytes)) T(std::forward<V>(value));
+        producer.position.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    template <typename Sink> bool pop_one(Sink &&sink) {
+        const std::size_t head = consumer.position.load(std::memory_order_relaxed);
+        if (head == consumer.cached_other) {
+            consumer.cached_other = producer.position.load(std::memory_order_acquire);
+            if (head == consumer.cached_other)
+                return false;
+        }
+        T *element = slots[head & mask].get();
+        try {
+            sink(std::move(*element));
+        } catch (...) {
+            element->~T();
+            consumer.position.store(head + 1, std::memory_order_release);
+            throw;
+        }
+        element->~T();
+        consumer.position.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    const std::size_t mask;
+    std::unique_ptr<detail::raw_slot<T>[]> slots;
+    side producer;
+    side consumer;
+    alignas(detail::cache_line_size) std::atomic<bool> closed{false};
+    detail::wait_event not_empty;
+    detail::wait_event not_full;
+};
+
+// endfold
+
+// startfold pipelines
+
+/**
+ * @brief Sizing of a pipeline's batches and of the bounded buffers between its stages.
+ *
+ * Peak memory per stage boundary is roughly (buffer_batches + threads of both stages) * batch_size elements, no matter
+ * how long the input is.
+ */
+struct pipeline_options {
+    std::size_t batch_size = 1024;
+    std::size_t buffer_batches = 4;
+};
+
+/**
+ * @brief What one pipeline stage did. Times are summed over all threads of the stage.
+ */
+struct pipeline_stage_metrics {
+    std::string name;
+    std::size_t threads = 0;
+    std::size_t batches = 0;
+    std::size_t items_in = 0;
+    std::size_t items_out = 0;
+    std::chrono::nanoseconds busy_time{0};        // running the stage function
+    std::chrono::nanoseconds input_wait_time{0};  // waiting for the upstream stage
+    std::chrono::nanoseconds output_wait_time{0}; // blocked on a full downstream buffer, i.e. backpressure
+};
+
+namespace detail {
+
+struct pipeline_stage_counters {
+    pipeline_stage_counters(std::string name, std::size_t threads) : name(std::move(name)), threads(threads) {}
+
+    const std::string name;
+    const std::size_t threads;
+    std::atomic<std::size_t> batches{0};
+    std::atomic<std::size_t> items_in{0};
+    std::atomic<std::size_t> items_out{0};
+    std::atomic<std::int64_t> busy_ns{0};
+    std::atomic<std::int64_t> input_wait_ns{0};
+    std::atomic<std::int64_t> output_wait_ns{0};
+
+    static void add_time(std::atomic<std::int64_t> &counter, std::chrono::steady_clock::time_point from,
+                         std::chrono::steady_clock::time_point to) {
+        counter.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(to - from).count(),
+                          std::memory_order_relaxed);
+    }
+
+    pipeline_stage_metrics snapshot() const {
+        pipeline_stage_metrics m;
+        m.name = name;
+        m.threads = threads;
+        m.batches = batches.load(std::memory_order_relaxed);
+        m.items_in = items_in.load(std::memory_order_relaxed);
+        m.items_out = items_out.load(std::memory_order_relaxed);
+        m.busy_time = std::chrono::nanoseconds(busy_ns.load(std::memory_order_relaxed));
+        m.input_wait_time = std::chrono::nanoseconds(input_wait_ns.load(std::memory_order_relaxed));
+        m.output_wait_time = std::chrono::nanoseconds(output_wait_ns.load(std::memory_order_relaxed));
+        return m;
+    }
+};
+
+/**
+ * @brief Bounded buffer of batches between two stages; an spsc_queue when both sides are single threaded.
+ */
+template <typename T> class pipeline_channel {
+  public:
+    void open(std::size_t producers, std::size_t consumers, std::size_t capacity) {
+        if (producers == 1 && consumers == 1)
+            spsc = std::make_unique<spsc_queue<std::vector<T>>>(capacity);
+        else
+            mpmc = std::make_unique<mpmc_queue<std::vector<T>>>(capacity);
+    }
+
+    bool push(std::vector<T> &&batch) { return spsc ? spsc->push(std::move(batch)) : mpmc->push(std::move(batch)); }
+
+    std::optional<std::vector<T>> pop() { return spsc ? spsc->pop() : mpmc->pop(); }
+
+    void close() {
+        if (spsc)
+            spsc->close();
+        else if (mpmc)
+            mpmc->close();
+    }
+
+  private:
+    std::unique_ptr<spsc_queue<std::vector<T>>> spsc;
+    std::unique_ptr<mpmc_queue<std::vector<T>>> mpmc;
+};
+
+/**
+ * @brief Wrap a callable in a std::function, through a shared_ptr if it is move-only.
+ */
+template <typename Body> std::function<void()> to_pipeline_function(Body body) {
+    if constexpr (std::is_copy_constructible_v<Body>)
+        return body;
+    else
+        return [body = std::make_shared<Body>(std::move(body))] { (*body)(); };
+}
+
+struct pipeline_state {
+    struct stage_workers {
+        std::vector<std::function<void()>> bodies; // one per thread, so no closure is shared between threads
+        std::function<void()> close_output;
+    };
+
+    explicit pipeline_state(pipeline_options options) : options(options) {}
+
+    pipeline_stage_counters &add_counters(std::string name, std::size_t threads) {
+        return counters.emplace_back(std::move(name), threads);
+    }
+
+    void fail(std::exception_ptr e) {
+        {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (!error)
+                error = std::move(e);
+        }
+        failed.store(true, std::memory_order_release);
+        for (auto &stage : stages)
+            stage.close_output();
+    }
+
+    bool has_failed() const { return failed.load(std::memory_order_acquire); }
+
+    /**
+     * @brief Start every stage on its own threads, run the sink on the calling thread, join and rethrow the first
+     * exception any stage threw.
+     */
+    void run(const std::function<void()> &sink) {
+        if (started)
+            throw std::logic_error("pipeline has already been run");
+        started = true;
+
+        std::vector<std::thread> threads;
+        try {
+            for (auto &stage : stages) {
+                auto remaining = std::make_shared<std::atomic<std::size_t>>(stage.bodies.size());
+                for (auto &body : stage.bodies) {
+                    threads.emplace_back([this, &stage, &body, remaining] {
+                        try {
+                            body();
+                        } catch (...) {
+                            fail(std::current_exception());
+                        }
+                        // the last thread of a stage tells the next stage that no more batches are coming
+                        if (remaining->fetch_sub(1, std::memory_order_acq_rel) == 1)
+                            stage.close_output();
+                    });
+                }
+            }
+            sink();
+        } catch (...) {
+            fail(std::current_exception());
+        }
+        for (auto &thread : threads)
+            thread.join();
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    const pipeline_options options;
+    std::deque<pipeline_stage_counters> counters; // deque: atomics must not move
+    std::vector<stage_workers> stages;
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    std::atomic<bool> failed{false};
+    bool started = false;
+};
+
+} // namespace detail
+
+/**
+ * @brief A chain of stages that process batches of elements concurrently, connected by bounded buffers.
+ *
+ * Instead of map_vector, then filter, then build_map_from_vector as separate full passes, every stage runs on its own
+ * threads and starts on the first batch as soon as the previous stage produces it. A full buffer blocks the stage
+ * feeding it, so a fast source cannot run ahead of a slow consumer and memory stays bounded for streaming input.
+ *
+ * Stages are added with map, filter and map_batch, each with its own thread count. Nothing runs until a terminal
+ * operation (collect, for_each, build_map, group_by) is called. That call runs the sink on the calling thread and
+ * returns when everything is done. If any stage throws, the pipeline shuts down and the first exception is rethrown
+ * from the terminal operation. Per-stage timings are available afterwards from metrics().
+ *
+ * Every thread of a stage calls its own copy of the stage function, so a mutable function object needs no locking, but
+ * a function for a stage with more than one thread must be copyable and anything it refers to by reference or pointer
+ * is shared between those threads. Single threaded stages and the source may be move-only.
+ *
+ * @warning Batches reach the next stage in order only while every stage in between runs on a single thread.
+ *
+ * @tparam T Type of the elements leaving the last stage.
+ *
+ * @example
+ * @code
+ * auto records = make_pipeline_from_generator<std::string>(read_line, {4096, 8})
+ *                    .map("parse", parse_record, 4)
+ *                    .filter("valid", [](const Record &r) { return r.valid; })
+ *                    .build_map([](const Record &r) { return r.id; });
+ * @endcode
+ */
+template <typename T> class pipeline {
+  public:
+    using value_type = T;
+
+    /**
+     * @brief Start a pipeline from a custom source, run on its own thread.
+     *
+     * @param source Callable taking (std::vector<T> &batch, std::size_t batch_size) that appends up to batch_size
+     * elements to batch and returns false once the input is exhausted.
+     */
+    template <typename Source> static pipeline<T> from_source(Source source, pipeline_options options = {}) {
+        if (options.batch_size == 0 || options.buffer_batches == 0)
+            throw std::invalid_argument("pipeline batch_size and buffer_batches must be positive");
+        auto state = std::make_shared<detail::pipeline_state>(options);
+        auto output = std::make_shared<detail::pipeline_channel<T>>();
+        auto &counters = state->add_counters("source", 1);
+        auto body = [state = state.get(), output, &counters, source = std::move(source)]() mutable {
+            using clock = std::chrono::steady_clock;
+            const std::size_t batch_size = state->options.batch_size;
+            while (!state->has_failed()) {
+                const auto started = clock::now();
+                std::vector<T> batch;
+                batch.reserve(batch_size);
+                const bool more = source(batch, batch_size);
+                const auto produced = clock::now();
+                counters.add_time(counters.busy_ns, started, produced);
+                if (!batch.empty()) {
+                    counters.batches.fetch_add(1, std::memory_order_relaxed);
+                    counters.items_out.fetch_add(batch.size(), std::memory_order_relaxed);
+                    if (!output->push(std::move(batch)))
+                        return;
+                    counters.add_time(counters.output_wait_ns, produced, clock::now());
+                }
+                if (!more)
+                    return;
+            }
+        };
+        std::vector<std::function<void()>> bodies;
+        bodies.push_back(detail::to_pipeline_function(std::move(body)));
+        state->stages.push_back({std::move(bodies), [output] { output->close(); }});
+        return pipeline<T>(std::move(state), std::move(output), 1);
+    }
+
+    /**
+     * @brief Add a stage that applies func to every element.
+     */
+    template <typename Func> auto map(std::string name, Func func, std::size_t threads = 1) {
+        using U = std::decay_t<std::invoke_result_t<Func &, T &&>>;
+        return add_stage<U>(std::move(name), threads, [func = std::move(func)](std::vector<T> &&batch) mutable {
+            std::vector<U> result;
+            result.reserve(batch.size());
+            for (auto &item : batch)
+                result.push_back(func(std::move(item)));
+            return result;
+        });
+    }
+
+    /**
+     * @brief Add a stage that keeps only the elements for which pred returns true.
+     */
+    template <typename Pred> pipeline<T> filter(std::string name, Pred pred, std::size_t threads = 1) {
+        return add_stage<T>(std::move(name), threads, [pred = std::move(pred)](std::vector<T> &&batch) mutable {
+            batch.erase(std::remove_if(batch.begin(), batch.end(), [&](const T &item) { return !pred(item); }),
+                        batch.end());
+            return std::move(batch);
+        });
+    }
+
+    /**
+     * @brief Add a stage that turns a whole batch into a batch of another type, e.g. to parse several records out of
+     * one chunk of input or to drop and expand elements at once. An empty result batch is not passed on.
+     */
+    template <typename Func> auto map_batch(std::string name, Func func, std::size_t threads = 1) {
+        using U = typename std::decay_t<std::invoke_result_t<Func &, std::vector<T> &&>>::value_type;
+        return add_stage<U>(std::move(name), threads, std::move(func));
+    }
+
+    /**
+     * @brief Run the pipeline and call func with every element on the calling thread.
+     */
+    template <typename Func> void for_each(Func func) {
+        drain("for_each", [&](std::vector<T> &&batch) {
+            for (auto &item : batch)
+                func(std::move(item));
+        });
+    }
+
+    /**
+     * @brief Run the pipeline and gather every element into a vector.
+     */
+    std::vector<T> collect() {
+        std::vector<T> result;
+        drain("collect", [&](std::vector<T> &&batch) {
+            if (result.empty())
+                result = std::move(batch);
+            else
+                result.insert(result.end(), std::make_move_iterator(batch.begin()),
+                              std::make_move_iterator(batch.end()));
+        });
+        return result;
+    }
+
+    /**
+     * @brief Run the pipeline and build an unordered_map keyed by key_func, like build_map_from_vector.
+     *
+     * @note The first element producing a key wins; which one is first depends on thread scheduling if any stage is
+     * multithreaded.
+     */
+    template <typename KeyFunc> auto build_map(KeyFunc key_func) {
+        using Key = std::decay_t<std::invoke_result_t<KeyFunc &, const T &>>;
+        std::unordered_map<Key, T> map;
+        drain("build_map", [&](std::vector<T> &&batch) {
+            for (auto &item : batch) {
+                Key key = key_func(std::as_const(item));
+                map.try_emplace(std::move(key), std::move(item));
+            }
+        });
+        return map;
+    }
+
+    /**
+     * @brief Run the pipeline and group the elements by key_func.
+     */
+    template <typename KeyFunc> auto group_by(KeyFunc key_func) {
+        using Key = std::decay_t<std::invoke_result_t<KeyFunc &, const T &>>;
+        std::unordered_map<Key, std::vector<T>> groups;
+        drain("group_by", [&](std::vector<T> &&batch) {
+            for (auto &item : batch)
+                groups[key_func(std::as_const(item))].push_back(std::move(item));
+        });
+        return groups;
+    }
+
+    /**
+     * @brief Metrics of every stage so far, source first and sink last.
+     */
+    std::vector<pipeline_stage_metrics> metrics() const {
+        std::vector<pipeline_stage_metrics> result;
+        result.reserve(state->counters.size());
+        for (const auto &counters : state->counters)
+            result.push_back(counters.snapshot());
+        return result;
+    }
+
+  private:
+    template <typename U> friend class pipeline;
+
+    pipeline(std::shared_ptr<detail::pipeline_state> state, std::shared_ptr<detail::pipeline_channel<T>> output,
+             std::size_t producers)
+        : state(std::move(state)), output(std::move(output)), producers(producers) {}
+
+    void claim_output(std::size_t consumers) {
+        if (!output)
+            throw std::logic_error("pipeline stage already has a consumer");
+        output->open(producers, consumers, state->options.buffer_batches);
+    }
+
+    /**
+     * @brief Append a stage whose threads pop a batch, apply their own copy of batch_func and push the result
+     * downstream.
+     */
+    template <typename U, typename BatchFunc>
+    pipeline<U> add_stage(std::string name, std::size_t threads, BatchFunc batch_func) {
+        threads = std::max<std::size_t>(threads, 1);
+        if (!std::is_copy_constructible_v<BatchFunc> && threads > 1)
+            throw std::invalid_argument("a pipeline stage with several threads needs a copyable function");
+        claim_output(threads);
+        auto input = std::move(output);
+        auto next = std::make_shared<detail::pipeline_channel<U>>();
+        auto &counters = state->add_counters(std::move(name), threads);
+        auto make_body = [&](BatchFunc func) {
+            auto body = [state = state.get(), input, next, &counters, batch_func = std::move(func)]() mutable {
+                using clock = std::chrono::steady_clock;
+                while (true) {
+                    const auto waiting = clock::now();
+                    auto batch = input->pop();
+                    const auto started = clock::now();
+                    counters.add_time(counters.input_wait_ns, waiting, started);
+                    if (!batch || state->has_failed())
+                        return;
+                    counters.items_in.fetch_add(batch->size(), std::memory_order_relaxed);
+                    std::vector<U> result = batch_func(std::move(*batch));
+                    const auto finished = clock::now();
+                    counters.add_time(counters.busy_ns, started, finished);
+                    counters.batches.fetch_add(1, std::memory_order_relaxed);
+                    counters.items_out.fetch_add(result.size(), std::memory_order_relaxed);
+                    if (result.empty())
+                        continue;
+                    if (!next->push(std::move(result)))
+                        return;
+                    counters.add_time(counters.output_wait_ns, finished, clock::now());
+                }
+            };
+            return detail::to_pipeline_function(std::move(body));
+        };
+        std::vector<std::function<void()>> bodies;
+        bodies.reserve(threads);
+        if constexpr (std::is_copy_constructible_v<BatchFunc>)
+            for (std::size_t t = 1; t < threads; ++t)
+                bodies.push_back(make_body(batch_func));
+        bodies.push_back(make_body(std::move(batch_func)));
+        state->stages.push_back({std::move(bodies), [next] { next->close(); }});
+        return pipeline<U>(state, std::move(next), threads);
+    }
+
+    template <typename Sink> void drain(std::string name, Sink sink) {
+        claim_output(1);
+        auto input = std::move(output);
+        auto &counters = state->add_counters(std::move(name), 1);
+        state->run([&] {
+            using clock = std::chrono::steady_clock;
+            while (true) {
+                const auto waiting = clock::now();
+                auto batch = input->pop();
+                const auto started = clock::now();
+                counters.add_time(counters.input_wait_ns, waiting, started);
+                if (!batch || state->has_failed())
+                    return;
+                counters.items_in.fetch_add(batch->size(), std::memory_order_relaxed);
+                counters.batches.fetch_add(1, std::memory_order_relaxed);
+                sink(std::move(*batch));
+                counters.add_time(counters.busy_ns, started, clock::now());
+            }
+        });
+    }
+
+    std::shared_ptr<detail::pipeline_state> state;
+    std::shared_ptr<detail::pipeline_channel<T>> output;
+    std::size_t producers;
+};
+
+/**
+ * @brief Start a pipeline whose source hands out the elements of items in batches.
+ */
+template <typename T> pipeline<T> make_pipeline(std::vector<T> items, pipeline_options options = {}) {
+    return pipeline<T>::from_source(
+        [items = std::move(items), next = std::size_t{0}](std::vector<T> &batch, std::size_t batch_size) mutable {
+            const std::size_t end = std::min(items.size(), next + batch_size);
+            batch.insert(batch.end(), std::make_move_iterator(items.begin() + next),
+                         std::make_move_iterator(items.begin() + end));
+            next = end;
+            return next < items.size();
+        },
+        options);
+}
+
+/**
+ * @brief Start a pipeline whose source calls generator, on its own thread, until it returns std::nullopt.
+ *
+ * @tparam T Type of the generated elements.
+ * @tparam Generator Callable returning std::optional<T>.
+ */
+template <typename T, typename Generator>
+pipeline<T> make_pipeline_from_generator(Generator generator, pipeline_options options = {}) {
+    return pipeline<T>::from_source(
+        [generator = std::move(generator)](std::vector<T> &batch, std::size_t batch_size) mutable {
+            while (batch.size() < batch_size) {
+                std::optional<T> item = generator();
+                if (!item)
+                    return false;
+                batch.push_back(std::move(*item));
+            }
+            return true;
+        },
+        options);
+}
+
+// endfold
+
+// startfold parallel unordered maps
+
+/**
+ * @brief How the parallel_* functions split their work.
+ *
+ * Work is cut into a fixed number of chunks and results are always merged in chunk order, so the output depends on
+ * chunks but never on threads or on scheduling: the same input gives bitwise identical results whether it runs on
+ * 1 thread or 64.
+ */
+struct parallel_options {
+    std::size_t threads = 0;               // 0 means std::thread::hardware_concurrency()
+    std::size_t chunks = 64;               // fixed, so chunk boundaries do not move with the thread count
+    std::size_t min_parallel_size = 16384; // smaller inputs run every chunk on the calling thread
+};
+
+/**
+ * @brief Run func(chunk_index) for every chunk in [0, chunk_count) on up to threads threads, the calling thread
+ * included.
+ *
+ * Threads claim chunks from a shared counter, so uneven chunks balance out. Which thread runs which chunk is not
+ * deterministic; callers that need deterministic results write each chunk's output to its own slot and merge the
+ * slots in chunk order afterwards. If func throws, remaining chunks are skipped and the first exception is rethrown
+ * once every thread has stopped.
+ *
+ * @param threads Maximum number of threads, 0 means std::thread::hardware_concurrency().
+ */
+template <typename Func> void parallel_for_chunks(std::size_t chunk_count, Func func, std::size_t threads = 0) {
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min(threads, chunk_count);
+    if (threads <= 1) {
+        for (std::size_t chunk = 0; chunk < chunk_count; ++chunk)
+            func(chunk);
+        return;
+    }
+
+    std::atomic<std::size_t> next_chunk{0};
+    std::atomic<bool> failed{false};
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    auto worker = [&] {
+        while (!failed.load(std::memory_order_relaxed)) {
+            const std::size_t chunk = next_chunk.fetch_add(1, std::memory_order_relaxed);
+            if (chunk >= chunk_count)
+                return;
+            try {
+                func(chunk);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error)
+                    error = std::current_exception();
+                failed.store(true, std::memory_order_relaxed);
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    pool.reserve(threads - 1);
+    try {
+        for (std::size_t t = 1; t < threads; ++t)
+            pool.emplace_back(worker);
+    } catch (const std::system_error &) {
+        // could not start more threads: the ones we have, and the calling thread, still finish every chunk
+    }
+    worker();
+    for (auto &thread : pool)
+        thread.join();
+    if (error)
+        std::rethrow_exception(error);
+}
+
+namespace detail {
+
+template <typename K, typename V>
+std::size_t bucket_chunk_count(const std::unordered_map<K, V> &map, const parallel_options &options) {
+    return std::max<std::size_t>(1, std::min(options.chunks, map.bucket_count()));
+}
+
+template <typename K, typename V>
+std::size_t parallel_thread_count(const std::unordered_map<K, V> &map, const parallel_options &options) {
+    return map.size() < options.min_parallel_size ? 1 : options.threads;
+}
+
+/**
+ * @brief Call func(key, value) for every entry in the buckets belonging to chunk.
+ *
+ * Chunk c covers buckets [c * B / chunk_count, (c + 1) * B / chunk_count), so the split only depends on the map.
+ */
+template <typename Map, typename Func>
+void for_each_entry_in_bucket_chunk(Map &map, std::size_t chunk, std::size_t chunk_count, Func &func) {
+    const std::size_t buckets = map.bucket_count();
+    const std::size_t first = chunk * buckets / chunk_count;
+    const std::size_t last = (chunk + 1) * buckets / chunk_count;
+    for (std::size_t bucket = first; bucket < last; ++bucket)
+        for (auto it = map.begin(bucket); it != map.end(bucket); ++it)
+            func(it->first, it->second);
+}
+
+template <typename K, typename V, typename Extract>
+auto gather_from_bucket_chunks(const std::unordered_map<K, V> &map, Extract extract, const parallel_options &options) {
+    using Element = std::decay_t<decltype(extract(std::declval<const K &>(), std::declval<const V &>()))>;
+    const std::size_t chunk_count = bucket_chunk_count(map, options);
+    std::vector<std::vector<Element>> per_chunk(chunk_count);
+    parallel_for_chunks(
+        chunk_count,
+        [&](std::size_t chunk) {
+            auto gather = [&](const K &key, const V &value) { per_chunk[chunk].push_back(extract(key, value)); };
+            for_each_entry_in_bucket_chunk(map, chunk, chunk_count, gather);
+        },
+        parallel_thread_count(map, options));
+    return per_chunk;
+}
+
+} // namespace detail
+
+/**
+ * @brief Parallel for_each_pair_in_map: apply func(key, value) to every entry, several entries at a time.
+ *
+ * func runs concurrently on distinct entries, so it may modify the value it is given but must synchronize anything
+ * else it touches. Each entry is always processed as part of the same chunk, whatever the thread count.
+ */
+template <typename Key, typename Value, typename Func>
+void parallel_for_each_pair_in_map(std::unordered_map<Key, Value> &map, Func func, parallel_options options = {}) {
+    const std::size_t chunk_count = detail::bucket_chunk_count(map, options);
+    parallel_for_chunks(
+        chunk_count,
+        [&](std::size_t chunk) {
+            auto apply = [&](const Key &key, Value &value) { func(key, value); };
+            detail::for_each_entry_in_bucket_chunk(map, chunk, chunk_count, apply);
+        },
+        detail::parallel_thread_count(map, options));
+}
+
+/**
+ * @brief Parallel map_values: func runs concurrently, the result map is then filled in a fixed order.
+ *
+ * Because entries are inserted in chunk order, the result (including its own iteration order) is identical for any
+ * thread count.
+ */
+template <typename K, typename V, typename Func>
+auto parallel_map_values(const std::unordered_map<K, V> &input_map, Func func, parallel_options options = {}) {
+    using ValueType = decltype(func(std::declval<V>()));
+    auto per_chunk = detail::gather_from_bucket_chunks(
+        input_map, [&](const K &key, const V &value) { return std::pair<K, ValueType>(key, func(value)); }, options);
+
+    std::unordered_map<K, ValueType> result;
+    result.reserve(input_map.size());
+    for (auto &chunk : per_chunk)
+        for (auto &[key, value] : chunk)
+            result.emplace(std::move(key), std::move(value));
+    return result;
+}
+
+/**
+ * @brief Parallel values(): the values in bucket order, identical for any thread count.
+ *
+ * @note This order is deterministic but is not the iteration order values() returns.
+ */
+template <typename Key, typename Value>
+std::vector<Value> parallel_values(const std::unordered_map<Key, Value> &map, parallel_options options = {}) {
+    auto per_chunk = detail::gather_from_bucket_chunks(
+        map, [](const Key &, const Value &value) { return value; }, options);
+    std::vector<Value> result;
+    result.reserve(map.size());
+    for (auto &chunk : per_chunk)
+        result.insert(result.end(), std::make_move_iterator(chunk.begin()), std::make_move_iterator(chunk.end()));
+    return result;
+}
+
+/**
+ * @brief Parallel keys(): the keys in bucket order, identical for any thread count.
+ */
+template <typename Key, typename Value>
+std::vector<Key> parallel_keys(const std::unordered_map<Key, Value> &map, parallel_options options = {}) {
+    auto per_chunk = detail::gather_from_bucket_chunks(
+        map, [](const Key &key, const Value &) { return key; }, options);
+    std::vector<Key> result;
+    result.reserve(map.size());
+    for (auto &chunk : per_chunk)
+        result.insert(result.end(), std::make_move_iterator(chunk.begin()), std::make_move_iterator(chunk.end()));
+    return result;
+}
+
+// endfold
+
+// startfold parallel sorting
+
+namespace detail {
+
+/**
+ * @brief How many of the first diagonal elements of a stable merge of [a, a + n) and [b, b + m) come from a.
+ *
+ * Ties go to a, matching std::merge, so merging the pieces on either side of every diagonal independently gives the
+ * same output as one sequential merge.
+ */
+template <typename It, typename Compare>
+std::size_t merge_path_split(It a, std::size_t n, It b, std::size_t m, std::size_t diagonal, Compare &comp) {
+    std::size_t lo = diagonal > m ? diagonal - m : 0;
+    std::size_t hi = std::min(diagonal, n);
+    while (lo < hi) {
+        const std::size_t i = lo + (hi - lo) / 2;
+        if (!comp(b[diagonal - i - 1], a[i]))
+            lo = i + 1; // a[i] <= b[j - 1]: a[i] belongs before the diagonal
+        else
+            hi = i;
+    }
+    return lo;
+}
+
+/**
+ * @brief std::merge that moves instead of copying, while still handing comp lvalues.
+ */
+template <typename It, typename OutIt, typename Compare>
+void move_merge(It first1, It last1, It first2, It last2, OutIt out, Compare &comp) {
+    while (first1 != last1 && first2 != last2) {
+        if (comp(*first2, *first1))
+            *out++ = std::move(*first2++);
+        else
+            *out++ = std::move(*first1++);
+    }
+    std::move(first2, last2, std::move(first1, last1, out));
+}
+
+/**
+ * @brief Sort each of options.chunks runs with sort_run, then merge the runs pairwise, splitting every merge into
+ * independent pieces along merge paths so that all threads stay busy until the last round.
+ *
+ * The result only depends on options.chunks, never on the thread count.
+ */
+template <typename T, typename Compare, typename SortRun>
+void parallel_merge_sort(std::vector<T> &vec, Compare comp, parallel_options options, SortRun sort_run) {
+    const std::size_t n = vec.size();
+    const std::size_t runs = std::min(std::max<std::size_t>(options.chunks, 1), std::max<std::size_t>(n, 1));
+    if (runs <= 1 || n < options.min_parallel_size) {
+        sort_run(vec.begin(), vec.end());
+        return;
+    }
+
+    std::vector<std::size_t> bounds(runs + 1);
+    for (std::size_t r = 0; r <= runs; ++r)
+        bounds[r] = r * n / runs;
+    parallel_for_chunks(
+        runs, [&](std::size_t r) { sort_run(vec.begin() + bounds[r], vec.begin() + bounds[r + 1]); }, options.threads);
+
+    std::vector<T> buffer(n);
+    std::vector<T> *source = &vec;
+    std::vector<T> *target = &buffer;
+    for (std::size_t width = 1; width < runs; width *= 2) {
+        const std::size_t pairs = (runs + 2 * width - 1) / (2 * width);
+        const std::size_t pieces_per_pair = std::max<std::size_t>(1, runs / pairs);
+        parallel_for_chunks(
+            pairs * pieces_per_pair,
+            [&](std::size_t task) {
+                const std::size_t pair = task / pieces_per_pair;
+                const std::size_t piece = task % pieces_per_pair;
+                const std::size_t first = bounds[pair * 2 * width];
+                const std::size_t middle = bounds[std::min(runs, pair * 2 * width + width)];
+                const std::size_t last = bounds[std::min(runs, pair * 2 * width + 2 * width)];
+                const std::size_t n1 = middle - first;
+                const std::size_t n2 = last - middle;
+                const auto a = source->begin() + first;
+                const auto b = source->begin() + middle;
+                const std::size_t d0 = piece * (n1 + n2) / pieces_per_pair;
+                const std::size_t d1 = (piece + 1) * (n1 + n2) / pieces_per_pair;
+                const std::size_t i0 = merge_path_split(a, n1, b, n2, d0, comp);
+                const std::size_t i1 = merge_path_split(a, n1, b, n2, d1, comp);
+                move_merge(a + i0, a + i1, b + (d0 - i0), b + (d1 - i1), target->begin() + first + d0, comp);
+            },
+            options.threads);
+        std::swap(source, target);
+    }
+    if (source != &vec)
+        vec.swap(buffer);
+}
+
+/**
+ * @brief Map an integral or enum key to an unsigned integer with the same ordering, for radix sorting.
+ */
+template <typename Key> auto radix_key(Key key) {
+    if constexpr (std::is_enum_v<Key>) {
+        return radix_key(static_cast<std::underlying_type_t<Key>>(key));
+    } else if constexpr (std::is_same_v<Key, bool>) {
+        return static_cast<std::uint8_t>(key);
+    } else {
+        static_assert(std::is_integral_v<Key>, "radix sorting needs integral or enum keys");
+        using U = std::make_unsigned_t<Key>;
+        U bits = static_cast<U>(key);
+        if constexpr (std::is_signed_v<Key>)
+            bits ^= U(1) << (sizeof(U) * 8 - 1); // flip the sign bit so negative keys sort first
+        return bits;
+    }
+}
+
+/**
+ * @brief Stable LSD radix sort of (key, index) pairs, one byte per pass. Passes where every key has the same byte
+ * are skipped, so narrow key ranges cost fewer passes.
+ */
+template <typename U> void radix_sort_pairs(std::vector<std::pair<U, std::size_t>> &items) {
+    constexpr unsigned passes = sizeof(U);
+    std::vector<std::array<std::size_t, 256>> counts(passes); // every pass's histogram, from one read of the keys
+    for (const auto &item : items)
+        for (unsigned pass = 0; pass < passes; ++pass)
+            ++counts[pass][(item.first >> (pass * 8)) & 0xff];
+
+    std::vector<std::pair<U, std::size_t>> scratch(items.size());
+    for (unsigned pass = 0; pass < passes; ++pass) {
+        auto &offsets = counts[pass];
+        if (std::find(offsets.begin(), offsets.end(), items.size()) != offsets.end())
+            continue;
+        std::size_t total = 0;
+        for (auto &offset : offsets)
+            total += std::exchange(offset, total);
+        const unsigned shift = pass * 8;
+        for (const auto &item : items)
+            scratch[offsets[(item.first >> shift) & 0xff]++] = item;
+        items.swap(scratch);
+    }
+}
+
+template <typename T, typename KeyFunc>
+std::vector<std::pair<decltype(radix_key(std::declval<KeyFunc &>()(std::declval<const T &>()))), std::size_t>>
+radix_sorted_keys(const std::vector<T> &vec, KeyFunc &key_func) {
+    std::vector<std::pair<decltype(radix_key(key_func(vec.front()))), std::size_t>> items;
+    items.reserve(vec.size());
+    for (std::size_t i = 0; i < vec.size(); ++i)
+        items.emplace_back(radix_key(key_func(vec[i])), i);
+    radix_sort_pairs(items);
+    return items;
+}
+
+} // namespace detail
+
+/**
+ * @brief Sort a vector using several threads: chunks are sorted concurrently and then merged in parallel.
+ *
+ * The result is deterministic (it does not depend on the thread count) but, as with std::sort, the relative order of
+ * equal elements is unspecified. Vectors smaller than options.min_parallel_size are sorted with std::sort directly.
+ *
+ * @tparam T Type of the elements, must be default constructible and move assignable.
+ * @param vec Vector to sort in place.
+ * @param comp Strict weak ordering, called concurrently.
+ */
+template <typename T, typename Compare = std::less<>>
+void parallel_sort(std::vector<T> &vec, Compare comp = {}, parallel_options options = {}) {
+    detail::parallel_merge_sort(vec, comp, options, [&](auto first, auto last) { std::sort(first, last, comp); });
+}
+
+/**
+ * @brief Like parallel_sort, but equal elements keep their original relative order.
+ */
+template <typename T, typename Compare = std::less<>>
+void parallel_stable_sort(std::vector<T> &vec, Compare comp = {}, parallel_options options = {}) {
+    detail::parallel_merge_sort(vec, comp, options,
+                                [&](auto first, auto last) { std::stable_sort(first, last, comp); });
+}
+
+/**
+ * @brief Stable sort by an integer (or enum) key with an LSD radix sort: O(n) per key byte instead of O(n log n)
+ * comparisons.
+ *
+ * Each key is computed once. Byte positions in which all keys agree are skipped.
+ *
+ * @tparam KeyFunc Callable taking a const T& and returning an integral or enum key.
+ */
+template <typename T, typename KeyFunc> void sort_by_key(std::vector<T> &vec, KeyFunc key_func) {
+    if (vec.size() < 2)
+        return;
+    const auto order = detail::radix_sorted_keys(vec, key_func);
+    std::vector<T> sorted;
+    sorted.reserve(vec.size());
+    for (const auto &item : order)
+        sorted.push_back(std::move(vec[item.second]));
+    vec.swap(sorted);
+}
+
+/**
+ * @brief The permutation that stably sorts vec: vec[result[0]], vec[result[1]], ... is in order.
+ *
+ * Runs in parallel like parallel_stable_sort; vec itself is not modified.
+ */
+template <typename T, typename Compare = std::less<>>
+std::vector<std::size_t> argsort(const std::vector<T> &vec, Compare comp = {}, parallel_options options = {}) {
+    std::vector<std::size_t> indices(vec.size());
+    for (std::size_t i = 0; i < indices.size(); ++i)
+        indices[i] = i;
+    parallel_stable_sort(indices, [&](std::size_t a, std::size_t b) { return comp(vec[a], vec[b]); }, options);
+    return indices;
+}
+
+/**
+ * @brief The permutation that stably sorts vec by an integer (or enum) key, computed with a radix sort.
+ */
+template <typename T, typename KeyFunc>
+std::vector<std::size_t> argsort_by_key(const std::vector<T> &vec, KeyFunc key_func) {
+    std::vector<std::size_t> indices;
+    indices.reserve(vec.size());
+    if (vec.empty())
+        return indices;
+    for (const auto &item : detail::radix_sorted_keys(vec, key_func))
+        indices.push_back(item.second);
+    return indices;
+}
+
+// endfold
+
+// startfold scans
+
+namespace detail {
+
+template <typename T, typename Op>
+inline constexpr bool is_simd_plus_scan_v =
+    (std::is_same_v<Op, std::plus<>> || std::is_same_v<Op, std::plus<T>>) &&
+    (std::is_same_v<T, std::int32_t> || std::is_same_v<T, std::uint32_t> || std::is_same_v<T, float>);
+
+#if defined(__SSE2__)
+/**
+ * @brief Running sum of four 32 bit lanes in registers: two shifted adds give the in-vector prefix, then the carry from
+ * the previous vector is added and the last lane broadcast as the next carry. Unsigned, so overflow wraps like the
+ * vector lanes do instead of being undefined.
+ */
+inline void simd_plus_scan(const std::uint32_t *in, std::uint32_t *out, std::size_t n, std::uint32_t carry) {
+    __m128i running = _mm_set1_epi32(static_cast<int>(carry));
+    std::size_t i = 0;
+    for (const std::size_t vector_end = n - n % 4; i < vector_end; i += 4) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+        x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+        x = _mm_add_epi32(x, _mm_slli_si128(x, 8));
+        x = _mm_add_epi32(x, running);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), x);
+        running = _mm_shuffle_epi32(x, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+    carry = static_cast<std::uint32_t>(_mm_cvtsi128_si32(running));
+    for (; i < n; ++i)
+        out[i] = carry += in[i];
+}
+
+inline void simd_plus_scan(const std::int32_t *in, std::int32_t *out, std::size_t n, std::int32_t carry) {
+    // two's complement addition is the same operation for signed and unsigned lanes
+    simd_plus_scan(reinterpret_cast<const std::uint32_t *>(in), reinterpret_cast<std::uint32_t *>(out), n,
+                   static_cast<std::uint32_t>(carry));
+}
+
+inline void simd_plus_scan(const float *in, float *out, std::size_t n, float carry) {
+    __m128 running = _mm_set1_ps(carry);
+    std::size_t i = 0;
+    for (const std::size_t vector_end = n - n % 4; i < vector_end; i += 4) {
+        __m128 x = _mm_loadu_ps(in + i);
+        x = _mm_add_ps(x, _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(x), 4)));
+        x = _mm_add_ps(x, _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(x), 8)));
+        x = _mm_add_ps(x, running);
+        _mm_storeu_ps(out + i, x);
+        running = _mm_shuffle_ps(x, x, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+    carry = _mm_cvtss_f32(running);
+    for (; i < n; ++i)
+        out[i] = carry = carry + in[i];
+}
+#endif
+
+/**
+ * @brief out[i] = op(carry, in[0], ..., in[i]) on one thread; carry may be null. in and out may be the same array.
+ */
+template <typename T, typename Op> void serial_scan(const T *in, T *out, std::size_t n, Op &op, const T *carry) {
+    if (n == 0)
+        return;
+#if defined(__SSE2__)
+    if constexpr (is_simd_plus_scan_v<T, Op>) {
+        simd_plus_scan(in, out, n, carry ? *carry : T(0));
+        return;
+    }
+#endif
+    T running = carry ? op(*carry, in[0]) : in[0];
+    out[0] = running;
+    for (std::size_t i = 1; i < n; ++i) {
+        running = op(std::move(running), in[i]);
+        out[i] = running;
+    }
+}
+
+/**
+ * @brief Two pass parallel scan: every chunk is scanned on its own, the chunk totals are combined in order, then each
+ * chunk except the first is offset by the combined total of the chunks before it.
+ *
+ * Chunk boundaries only depend on options.chunks, so the result is the same for every thread count.
+ */
+template <typename T, typename Op>
+void parallel_scan(const T *in, T *out, std::size_t n, Op op, const T *init, const parallel_options &options) {
+    if (n == 0)
+        return;
+    // chunking regroups the operations, which any type holding floating point values can observe; only integers
+    // take the single pass when there is a single thread anyway
+    const bool single_thread =
+        options.threads == 1 || (options.threads == 0 && std::thread::hardware_concurrency() <= 1);
+    if (n < options.min_parallel_size || options.chunks <= 1 || (single_thread && std::is_integral_v<T>)) {
+        serial_scan(in, out, n, op, init);
+        return;
+    }
+    const std::size_t chunk_count = std::min(std::max<std::size_t>(options.chunks, 1), n);
+    const auto bound = [&](std::size_t c) { return c * n / chunk_count; };
+
+    parallel_for_chunks(
+        chunk_count,
+        [&](std::size_t c) {
+            serial_scan(in + bound(c), out + bound(c), bound(c + 1) - bound(c), op, c == 0 ? init : nullptr);
+        },
+        options.threads);
+
+    std::vector<std::optional<T>> carries(chunk_count);
+    for (std::size_t c = 1; c < chunk_count; ++c) {
+        const T &previous_last = out[bound(c) - 1];
+        carries[c] = c == 1 ? previous_last : op(*carries[c - 1], previous_last);
+    }
+
+    parallel_for_chunks(
+        chunk_count - 1,
+        [&](std::size_t chunk) {
+            const std::size_t c = chunk + 1;
+            const T carry = *carries[c];
+            for (std::size_t i = bound(c); i < bound(c + 1); ++i)
+                out[i] = op(carry, out[i]);
+        },
+        options.threads);
+}
+
+} // namespace detail
+
+/**
+ * @brief Inclusive scan: result[i] = vec[0] op vec[1] op ... op vec[i].
+ *
+ * Runs as a two pass parallel scan for large inputs, and with SSE2 kernels for std::plus over int32, uint32 and float.
+ * op must be associative, it is not required to be commutative.
+ *
+ * @note For float the additions are grouped differently from a strict left to right loop, so the last bits can differ
+ * from std::inclusive_scan; they do not differ between thread counts.
+ *
+ * @tparam Op Associative binary operation, std::plus<> by default.
+ */
+template <typename T, typename Op = std::plus<>>
+std::vector<T> inclusive_scan_vector(const std::vector<T> &vec, Op op = {}, parallel_options options = {}) {
+    std::vector<T> result(vec.size());
+    detail::parallel_scan(vec.data(), result.data(), vec.size(), op, static_cast<const T *>(nullptr), options);
+    return result;
+}
+
+/**
+ * @brief inclusive_scan_vector, overwriting vec.
+ */
+template <typename T, typename Op = std::plus<>>
+void inclusive_scan_in_place(std::vector<T> &vec, Op op = {}, parallel_options options = {}) {
+    detail::parallel_scan(vec.data(), vec.data(), vec.size(), op, static_cast<const T *>(nullptr), options);
+}
+
+/**
+ * @brief Exclusive scan: result[0] = init, result[i] = init op vec[0] op ... op vec[i - 1].
+ *
+ * The result has vec.size() + 1 elements, the last one being the total, which is the offsets array CSR layouts and
+ * stream compaction need: scanning the sizes {3, 1, 2} gives {0, 3, 4, 6}.
+ */
+template <typename T, typename Op = std::plus<>>
+std::vector<T> exclusive_scan_vector(const std::vector<T> &vec, T init = T(), Op op = {},
+                                     parallel_options options = {}) {
+    std::vector<T> result(vec.size() + 1);
+    result[0] = init;
+    detail::parallel_scan(vec.data(), result.data() + 1, vec.size(), op, &init, options);
+    return result;
+}
+
+/**
+ * @brief Inclusive scan that restarts at every element whose segment_heads flag is set.
+ *
+ * result[i] combines the elements from the closest head at or before i up to i. Scanning {1, 2, 3, 4, 5} with heads
+ * {1, 0, 1, 0, 0} gives {1, 3, 3, 7, 12}. Runs as a two pass parallel scan for large inputs.
+ *
+ * @param segment_heads Container of flags, one per element of vec; the first element always starts a segment.
+ *
+ * @throws std::invalid_argument if segment_heads and vec differ in size.
+ */
+template <typename T, typename Flags, typename Op = std::plus<>>
+std::vector<T> segmented_inclusive_scan(const std::vector<T> &vec, const Flags &segment_heads, Op op = {},
+                                        parallel_options options = {}) {
+    const std::size_t n = vec.size();
+    if (segment_heads.size() != n)
+        throw std::invalid_argument("segmented_inclusive_scan needs one segment flag per element");
+    std::vector<T> result(n);
+    if (n == 0)
+        return result;
+
+    const std::size_t chunk_count =
+        n < options.min_parallel_size ? 1 : std::min(std::max<std::size_t>(options.chunks, 1), n);
+    const auto bound = [&](std::size_t c) { return c * n / chunk_count; };
+    // chunk c's elements before its first head still need the carry from earlier chunks
+    std::vector<std::size_t> first_head(chunk_count);
+
+    parallel_for_chunks(
+        chunk_count,
+        [&](std::size_t c) {
+            const std::size_t last = bound(c + 1);
+            std::size_t i = bound(c);
+            first_head[c] = last;
+            for (bool open = false; i < last; ++i) {
+                if (segment_heads[i] || !open) {
+                    result[i] = vec[i];
+                    if (segment_heads[i] && first_head[c] == last)
+                        first_head[c] = i;
+                    open = true;
+                } else {
+                    result[i] = op(result[i - 1], vec[i]);
+                }
+            }
+        },
+        options.threads);
+
+    std::vector<std::optional<T>> carries(chunk_count);
+    for (std::size_t c = 1; c < chunk_count; ++c) {
+        const T &previous_last = result[bound(c) - 1];
+        const bool previous_restarted = first_head[c - 1] != bound(c);
+        carries[c] = previous_restarted || !carries[c - 1] ? previous_last : op(*carries[c - 1], previous_last);
+    }
+
+    parallel_for_chunks(
+        chunk_count,
+        [&](std::size_t c) {
+            if (!carries[c] || segment_heads[bound(c)])
+                return;
+            const T carry = *carries[c];
+            for (std::size_t i = bound(c); i < first_head[c]; ++i)
+                result[i] = op(carry, result[i]);
+        },
+        options.threads);
+    return result;
+}
+
+// endfold
+
+// startfold counting
+
+namespace detail {
+
+inline std::size_t resolved_thread_count(std::size_t threads) {
+    return threads != 0 ? threads : std::max(1u, std::thread::hardware_concurrency());
+}
+
+/**
+ * @brief Inverse of radix_key.
+ */
+template <typename Key, typename U> Key from_radix_key(U bits) {
+    if constexpr (std::is_enum_v<Key>) {
+        return static_cast<Key>(from_radix_key<std::underlying_type_t<Key>>(bits));
+    } else if constexpr (std::is_same_v<Key, bool>) {
+        return bits != 0;
+    } else {
+        if constexpr (std::is_signed_v<Key>)
+            bits ^= U(1) << (sizeof(U) * 8 - 1);
+        return static_cast<Key>(bits);
+    }
+}
+
+/**
+ * @brief Add the number of times each bin in [0, range) occurs among index_of(first) ... index_of(last - 1) to counts.
+ *
+ * Consecutive elements are counted into four private tables in turn, so a run of equal keys increments four different
+ * counters instead of every increment waiting on the store of the previous one to the same counter. The 32 bit tables
+ * are folded into counts often enough that they cannot overflow.
+ */
+template <typename IndexFunc>
+void count_into_tables(std::size_t first, std::size_t last, std::size_t range, IndexFunc &index_of,
+                       std::vector<std::size_t> &counts) {
+    constexpr std::size_t lanes = 4;
+    constexpr std::size_t flush_every = std::size_t(1) << 31;
+
+    std::vector<std::uint32_t> tables(lanes * range);
+    for (std::size_t segment = first; segment < last; segment += flush_every) {
+        const std::size_t segment_last = std::min(last, segment + std::min(flush_every, last - segment));
+        std::size_t i = segment;
+        for (; i + lanes <= segment_last; i += lanes) {
+            ++tables[index_of(i)];
+            ++tables[range + index_of(i + 1)];
+            ++tables[2 * range + index_of(i + 2)];
+            ++tables[3 * range + index_of(i + 3)];
+        }
+        for (; i < segment_last; ++i)
+            ++tables[index_of(i)];
+
+        for (std::size_t b = 0; b < range; ++b)
+            counts[b] += std::size_t(tables[b]) + tables[range + b] + tables[2 * range + b] + tables[3 * range + b];
+        std::fill(tables.begin(), tables.end(), 0);
+    }
+}
+
+/**
+ * @brief Dense counting over n elements, one private set of tables per thread, merged bin range by bin range in
+ * parallel.
+ */
+template <typename IndexFunc>
+std::vector<std::size_t> parallel_count_dense(std::size_t n, std::size_t range, IndexFunc index_of,
+                                              const parallel_options &options) {
+    const std::size_t threads = n < options.min_parallel_size ? 1 : resolved_thread_count(options.threads);
+    // counting is exact, so one part per thread (not per chunk) gives the same result with the least table memory;
+    // parts are also kept at least range elements long, so the tables never outgrow the input they count
+    const std::size_t parts = std::max<std::size_t>(1, std::min(threads, n / range));
+    std::vector<std::vector<std::size_t>> partial(parts);
+    parallel_for_chunks(
+        parts,
+        [&](std::size_t p) {
+            partial[p].assign(range, 0);
+            count_into_tables(p * n / parts, (p + 1) * n / parts, range, index_of, partial[p]);
+        },
+        threads);
+    if (parts == 1)
+        return std::move(partial[0]);
+
+    std::vector<std::size_t> counts = std::move(partial[0]);
+    const std::size_t merge_parts = range * parts < options.min_parallel_size ? 1 : std::min(threads, range);
+    parallel_for_chunks(
+        merge_parts,
+        [&](std::size_t m) {
+            for (std::size_t p = 1; p < parts; ++p)
+                for (std::size_t b = m * range / merge_parts; b < (m + 1) * range / merge_parts; ++b)
+                    counts[b] += partial[p][b];
+        },
+        threads);
+    return counts;
+}
+
+} // namespace detail
+
+/**
+ * @brief Count how many elements produce each key.
+ *
+ * Integer, enum and bool keys whose values span a range no longer than each thread's share of the input (and at most
+ * 4M values) are counted in flat arrays instead of a hash map, see detail::count_into_tables; other keys are counted
+ * in per-thread unordered_maps that are merged at the end. Large inputs are split across threads.
+ *
+ * @tparam KeyFunc Callable taking a const T& and returning the key; called concurrently.
+ * @return std::unordered_map from each key that occurs to its number of occurrences.
+ *
+ * @example
+ * @code
+ * auto per_level = count_by(log_entries, [](const Entry &e) { return e.level; });
+ * @endcode
+ */
+template <typename T, typename KeyFunc>
+auto count_by(const std::vector<T> &vec, KeyFunc key_func, parallel_options options = {}) {
+    using Key = std::decay_t<std::invoke_result_t<KeyFunc &, const T &>>;
+    std::unordered_map<Key, std::size_t> counts;
+    if (vec.empty())
+        return counts;
+    const std::size_t n = vec.size();
+    const std::size_t threads = n < options.min_parallel_size ? 1 : detail::resolved_thread_count(options.threads);
+
+    if constexpr (std::is_integral_v<Key> || std::is_enum_v<Key>) {
+        using U = decltype(detail::radix_key(std::declval<Key>()));
+        U lo = 0;
+        U hi = std::numeric_limits<U>::max();
+        if constexpr (sizeof(U) > 1) { // 8 bit keys are counted over their whole domain without a bounds pass
+            std::vector<std::pair<U, U>> bounds(threads);
+            parallel_for_chunks(
+                threads,
+                [&](std::size_t p) {
+                    // four independent running minima and maxima, so consecutive elements do not wait on each other
+                    std::array<U, 4> part_lo, part_hi;
+                    part_lo.fill(std::numeric_limits<U>::max());
+                    part_hi.fill(0);
+                    const std::size_t last = (p + 1) * n / threads;
+                    for (std::size_t i = p * n / threads; i < last; ++i) {
+                        const U k = detail::radix_key(key_func(vec[i]));
+                        part_lo[i % 4] = std::min(part_lo[i % 4], k);
+                        part_hi[i % 4] = std::max(part_hi[i % 4], k);
+                    }
+                    bounds[p] = {*std::min_element(part_lo.begin(), part_lo.end()),
+                                 *std::max_element(part_hi.begin(), part_hi.end())};
+                },
+                threads);
+            lo = std::numeric_limits<U>::max();
+            hi = 0;
+            for (const auto &[part_lo, part_hi] : bounds) {
+                lo = std::min(lo, part_lo);
+                hi = std::max(hi, part_hi);
+            }
+        }
+
+        // a dense table per thread no larger than that thread's share of the input (up to 4M bins) is cheaper than
+        // hashing every element; tiny inputs with widely spread keys are hashed
+        const std::size_t dense_limit = std::max<std::size_t>(256, std::min<std::size_t>(n / threads, 1 << 22));
+        if (static_cast<std::uint64_t>(hi - lo) < dense_limit) {
+            const std::size_t range = static_cast<std::size_t>(hi - lo) + 1;
+            const auto index_of = [&](std::size_t i) {
+                return static_cast<std::size_t>(detail::radix_key(key_func(vec[i])) - lo);
+            };
+            const auto table = detail::parallel_count_dense(n, range, index_of, options);
+            for (std::size_t b = 0; b < range; ++b)
+                if (table[b] != 0)
+                    counts.emplace(detail::from_radix_key<Key>(static_cast<U>(lo + b)), table[b]);
+            return counts;
+        }
+    }
+
+    std::vector<std::unordered_map<Key, std::size_t>> partial(threads);
+    parallel_for_chunks(
+        threads,
+        [&](std::size_t p) {
+            for (std::size_t i = p * n / threads, last = (p + 1) * n / threads; i < last; ++i)
+                ++partial[p][key_func(vec[i])];
+        },
+        threads);
+    auto largest = std::max_element(partial.begin(), partial.end(),
+                                    [](const auto &a, const auto &b) { return a.size() < b.size(); });
+    counts = std::move(*largest);
+    for (auto part = partial.begin(); part != partial.end(); ++part)
+        if (part != largest)
+            for (const auto &[key, count] : *part)
+                counts[key] += count;
+    return counts;
+}
+
+/**
+ * @brief Count the occurrences of each value in [0, bins) of a vector of small non negative integers (like
+ * numpy.bincount), using the same multi-table counting as count_by.
+ *
+ * @return std::vector<std::size_t> of size bins; element b is the number of elements equal to b.
+ *
+ * @throws std::out_of_range if an element is negative or not less than bins.
+ */
+template <typename T, typename = std::enable_if_t<std::is_integral_v<T> || std::is_enum_v<T>>>
+std::vector<std::size_t> histogram(const std::vector<T> &vec, std::size_t bins, parallel_options options = {}) {
+    const std::size_t overflow_bin = bins;
+    auto counts = detail::parallel_count_dense(
+        vec.size(), bins + 1,
+        [&](std::size_t i) {
+            const long long value = detail::dense_key_to_integer(vec[i]);
+            return value >= 0 && static_cast<unsigned long long>(value) < bins ? static_cast<std::size_t>(value)
+                                                                                : overflow_bin;
+        },
+        options);
+    if (counts[overflow_bin] != 0)
+        throw std::out_of_range("histogram value outside [0, bins)");
+    counts.pop_back();
+    return counts;
+}
+
+/**
+ * @brief Count the elements falling into each of bins equal width bins covering [lo, hi).
+ *
+ * Elements outside [lo, hi), and NaNs, are not counted.
+ *
+ * @return std::vector<std::size_t> of size bins.
+ *
+ * @throws std::invalid_argument if bins is 0 or lo < hi does not hold.
  */
-template <typename Key, typename Value1, typename Value2,
-          typename ResultType = decltype(std::declval<Value1>() + std::declval<Value2>()), typename Func>
-std::unordered_map<Key, ResultType> combine_maps(const std::unordered_map<Key, Value1> &map1,
-                                                 const std::unordered_map<Key, Value2> &map2, Func func) {
-    if (map1.size() != map2.size()) {
-        throw std::invalid_argument("Maps do not have the same number of elements");
-    }
+template <typename T, typename = std::enable_if_t<std::is_arithmetic_v<T>>>
+std::vector<std::size_t> histogram(const std::vector<T> &vec, std::size_t bins, double lo, double hi,
+                                   parallel_options options = {}) {
+    if (bins == 0 || !(lo < hi))
+        throw std::invalid_argument("histogram needs at least one bin and lo < hi");
+    const double scale = static_cast<double>(bins) / (hi - lo);
+    const std::size_t outside_bin = bins;
+    auto counts = detail::parallel_count_dense(
+        vec.size(), bins + 1,
+        [&](std::size_t i) {
+            const double x = static_cast<double>(vec[i]);
+            if (!(x >= lo && x < hi))
+                return outside_bin;
+            // rounding can put values just below hi into bin number bins
+            return std::min(static_cast<std::size_t>((x - lo) * scale), bins - 1);
+        },
+        options);
+    counts.pop_back();
+    return counts;
+}
 
-    std::unordered_map<Key, ResultType> result;
+// endfold
 
-    for (const auto &pair : map1) {
-        const Key &key = pair.first;
-        auto it2 = map2.find(key);
-        if (it2 == map2.end()) {
-            throw std::invalid_argument("Keysets of the maps do not match");
+// startfold reductions
+
+/**
+ * @brief What the reductions do with floating point NaNs.
+ *
+ * propagate (the default, as in numpy) makes any NaN the result, and argmin/argmax then return the index of the first
+ * NaN; omit ignores NaNs, so a vector of only NaNs is treated like an empty one.
+ */
+enum class nan_policy { omit, propagate };
+
+namespace detail {
+
+template <typename V> bool is_nan_value(const V &value) {
+    if constexpr (std::is_floating_point_v<V>)
+        return value != value;
+    else
+        return false;
+}
+
+/**
+ * @brief Smallest and largest non NaN value of a range, and whether it held any NaN or any non NaN value.
+ */
+template <typename T> struct minmax_scan {
+    T lo{};
+    T hi{};
+    bool any_ordered = false;
+    bool any_nan = false;
+
+    void add(T x) {
+        if (is_nan_value(x)) {
+            any_nan = true;
+        } else if (!any_ordered) {
+            lo = hi = x;
+            any_ordered = true;
+        } else {
+            lo = x < lo ? x : lo;
+            hi = hi < x ? x : hi;
         }
-        result[key] = func(pair.second, it2->second);
     }
+};
 
+template <typename T> minmax_scan<T> scan_minmax(const T *data, std::size_t n) {
+    minmax_scan<T> result;
+    for (std::size_t i = 0; i < n; ++i)
+        result.add(data[i]);
     return result;
 }
 
+#if defined(__SSE2__)
 /**
- * @brief Filters two maps to only include entries with keys that exist in both maps.
- *
- * This function takes two maps of the same type and returns a pair of maps where
- * each map only contains the keys that are present in both input maps.
- *
- * @tparam MapType The type of the input maps. Must support `key_type`, iteration,
- * and lookup operations. Typically `std::unordered_map` or `std::map`.
- *
- * @param map1 The first input map.
- * @param map2 The second input map.
- * @return A `std::pair` of filtered maps `{filtered_map1, filtered_map2}` where:
- *   - `filtered_map1` contains only the entries from `map1` whose keys exist in `map2`.
- *   - `filtered_map2` contains only the entries from `map2` whose keys exist in `map1`.
- *
- * @note Requires helper functions:
- *   - `keys(const MapType&)` that returns a container of keys in the map.
- *   - `filter_map_by_key_set(const MapType&, const std::unordered_set<typename MapType::key_type>&)`
- *     that returns a map containing only the specified keys.
+ * @brief Fold the lanes of the vector accumulators and the scalar tail into one minmax_scan.
  */
-template <typename MapType>
-std::pair<MapType, MapType> filter_maps_to_shared_keys(const MapType &map1, const MapType &map2) {
-    auto keys1 = keys(map1);
-    auto keys2 = keys(map2);
+template <typename T, std::size_t Lanes>
+minmax_scan<T> finish_minmax(const T (&lo)[Lanes], const T (&hi)[Lanes], bool any_ordered, bool any_nan,
+                             const T *tail, std::size_t tail_size) {
+    // a lane that only saw NaNs still holds its +/-infinity start value, which is harmless as long as lo lanes only
+    // feed the minimum and hi lanes only the maximum
+    minmax_scan<T> result = scan_minmax(tail, tail_size);
+    result.any_nan |= any_nan;
+    if (!any_ordered)
+        return result;
+    T vector_lo = lo[0], vector_hi = hi[0];
+    for (std::size_t lane = 1; lane < Lanes; ++lane) {
+        vector_lo = lo[lane] < vector_lo ? lo[lane] : vector_lo;
+        vector_hi = vector_hi < hi[lane] ? hi[lane] : vector_hi;
+    }
+    result.lo = result.any_ordered && result.lo < vector_lo ? result.lo : vector_lo;
+    result.hi = result.any_ordered && vector_hi < result.hi ? result.hi : vector_hi;
+    result.any_ordered = true;
+    return result;
+}
 
-    std::unordered_set<typename MapType::key_type> shared_keys;
-    for (auto &k : keys1) {
-        if (keys2.find(k) != keys2.end()) {
-            shared_keys.insert(k);
+// minps/maxps return their second operand when either is NaN, so with the accumulator second NaNs are skipped; the
+// NaN and non NaN lanes seen are tracked separately with unordered/ordered compares
+inline minmax_scan<float> scan_minmax(const float *data, std::size_t n) {
+    __m128 lo = _mm_set1_ps(std::numeric_limits<float>::infinity());
+    __m128 hi = _mm_set1_ps(-std::numeric_limits<float>::infinity());
+    __m128 ordered = _mm_setzero_ps();
+    __m128 unordered = _mm_setzero_ps();
+    std::size_t i = 0;
+    for (const std::size_t vector_end = n - n % 4; i < vector_end; i += 4) {
+        const __m128 x = _mm_loadu_ps(data + i);
+        lo = _mm_min_ps(x, lo);
+        hi = _mm_max_ps(x, hi);
+        ordered = _mm_or_ps(ordered, _mm_cmpord_ps(x, x));
+        unordered = _mm_or_ps(unordered, _mm_cmpunord_ps(x, x));
+    }
+    float lo_lanes[4], hi_lanes[4];
+    _mm_storeu_ps(lo_lanes, lo);
+    _mm_storeu_ps(hi_lanes, hi);
+    return finish_minmax(lo_lanes, hi_lanes, _mm_movemask_ps(ordered) != 0, _mm_movemask_ps(unordered) != 0, data + i,
+                         n - i);
+}
+
+inline minmax_scan<double> scan_minmax(const double *data, std::size_t n) {
+    __m128d lo = _mm_set1_pd(std::numeric_limits<double>::infinity());
+    __m128d hi = _mm_set1_pd(-std::numeric_limits<double>::infinity());
+    __m128d ordered = _mm_setzero_pd();
+    __m128d unordered = _mm_setzero_pd();
+    std::size_t i = 0;
+    for (const std::size_t vector_end = n - n % 2; i < vector_end; i += 2) {
+        const __m128d x = _mm_loadu_pd(data + i);
+        lo = _mm_min_pd(x, lo);
+        hi = _mm_max_pd(x, hi);
+        ordered = _mm_or_pd(ordered, _mm_cmpord_pd(x, x));
+        unordered = _mm_or_pd(unordered, _mm_cmpunord_pd(x, x));
+    }
+    double lo_lanes[2], hi_lanes[2];
+    _mm_storeu_pd(lo_lanes, lo);
+    _mm_storeu_pd(hi_lanes, hi);
+    return finish_minmax(lo_lanes, hi_lanes, _mm_movemask_pd(ordered) != 0, _mm_movemask_pd(unordered) != 0, data + i,
+                         n - i);
+}
+
+inline minmax_scan<std::int32_t> scan_minmax(const std::int32_t *data, std::size_t n) {
+    // SSE2 has no 32 bit integer min/max, so select with a compare mask
+    __m128i lo = _mm_set1_epi32(std::numeric_limits<std::int32_t>::max());
+    __m128i hi = _mm_set1_epi32(std::numeric_limits<std::int32_t>::min());
+    std::size_t i = 0;
+    for (const std::size_t vector_end = n - n % 4; i < vector_end; i += 4) {
+        const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+        const __m128i below = _mm_cmplt_epi32(x, lo);
+        lo = _mm_or_si128(_mm_and_si128(below, x), _mm_andnot_si128(below, lo));
+        const __m128i above = _mm_cmpgt_epi32(x, hi);
+        hi = _mm_or_si128(_mm_and_si128(above, x), _mm_andnot_si128(above, hi));
+    }
+    std::int32_t lo_lanes[4], hi_lanes[4];
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(lo_lanes), lo);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(hi_lanes), hi);
+    return finish_minmax(lo_lanes, hi_lanes, i > 0, false, data + i, n - i);
+}
+#endif
+
+/**
+ * @brief Index of the first smallest (Max = false) or largest (Max = true) of get(0) ... get(n - 1).
+ */
+template <bool Max, typename Get>
+std::optional<std::size_t> arg_extreme(std::size_t n, Get &&get, nan_policy nan) {
+    using V = std::decay_t<decltype(get(std::size_t{0}))>;
+    std::optional<std::size_t> best;
+    std::optional<V> best_value;
+    for (std::size_t i = 0; i < n; ++i) {
+        V value = get(i);
+        if (is_nan_value(value)) {
+            if (nan == nan_policy::propagate)
+                return i;
+            continue;
+        }
+        if (!best_value || (Max ? *best_value < value : value < *best_value)) {
+            best = i;
+            best_value = std::move(value);
         }
     }
+    return best;
+}
 
-    MapType filtered_map1 = filter_map_by_key_set(map1, shared_keys);
-    MapType filtered_map2 = filter_map_by_key_set(map2, shared_keys);
+/**
+ * @brief argmin/argmax of an arithmetic vector: find the extreme value with scan_minmax, then the first index holding
+ * it.
+ */
+template <bool Max, typename T> std::optional<std::size_t> arg_extreme(const std::vector<T> &vec, nan_policy nan) {
+    const auto scan = scan_minmax(vec.data(), vec.size());
+    if (nan == nan_policy::propagate && scan.any_nan)
+        return static_cast<std::size_t>(
+            std::find_if(vec.begin(), vec.end(), [](const T &x) { return is_nan_value(x); }) - vec.begin());
+    if (!scan.any_ordered)
+        return std::nullopt;
+    const T target = Max ? scan.hi : scan.lo;
+    return static_cast<std::size_t>(std::find(vec.begin(), vec.end(), target) - vec.begin());
+}
 
-    return {filtered_map1, filtered_map2};
+template <typename T>
+using sum_type_t = std::conditional_t<std::is_floating_point_v<T>, std::common_type_t<T, double>,
+                                      std::conditional_t<std::is_signed_v<T>, long long, unsigned long long>>;
+
+/**
+ * @brief Sum and number of summed (non omitted) values of get(0) ... get(n - 1), with four independent accumulators
+ * so the additions do not form one long dependency chain.
+ */
+template <typename Get> auto sum_and_count(std::size_t n, Get &&get, nan_policy nan) {
+    using S = sum_type_t<std::decay_t<decltype(get(std::size_t{0}))>>;
+    S partial[4] = {S(0), S(0), S(0), S(0)};
+    std::size_t counted = 0;
+    for (std::size_t i = 0; i < n; ++i) {
+        const S value = static_cast<S>(get(i));
+        if (nan == nan_policy::omit && is_nan_value(value))
+            continue;
+        partial[i % 4] += value;
+        ++counted;
+    }
+    return std::pair<S, std::size_t>((partial[0] + partial[1]) + (partial[2] + partial[3]), counted);
 }
 
+} // namespace detail
+
 /**
- * @brief Extracts all values from an unordered_map into a vector.
- *
- * @tparam Key Type of the keys in the map.
- * @tparam Value Type of the values in the map.
- * @param map The unordered_map to extract values from.
- * @return std::vector<Value> A vector containing all values from the map.
+ * @brief Smallest element of an arithmetic vector, SIMD accelerated for float, double and int32.
  *
- * @note The order of values in the resulting vector is unspecified because
- *       unordered_map does not guarantee ordering.
+ * @return The minimum, std::nullopt if there is no (non NaN) element, or NaN if nan is propagate and one occurs.
  */
-template <typename Key, typename Value> std::vector<Value> values(const std::unordered_map<Key, Value> &map) {
-    std::vector<Value> values;
-    values.reserve(map.size()); // optional: reserve space for efficiency
-    for (const auto &pair : map) {
-        values.push_back(pair.second);
-    }
-    return values;
+template <typename T, typename = std::enable_if_t<std::is_arithmetic_v<T>>>
+std::optional<T> min_value(const std::vector<T> &vec, nan_policy nan = nan_policy::propagate) {
+    const auto scan = detail::scan_minmax(vec.data(), vec.size());
+    if (nan == nan_policy::propagate && scan.any_nan)
+        return std::numeric_limits<T>::quiet_NaN();
+    if (!scan.any_ordered)
+        return std::nullopt;
+    return scan.lo;
 }
 
 /**
- * @brief Extracts all keys from an unordered_map into a vector.
+ * @brief Largest element of an arithmetic vector; see min_value.
+ */
+template <typename T, typename = std::enable_if_t<std::is_arithmetic_v<T>>>
+std::optional<T> max_value(const std::vector<T> &vec, nan_policy nan = nan_policy::propagate) {
+    const auto scan = detail::scan_minmax(vec.data(), vec.size());
+    if (nan == nan_policy::propagate && scan.any_nan)
+        return std::numeric_limits<T>::quiet_NaN();
+    if (!scan.any_ordered)
+        return std::nullopt;
+    return scan.hi;
+}
+
+/**
+ * @brief Smallest and largest element of an arithmetic vector in a single pass; see min_value.
+ */
+template <typename T, typename = std::enable_if_t<std::is_arithmetic_v<T>>>
+std::optional<std::pair<T, T>> minmax_values(const std::vector<T> &vec, nan_policy nan = nan_policy::propagate) {
+    const auto scan = detail::scan_minmax(vec.data(), vec.size());
+    if (nan == nan_policy::propagate && scan.any_nan)
+        return std::pair<T, T>(std::numeric_limits<T>::quiet_NaN(), std::numeric_limits<T>::quiet_NaN());
+    if (!scan.any_ordered)
+        return std::nullopt;
+    return std::pair<T, T>(scan.lo, scan.hi);
+}
+
+/**
+ * @brief Index of the first smallest element of an arithmetic vector, like std::min_element but SIMD accelerated.
  *
- * @tparam Key Type of the keys in the map.
- * @tparam Value Type of the values in the map.
- * @param map The unordered_map to extract keys from.
- * @return std::vector<Key> A vector containing all keys from the map.
+ * @return The index, or std::nullopt if there is no (non NaN) element.
+ */
+template <typename T, typename = std::enable_if_t<std::is_arithmetic_v<T>>>
+std::optional<std::size_t> argmin(const std::vector<T> &vec, nan_policy nan = nan_policy::propagate) {
+    return detail::arg_extreme<false>(vec, nan);
+}
+
+/**
+ * @brief Index of the first largest element of an arithmetic vector; see argmin.
+ */
+template <typename T, typename = std::enable_if_t<std::is_arithmetic_v<T>>>
+std::optional<std::size_t> argmax(const std::vector<T> &vec, nan_policy nan = nan_policy::propagate) {
+    return detail::arg_extreme<true>(vec, nan);
+}
+
+/**
+ * @brief Index of the element with the smallest key_func(element), e.g. the lowest scoring record.
+ */
+template <typename T, typename KeyFunc>
+std::optional<std::size_t> argmin_by(const std::vector<T> &vec, KeyFunc key_func,
+                                     nan_policy nan = nan_policy::propagate) {
+    return detail::arg_extreme<false>(vec.size(), [&](std::size_t i) { return key_func(vec[i]); }, nan);
+}
+
+/**
+ * @brief Index of the element with the largest key_func(element), e.g. the best scoring record.
+ */
+template <typename T, typename KeyFunc>
+std::optional<std::size_t> argmax_by(const std::vector<T> &vec, KeyFunc key_func,
+                                     nan_policy nan = nan_policy::propagate) {
+    return detail::arg_extreme<true>(vec.size(), [&](std::size_t i) { return key_func(vec[i]); }, nan);
+}
+
+/**
+ * @brief Sum of an arithmetic vector, accumulated in double for floating point and in 64 bits for integers.
+ */
+template <typename T, typename = std::enable_if_t<std::is_arithmetic_v<T>>>
+detail::sum_type_t<T> sum(const std::vector<T> &vec, nan_policy nan = nan_policy::propagate) {
+    return detail::sum_and_count(vec.size(), [&](std::size_t i) { return vec[i]; }, nan).first;
+}
+
+/**
+ * @brief Sum of key_func(element) over a vector.
+ */
+template <typename T, typename KeyFunc>
+auto sum_by(const std::vector<T> &vec, KeyFunc key_func, nan_policy nan = nan_policy::propagate) {
+    return detail::sum_and_count(vec.size(), [&](std::size_t i) { return key_func(vec[i]); }, nan).first;
+}
+
+/**
+ * @brief Arithmetic mean of a vector; with nan_policy::omit, NaNs count neither towards the sum nor the length.
  *
- * @note The order of keys in the resulting vector is unspecified because
- *       unordered_map does not guarantee ordering.
+ * @return The mean, or std::nullopt if nothing was averaged.
  */
-template <typename Key, typename Value> std::vector<Key> keys(const std::unordered_map<Key, Value> &map) {
-    std::vector<Key> keys;
-    keys.reserve(map.size()); // optional: reserve space for efficiency
-    for (const auto &pair : map) {
-        keys.push_back(pair.first);
+template <typename T, typename = std::enable_if_t<std::is_arithmetic_v<T>>>
+std::optional<double> mean(const std::vector<T> &vec, nan_policy nan = nan_policy::propagate) {
+    const auto [total, counted] = detail::sum_and_count(vec.size(), [&](std::size_t i) { return vec[i]; }, nan);
+    if (counted == 0)
+        return std::nullopt;
+    return static_cast<double>(total) / static_cast<double>(counted);
+}
+
+/**
+ * @brief Mean of key_func(element) over a vector; see mean.
+ */
+template <typename T, typename KeyFunc>
+std::optional<double> mean_by(const std::vector<T> &vec, KeyFunc key_func, nan_policy nan = nan_policy::propagate) {
+    const auto [total, counted] =
+        detail::sum_and_count(vec.size(), [&](std::size_t i) { return key_func(vec[i]); }, nan);
+    if (counted == 0)
+        return std::nullopt;
+    return static_cast<double>(total) / static_cast<double>(counted);
+}
+
+namespace detail {
+
+template <bool Max, typename Map, typename KeyFunc>
+std::optional<typename Map::key_type> key_of_extreme_value(const Map &map, KeyFunc &key_func, nan_policy nan) {
+    using V = std::decay_t<decltype(key_func(map.begin()->second))>;
+    const typename Map::value_type *best = nullptr;
+    std::optional<V> best_value;
+    for (const auto &entry : map) {
+        V value = key_func(entry.second);
+        if (is_nan_value(value)) {
+            if (nan == nan_policy::propagate)
+                return entry.first;
+            continue;
+        }
+        if (!best_value || (Max ? *best_value < value : value < *best_value)) {
+            best = &entry;
+            best_value = std::move(value);
+        }
     }
-    return keys;
+    if (!best)
+        return std::nullopt;
+    return best->first;
 }
 
-// endfold
+template <typename F> inline constexpr bool is_key_func_v = !std::is_same_v<std::decay_t<F>, nan_policy>;
 
-// startfold sets
+} // namespace detail
 
 /**
- * @brief Converts a vector into a set, removing duplicates.
- *
- * @tparam T Type of the elements in the vector.
- * @param vec The vector to convert.
- * @return std::set<T> A set containing all unique elements from the vector.
+ * @brief Key of the entry with the smallest value, found by iterating the map directly instead of copying values().
  *
- * @note The elements in the set are sorted because std::set maintains order.
+ * @return The key, or std::nullopt if the map has no (non NaN) value. With nan_policy::propagate, the key of the first
+ * NaN value visited.
  */
-template <typename T> std::set<T> to_set(const std::vector<T> &vec) { return std::set<T>(vec.begin(), vec.end()); }
+template <typename Map>
+std::optional<typename Map::key_type> key_of_min_value(const Map &map, nan_policy nan = nan_policy::propagate) {
+    auto identity = [](const auto &value) -> const auto & { return value; };
+    return detail::key_of_extreme_value<false>(map, identity, nan);
+}
 
 /**
- * @brief Converts a vector into an unordered_set, removing duplicates.
- *
- * @tparam T Type of the elements in the vector.
- * @param vec The vector to convert.
- * @return std::unordered_set<T> An unordered_set containing all unique elements from the vector.
- *
- * @note The elements in the unordered_set are not sorted.
+ * @brief Key of the entry with the largest value; see key_of_min_value.
  */
-template <typename T> std::unordered_set<T> to_unordered_set(const std::vector<T> &vec) {
-    return std::unordered_set<T>(vec.begin(), vec.end());
+template <typename Map>
+std::optional<typename Map::key_type> key_of_max_value(const Map &map, nan_policy nan = nan_policy::propagate) {
+    auto identity = [](const auto &value) -> const auto & { return value; };
+    return detail::key_of_extreme_value<true>(map, identity, nan);
 }
 
 /**
- * @brief Computes the intersection of two sets.
- *
- * @tparam SetType Type of the input sets (std::set or std::unordered_set).
- * @param a First set.
- * @param b Second set.
- * @return SetType A new set containing elements present in both input sets.
+ * @brief Key of the entry whose value has the smallest key_func(value), e.g. the id of the lowest scoring record.
+ */
+template <typename Map, typename KeyFunc, typename = std::enable_if_t<detail::is_key_func_v<KeyFunc>>>
+std::optional<typename Map::key_type> key_of_min_value(const Map &map, KeyFunc key_func,
+                                                       nan_policy nan = nan_policy::propagate) {
+    return detail::key_of_extreme_value<false>(map, key_func, nan);
+}
+
+/**
+ * @brief Key of the entry whose value has the largest key_func(value), e.g. the id of the best scoring record.
+ */
+template <typename Map, typename KeyFunc, typename = std::enable_if_t<detail::is_key_func_v<KeyFunc>>>
+std::optional<typename Map::key_type> key_of_max_value(const Map &map, KeyFunc key_func,
+                                                       nan_policy nan = nan_policy::propagate) {
+    return detail::key_of_extreme_value<true>(map, key_func, nan);
+}
+
+// endfold
+
+// startfold comparisons
+
+/**
+ * @brief Whether two T compare equal exactly when their bytes do, which lets the comparisons use memcmp and SIMD
+ * byte compares.
  *
- * @note For std::set, the result will be ordered. For std::unordered_set, order is unspecified.
+ * True for integers, enums and pointers. Specialize it to std::true_type for a struct whose operator== compares every
+ * member and whose members are themselves bitwise comparable; it is ignored for types with padding bits.
  */
-template <typename SetType> SetType set_intersection(const SetType &a, const SetType &b) {
-    SetType result;
+template <typename T>
+struct is_bitwise_comparable : std::bool_constant<std::is_scalar_v<T> && !std::is_floating_point_v<T>> {};
 
-    if constexpr (std::is_same_v<SetType, std::set<typename SetType::value_type>>) {
-        // use std::set_intersection for ordered sets
-        std::set_intersection(a.begin(), a.end(), b.begin(), b.end(), std::inserter(result, result.begin()));
+namespace detail {
+
+template <typename T>
+inline constexpr bool bitwise_comparable_v =
+    is_bitwise_comparable<T>::value && std::has_unique_object_representations_v<T>;
+
+#if defined(__SSE2__)
+/**
+ * @brief Compare x and y as Size byte elements, giving all ones bytes for equal elements and zero bytes otherwise.
+ */
+template <std::size_t Size> __m128i equal_elements_mask(__m128i x, __m128i y) {
+    if constexpr (Size == 1) {
+        return _mm_cmpeq_epi8(x, y);
+    } else if constexpr (Size == 2) {
+        return _mm_cmpeq_epi16(x, y);
+    } else if constexpr (Size == 4) {
+        return _mm_cmpeq_epi32(x, y);
     } else {
-        // Fallback for unordered_set or other sets
-        for (const auto &elem : a) {
-            if (b.count(elem)) {
-                result.insert(elem);
-            }
+        // SSE2 has no 64 bit compare: both 32 bit halves have to match
+        const __m128i halves = _mm_cmpeq_epi32(x, y);
+        return _mm_and_si128(halves, _mm_shuffle_epi32(halves, _MM_SHUFFLE(2, 3, 0, 1)));
+    }
+}
+#endif
+
+/**
+ * @brief Index of the first i < n with a[i] != b[i], or n if the ranges are equal.
+ */
+template <typename T> std::size_t first_mismatch_index(const T *a, const T *b, std::size_t n) {
+    std::size_t i = 0;
+    if constexpr (bitwise_comparable_v<T>) {
+        // memcmp finds the differing block, the element loop only runs inside it
+        constexpr std::size_t block = std::max<std::size_t>(1, 256 / sizeof(T));
+        for (; i < n; i += block)
+            if (std::memcmp(a + i, b + i, std::min(block, n - i) * sizeof(T)) != 0)
+                break;
+        for (; i < n; ++i)
+            if (std::memcmp(a + i, b + i, sizeof(T)) != 0)
+                return i;
+        return n;
+    }
+#if defined(__SSE2__)
+    else if constexpr (std::is_same_v<T, float>) {
+        for (const std::size_t vector_end = n - n % 4; i < vector_end; i += 4) {
+            const int equal = _mm_movemask_ps(_mm_cmpeq_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+            if (equal != 0xF)
+                return i + count_trailing_zeros(static_cast<std::uint64_t>(~equal & 0xF));
+        }
+    } else if constexpr (std::is_same_v<T, double>) {
+        for (const std::size_t vector_end = n - n % 2; i < vector_end; i += 2) {
+            const int equal = _mm_movemask_pd(_mm_cmpeq_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+            if (equal != 0x3)
+                return i + count_trailing_zeros(static_cast<std::uint64_t>(~equal & 0x3));
         }
     }
+#endif
+    for (; i < n; ++i)
+        if (!(a[i] == b[i]))
+            return i;
+    return n;
+}
 
-    return result;
+/**
+ * @brief Number of i < n with a[i] != b[i].
+ */
+template <typename T> std::size_t count_mismatches_in(const T *a, const T *b, std::size_t n) {
+    std::size_t i = 0;
+    std::size_t mismatches = 0;
+#if defined(__SSE2__)
+    constexpr bool bytes_vectorize = bitwise_comparable_v<T> && (sizeof(T) == 1 || sizeof(T) == 2 ||
+                                                                 sizeof(T) == 4 || sizeof(T) == 8);
+    if constexpr (bytes_vectorize || std::is_same_v<T, float> || std::is_same_v<T, double>) {
+        // psadbw adds up the all ones bytes of the equal elements into 64 bit lanes, so the counts never overflow
+        constexpr std::size_t per_vector = 16 / sizeof(T);
+        const __m128i zero = _mm_setzero_si128();
+        __m128i equal_bytes = zero;
+        for (const std::size_t vector_end = n - n % per_vector; i < vector_end; i += per_vector) {
+            __m128i equal;
+            if constexpr (std::is_same_v<T, float>)
+                equal = _mm_castps_si128(_mm_cmpeq_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+            else if constexpr (std::is_same_v<T, double>)
+                equal = _mm_castpd_si128(_mm_cmpeq_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+            else
+                equal = equal_elements_mask<sizeof(T)>(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i)),
+                                                       _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i)));
+            equal_bytes = _mm_add_epi64(equal_bytes, _mm_sad_epu8(equal, zero));
+        }
+        std::uint64_t lanes[2];
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), equal_bytes);
+        mismatches = i - static_cast<std::size_t>((lanes[0] + lanes[1]) / (255 * sizeof(T)));
+    }
+#endif
+    for (; i < n; ++i)
+        mismatches += !(a[i] == b[i]);
+    return mismatches;
+}
+
+template <typename T> int three_way_compare(const T &a, const T &b) { return a < b ? -1 : b < a ? 1 : 0; }
+
+// std::vector<bool> has no contiguous storage to compare
+template <typename T> using enable_if_not_bool_t = std::enable_if_t<!std::is_same_v<T, bool>>;
+
+inline std::size_t comparison_chunk_count(std::size_t n, const parallel_options &options) {
+    return n < options.min_parallel_size ? 1 : std::min(std::max<std::size_t>(options.chunks, 1), n);
+}
+
+} // namespace detail
+
+/**
+ * @brief Whether two vectors have the same size and equal elements, using a single memcmp for bitwise comparable
+ * types and SIMD compares for float and double.
+ */
+template <typename T, typename = detail::enable_if_not_bool_t<T>>
+bool vectors_equal(const std::vector<T> &a, const std::vector<T> &b) {
+    if (a.size() != b.size())
+        return false;
+    if (a.empty())
+        return true;
+    if constexpr (detail::bitwise_comparable_v<T>)
+        return std::memcmp(a.data(), b.data(), a.size() * sizeof(T)) == 0;
+    else
+        return detail::first_mismatch_index(a.data(), b.data(), a.size()) == a.size();
+}
+
+/**
+ * @brief Index of the first element where two vectors differ.
+ *
+ * @return The index, the length of the shorter vector if it is a prefix of the longer one, or std::nullopt if the
+ * vectors are equal.
+ */
+template <typename T, typename = detail::enable_if_not_bool_t<T>>
+std::optional<std::size_t> first_mismatch(const std::vector<T> &a, const std::vector<T> &b) {
+    const std::size_t common = std::min(a.size(), b.size());
+    const std::size_t index = detail::first_mismatch_index(a.data(), b.data(), common);
+    if (index == common && a.size() == b.size())
+        return std::nullopt;
+    return index;
+}
+
+/**
+ * @brief Number of positions where two vectors differ; the elements past the end of the shorter vector all count as
+ * differing.
+ */
+template <typename T, typename = detail::enable_if_not_bool_t<T>>
+std::size_t count_mismatches(const std::vector<T> &a, const std::vector<T> &b) {
+    const std::size_t common = std::min(a.size(), b.size());
+    return detail::count_mismatches_in(a.data(), b.data(), common) + (std::max(a.size(), b.size()) - common);
+}
+
+/**
+ * @brief Lexicographic three way comparison of two vectors, found through first_mismatch so only the first
+ * differing element is compared with operator<.
+ *
+ * @return A negative value if a sorts before b, zero if they are equal and a positive value otherwise.
+ */
+template <typename T, typename = detail::enable_if_not_bool_t<T>>
+int compare_vectors(const std::vector<T> &a, const std::vector<T> &b) {
+    const std::size_t common = std::min(a.size(), b.size());
+    if constexpr (std::is_same_v<T, unsigned char>) {
+        // memcmp orders unsigned bytes exactly like operator<
+        const int result = common == 0 ? 0 : std::memcmp(a.data(), b.data(), common);
+        if (result != 0)
+            return result < 0 ? -1 : 1;
+    } else {
+        // elements that differ but are unordered, like NaNs, are skipped as std::lexicographical_compare does
+        for (std::size_t i = 0; (i += detail::first_mismatch_index(a.data() + i, b.data() + i, common - i)) < common;
+             ++i)
+            if (const int order = detail::three_way_compare(a[i], b[i]); order != 0)
+                return order;
+    }
+    return detail::three_way_compare(a.size(), b.size());
+}
+
+/**
+ * @brief vectors_equal split over parallel_for_chunks for very large buffers; chunks stop early once any chunk has
+ * found a difference.
+ */
+template <typename T, typename = detail::enable_if_not_bool_t<T>>
+bool parallel_vectors_equal(const std::vector<T> &a, const std::vector<T> &b, parallel_options options = {}) {
+    if (a.size() != b.size())
+        return false;
+    const std::size_t n = a.size();
+    const std::size_t chunk_count = detail::comparison_chunk_count(n, options);
+    if (chunk_count <= 1)
+        return vectors_equal(a, b);
+    std::atomic<bool> differs{false};
+    parallel_for_chunks(
+        chunk_count,
+        [&](std::size_t c) {
+            if (differs.load(std::memory_order_relaxed))
+                return;
+            const std::size_t begin = c * n / chunk_count, end = (c + 1) * n / chunk_count;
+            if (detail::first_mismatch_index(a.data() + begin, b.data() + begin, end - begin) != end - begin)
+                differs.store(true, std::memory_order_relaxed);
+        },
+        options.threads);
+    return !differs.load();
+}
+
+/**
+ * @brief first_mismatch split over parallel_for_chunks; chunks past an already found difference are skipped, and the
+ * result is always the lowest differing index.
+ */
+template <typename T, typename = detail::enable_if_not_bool_t<T>>
+std::optional<std::size_t> parallel_first_mismatch(const std::vector<T> &a, const std::vector<T> &b,
+                                                   parallel_options options = {}) {
+    const std::size_t common = std::min(a.size(), b.size());
+    const std::size_t chunk_count = detail::comparison_chunk_count(common, options);
+    if (chunk_count <= 1)
+        return first_mismatch(a, b);
+    std::atomic<std::size_t> found{common};
+    parallel_for_chunks(
+        chunk_count,
+        [&](std::size_t c) {
+            const std::size_t begin = c * common / chunk_count, end = (c + 1) * common / chunk_count;
+            if (begin >= found.load(std::memory_order_relaxed))
+                return;
+            const std::size_t index =
+                begin + detail::first_mismatch_index(a.data() + begin, b.data() + begin, end - begin);
+            if (index == end)
+                return;
+            std::size_t current = found.load(std::memory_order_relaxed);
+            while (index < current && !found.compare_exchange_weak(current, index, std::memory_order_relaxed)) {
+            }
+        },
+        options.threads);
+    const std::size_t index = found.load();
+    if (index == common && a.size() == b.size())
+        return std::nullopt;
+    return index;
+}
+
+/**
+ * @brief count_mismatches split over parallel_for_chunks, with the per chunk counts summed afterwards.
+ */
+template <typename T, typename = detail::enable_if_not_bool_t<T>>
+std::size_t parallel_count_mismatches(const std::vector<T> &a, const std::vector<T> &b,
+                                      parallel_options options = {}) {
+    const std::size_t common = std::min(a.size(), b.size());
+    const std::size_t chunk_count = detail::comparison_chunk_count(common, options);
+    if (chunk_count <= 1)
+        return count_mismatches(a, b);
+    std::vector<std::size_t> counts(chunk_count);
+    parallel_for_chunks(
+        chunk_count,
+        [&](std::size_t c) {
+            const std::size_t begin = c * common / chunk_count, end = (c + 1) * common / chunk_count;
+            counts[c] = detail::count_mismatches_in(a.data() + begin, b.data() + begin, end - begin);
+        },
+        options.threads);
+    std::size_t total = std::max(a.size(), b.size()) - common;
+    for (std::size_t count : counts)
+        total += count;
+    return total;
 }
+
 // endfold
 
 }; // namespace collection_utils
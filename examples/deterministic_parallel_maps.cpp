@@ -0,0 +1,86 @@
+// Self-checking example: the parallel unordered_map functions give bitwise identical results for every thread count.
+//
+// g++ -std=c++17 -O2 -pthread -I.. deterministic_parallel_maps.cpp -o deterministic_parallel_maps
+// ./deterministic_parallel_maps    (exits with 1 and names the function on a mismatch)
+
+#include "collection_utils.hpp"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+
+using namespace collection_utils;
+
+namespace {
+
+template <typename T> bool bitwise_equal(const std::vector<T> &a, const std::vector<T> &b) {
+    return a.size() == b.size() && (a.empty() || std::memcmp(a.data(), b.data(), a.size() * sizeof(T)) == 0);
+}
+
+// the entries of a map in its own iteration order, which a differently built map would not share
+std::vector<std::pair<int, double>> entries_in_order(const std::unordered_map<int, double> &map) {
+    return {map.begin(), map.end()};
+}
+
+bool same_entries(const std::vector<std::pair<int, double>> &a, const std::vector<std::pair<int, double>> &b) {
+    if (a.size() != b.size())
+        return false;
+    for (std::size_t i = 0; i < a.size(); ++i)
+        if (a[i].first != b[i].first || std::memcmp(&a[i].second, &b[i].second, sizeof(double)) != 0)
+            return false;
+    return true;
+}
+
+} // namespace
+
+int main() {
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<double> value(-1e6, 1e6);
+    std::unordered_map<int, double> input;
+    while (input.size() < 200000)
+        input.emplace(static_cast<int>(rng()), value(rng));
+
+    const auto transform = [](double v) { return std::sin(v) * 1e-3 + v / 7.0; };
+    std::vector<std::pair<int, double>> reference_mapped;
+    std::vector<double> reference_values;
+    std::vector<int> reference_keys;
+    std::vector<std::pair<int, double>> reference_updated;
+
+    int failures = 0;
+    const auto check = [&](bool same, const char *what, std::size_t threads) {
+        if (!same) {
+            std::printf("%s differs with %zu threads\n", what, threads);
+            ++failures;
+        }
+    };
+
+    for (std::size_t threads : {1, 2, 3, 8, 16}) {
+        parallel_options options;
+        options.threads = threads;
+
+        auto mapped = entries_in_order(parallel_map_values(input, transform, options));
+        auto values = parallel_values(input, options);
+        auto keys = parallel_keys(input, options);
+        auto updated = input;
+        parallel_for_each_pair_in_map(updated, [&](const int &, double &v) { v = transform(v); }, options);
+        auto updated_entries = entries_in_order(updated);
+
+        if (threads == 1) {
+            reference_mapped = std::move(mapped);
+            reference_values = std::move(values);
+            reference_keys = std::move(keys);
+            reference_updated = std::move(updated_entries);
+            continue;
+        }
+        check(same_entries(mapped, reference_mapped), "parallel_map_values", threads);
+        check(bitwise_equal(values, reference_values), "parallel_values", threads);
+        check(bitwise_equal(keys, reference_keys), "parallel_keys", threads);
+        check(same_entries(updated_entries, reference_updated), "parallel_for_each_pair_in_map", threads);
+    }
+
+    if (failures != 0)
+        return 1;
+    std::printf("identical results for 1, 2, 3, 8 and 16 threads\n");
+    return 0;
+}